@@ -0,0 +1,126 @@
+#include "config.h"
+#include "common.h"
+#include "logging.h"
+#include "canvas.h"
+#include "winstar_lcd.h"
+
+
+/* Virtual canvas. Clients draw into a text area larger than the panel,
+ * kept here as display character codes, and move a viewport over it.
+ * Panel rows are rewritten from the canvas on every move; cells which
+ * already show the right character are skipped by the display shadow
+ * copy, so scrolling a list by one line sends only the cells that differ
+ * between neighbouring lines.
+ */
+
+
+struct canvas_t {
+    WinStarLCD *lcd;            // NULL if there is no canvas
+    unsigned rows;
+    unsigned cols;
+    unsigned top;               // Canvas cell shown in the upper left corner
+    unsigned left;
+    uint8_t cells[MAX_CANVAS_ROWS * MAX_CANVAS_COLS];
+};
+
+
+static canvas_t _canvas;
+
+
+/* Copies visible part of canvas rows [from, to) to the panel
+ */
+static void
+redraw(unsigned from, unsigned to)
+{
+    WinStarLCD *lcd = _canvas.lcd;
+    unsigned r, w;
+
+    w = _canvas.cols - _canvas.left;
+    if(w > lcd->cols())
+        w = lcd->cols();
+
+    if(from < _canvas.top)
+        from = _canvas.top;
+    if(to > _canvas.top + lcd->rows())
+        to = _canvas.top + lcd->rows();
+    if(to > _canvas.rows)
+        to = _canvas.rows;
+
+    for(r=from; r<to; ++r)
+        lcd->writeCells(r - _canvas.top, 0, &_canvas.cells[r * _canvas.cols + _canvas.left], w);
+}
+
+
+/* Creates blank canvas of given size, which must not be less than the
+ * panel, and shows its upper left corner. Previous canvas is dropped
+ */
+bool
+canvas_create(WinStarLCD *lcd, unsigned rows, unsigned cols)
+{
+    if(rows < lcd->rows() || cols < lcd->cols() || rows > MAX_CANVAS_ROWS || cols > MAX_CANVAS_COLS)
+        return false;
+
+    _canvas.lcd = lcd;
+    _canvas.rows = rows;
+    _canvas.cols = cols;
+    _canvas.top = 0;
+    _canvas.left = 0;
+    memset(_canvas.cells, ' ', rows * cols);
+
+    redraw(0, rows);
+    return true;
+}
+
+
+/* Forgets the canvas. Panel contents are left intact
+ */
+void
+canvas_drop(WinStarLCD *lcd)
+{
+    if(_canvas.lcd == lcd)
+        _canvas.lcd = NULL;
+}
+
+
+/* Prints UTF-8 text into canvas row, clipped at the end of the row.
+ * Panel is updated if the row is in view
+ */
+bool
+canvas_put(WinStarLCD *lcd, unsigned row, unsigned col, const char *text)
+{
+    if(_canvas.lcd != lcd || row >= _canvas.rows || col >= _canvas.cols)
+        return false;
+
+    lcd->encode(text, strlen(text), &_canvas.cells[row * _canvas.cols + col], _canvas.cols - col);
+    redraw(row, row + 1);
+    return true;
+}
+
+
+/* Moves viewport to given canvas cell, or by given number of cells if
+ * relative is set. Negative column keeps the current one when moving
+ * to absolute position. Position is clamped so the panel stays within
+ * the canvas
+ */
+bool
+canvas_view(WinStarLCD *lcd, int row, int col, bool relative)
+{
+    int top, left;
+
+    if(_canvas.lcd != lcd)
+        return false;
+
+    top = relative ? (int)_canvas.top + row : row;
+    left = relative ? (int)_canvas.left + col : (col < 0 ? (int)_canvas.left : col);
+
+    if(top > (int)(_canvas.rows - lcd->rows()))
+        top = _canvas.rows - lcd->rows();
+    if(left > (int)(_canvas.cols - lcd->cols()))
+        left = _canvas.cols - lcd->cols();
+
+    _canvas.top = top < 0 ? 0 : top;
+    _canvas.left = left < 0 ? 0 : left;
+
+    redraw(_canvas.top, _canvas.top + lcd->rows());
+    return true;
+}
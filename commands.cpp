@@ -0,0 +1,718 @@
+#include "config.h"
+#include "common.h"
+#include "logging.h"
+#include "commands.h"
+#include "displays.h"
+#include "metrics.h"
+#include "schedule.h"
+#include "template.h"
+#include "canvas.h"
+#include "watch.h"
+#include "winstar_lcd.h"
+
+
+typedef void (*cmdfunc_f)(WinStarLCD *, char *);
+
+struct cmd_keyword {
+    const char *kw;
+    cmdfunc_f func;
+};
+
+
+static int _reply_fd = -1;      // Client which sent current command
+static WinStarLCD *_target;     // Display next commands of the client go to
+
+
+/* Sends reply to the client which issued current command. Replies are
+ * dropped for scheduled commands and when client does not read them
+ */
+static void
+reply(const char *buf, size_t len)
+{
+    ssize_t n;
+
+    if(-1 == _reply_fd)
+        return;
+
+    n = send(_reply_fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(n < (ssize_t)len)
+        WARN_RL("Reply to fd %d truncated (%d of %u bytes)", _reply_fd, (int)n, (unsigned)len);
+}
+
+
+/* Parses unsigned decimal number, skipping leading spaces. One space after
+ * the number is consumed too, so text argument which follows it may start
+ * with spaces
+ */
+static bool
+next_uint(char **p, unsigned *v)
+{
+    char *end;
+
+    while(' ' == **p)
+        ++*p;
+
+    *v = strtoul(*p, &end, 10);
+    if(end == *p || (' ' != *end && '\0' != *end))
+        return false;
+
+    *p = (' ' == *end) ? end + 1 : end;
+    return true;
+}
+
+
+/* Copies next space separated word into buffer. One space after the word
+ * is consumed, like in next_uint()
+ */
+static bool
+next_token(char **p, char *buf, size_t size)
+{
+    size_t l;
+
+    while(' ' == **p)
+        ++*p;
+
+    l = strcspn(*p, " ");
+    if(0 == l || l >= size)
+        return false;
+
+    memcpy(buf, *p, l);
+    buf[l] = '\0';
+    *p += l;
+    if(' ' == **p)
+        ++*p;
+    return true;
+}
+
+
+/* POS <row> <col>                     - move cursor
+ */
+static void
+cmd_pos(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    unsigned row, col;
+
+    if(!next_uint(&args, &row) || !next_uint(&args, &col)) {
+        WARN_RL("POS: invalid arguments '%s'", line);
+        return;
+    }
+
+    lcd->setCursor(row, col);
+}
+
+
+/* CURSOR ON|OFF|BLINK                 - show, hide or blink cursor
+ */
+static void
+cmd_cursor(WinStarLCD *lcd, char *args)
+{
+    if(0 == strcmp(args, "ON"))
+        lcd->showCursor(true);
+    else if(0 == strcmp(args, "OFF"))
+        lcd->showCursor(false);
+    else if(0 == strcmp(args, "BLINK"))
+        lcd->showCursor(false, true);
+    else
+        WARN_RL("CURSOR: expected ON, OFF or BLINK, got '%s'", args);
+}
+
+
+/* FRAME BEGIN|END                     - draw off screen, then show the frame
+ */
+static void
+cmd_frame(WinStarLCD *lcd, char *args)
+{
+    if(0 == strcmp(args, "BEGIN")) {
+        if(!lcd->beginFrame())
+            WARN_RL("FRAME: not supported by %ux%u panel", lcd->cols(), lcd->rows());
+    } else if(0 == strcmp(args, "END")) {
+        if(!lcd->endFrame())
+            DBG("FRAME END without FRAME BEGIN");
+    } else {
+        WARN_RL("FRAME: expected BEGIN or END, got '%s'", args);
+    }
+}
+
+
+/* WRITE <row> <col> <text>            - print text at given cell
+ */
+static void
+cmd_write(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    unsigned row, col;
+
+    if(!next_uint(&args, &row) || !next_uint(&args, &col)) {
+        WARN_RL("WRITE: invalid arguments '%s'", line);
+        return;
+    }
+
+    lcd->writeAt(row, col, args, strlen(args));
+}
+
+
+/* LINE <row> L|C|R <text>             - replace whole row with aligned text
+ */
+static void
+cmd_line(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    WinStarLCD::align how;
+    unsigned row;
+
+    if(!next_uint(&args, &row)) {
+        WARN_RL("LINE: invalid arguments '%s'", line);
+        return;
+    }
+
+    switch(toupper(args[0])) {
+        case 'L':
+            how = WinStarLCD::ALIGN_LEFT;
+            break;
+        case 'C':
+            how = WinStarLCD::ALIGN_CENTER;
+            break;
+        case 'R':
+            how = WinStarLCD::ALIGN_RIGHT;
+            break;
+        default:
+            WARN_RL("LINE: alignment must be L, C or R");
+            return;
+    }
+
+    if(' ' == args[1])
+        ++args;
+    else if('\0' != args[1]) {
+        WARN_RL("LINE: invalid arguments '%s'", line);
+        return;
+    }
+
+    lcd->writeLine(row, &args[1], how);
+}
+
+
+/* FILL <row> <col> <width> <height> [<char>]
+ *                                     - fill region with char (space)
+ */
+static void
+cmd_fill(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    unsigned row, col, w, h;
+
+    if(!next_uint(&args, &row) || !next_uint(&args, &col) || !next_uint(&args, &w) || !next_uint(&args, &h)) {
+        WARN_RL("FILL: invalid arguments '%s'", line);
+        return;
+    }
+
+    lcd->fillRegion(row, col, w, h, ('\0' != args[0]) ? args[0] : ' ');
+}
+
+
+/* BAR <id> H|V <row> <col> <cells>    - define bar and draw it empty
+ * BAR <id> <pixels>                   - set bar value
+ * BAR <id> X                          - delete bar
+ */
+static void
+cmd_bar(WinStarLCD *lcd, char *args)
+{
+    unsigned id, row, col, len;
+    char tok[16];
+    char *end;
+    unsigned long px;
+    int n;
+
+    n = sscanf(args, "%u %15s %u %u %u", &id, tok, &row, &col, &len);
+    if(n < 2) {
+        WARN_RL("BAR: invalid arguments '%s'", args);
+        return;
+    }
+
+    px = strtoul(tok, &end, 10);
+    if('\0' == *end) {
+        lcd->barSet(id, px > 0xFFFF ? 0xFFFF : px);
+        return;
+    }
+
+    if(2 == n && 0 == strcasecmp(tok, "X")) {
+        lcd->barRemove(id);
+        return;
+    }
+
+    if(5 == n && (0 == strcasecmp(tok, "H") || 0 == strcasecmp(tok, "V"))) {
+        if(!lcd->barDefine(id, toupper(tok[0]) == 'H' ? WinStarLCD::BAR_HORIZONTAL : WinStarLCD::BAR_VERTICAL,
+                row, col, len))
+            WARN_RL("BAR: cannot define bar #%u", id);
+        return;
+    }
+
+    WARN_RL("BAR: invalid arguments '%s'", args);
+}
+
+
+/* GLYPH <code point> <row0> .. <row7>   - register bitmap for character
+ *                                        missing in display ROM (hex)
+ */
+static void
+cmd_glyph(WinStarLCD *lcd, char *args)
+{
+    unsigned ucs, r[8];
+    uint8_t bitmap[8];
+    int i;
+
+    if(9 != sscanf(args, "%x %x %x %x %x %x %x %x %x", &ucs, &r[0], &r[1], &r[2], &r[3], &r[4], &r[5], &r[6], &r[7])) {
+        WARN_RL("GLYPH: invalid arguments '%s'", args);
+        return;
+    }
+
+    for(i=0; i<8; ++i)
+        bitmap[i] = r[i];
+
+    if(!lcd->defineGlyph(ucs, bitmap))
+        WARN_RL("GLYPH: glyph table is full");
+}
+
+
+/* AT <id> +<ms>|<unix time> <command>  - run command once
+ */
+static void
+cmd_at(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    char id[JOB_ID_LEN], when[24], *end;
+    struct timeval tv;
+    long long delay;
+
+    if(!next_token(&args, id, sizeof(id)) || !next_token(&args, when, sizeof(when)) || '\0' == *args) {
+        WARN_RL("AT: invalid arguments '%s'", line);
+        return;
+    }
+
+    if('+' == when[0]) {
+        delay = strtoll(&when[1], &end, 10);
+    } else {
+        gettimeofday(&tv, NULL);
+        delay = strtoll(when, &end, 10) * 1000 - ((long long)tv.tv_sec * 1000 + tv.tv_usec / 1000);
+    }
+
+    if('\0' != *end) {
+        WARN_RL("AT: invalid time '%s'", when);
+        return;
+    }
+
+    if(delay < 0)
+        delay = 0;
+    if(delay > 0x7FFFFFFF)
+        delay = 0x7FFFFFFF;
+
+    sched_command(lcd, id, delay, 0, args);
+}
+
+
+/* EVERY <id> <ms> <command>           - run command periodically
+ */
+static void
+cmd_every(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    char id[JOB_ID_LEN];
+    unsigned ms;
+
+    if(!next_token(&args, id, sizeof(id)) || !next_uint(&args, &ms) || 0 == ms || '\0' == *args) {
+        WARN_RL("EVERY: invalid arguments '%s'", line);
+        return;
+    }
+
+    sched_command(lcd, id, ms, ms, args);
+}
+
+
+/* BLINK <id> <ms> <row> <col> <len>   - blink region until cancelled
+ */
+static void
+cmd_blink(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    char id[JOB_ID_LEN];
+    unsigned ms, row, col, len;
+
+    if(!next_token(&args, id, sizeof(id)) || !next_uint(&args, &ms) || !next_uint(&args, &row)
+            || !next_uint(&args, &col) || !next_uint(&args, &len)) {
+        WARN_RL("BLINK: invalid arguments '%s'", line);
+        return;
+    }
+
+    if(!sched_blink(lcd, id, ms, row, col, len))
+        WARN_RL("BLINK: cannot schedule '%s'", id);
+}
+
+
+/* EXPIRE <id> <sec> <row> <col> <len> - blank region after a while
+ */
+static void
+cmd_expire(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    char id[JOB_ID_LEN];
+    unsigned sec, row, col, len;
+
+    if(!next_token(&args, id, sizeof(id)) || !next_uint(&args, &sec) || !next_uint(&args, &row)
+            || !next_uint(&args, &col) || !next_uint(&args, &len)) {
+        WARN_RL("EXPIRE: invalid arguments '%s'", line);
+        return;
+    }
+
+    if(sec > 0x7FFFFFFF / 1000)
+        sec = 0x7FFFFFFF / 1000;
+
+    if(!sched_expire(lcd, id, sec * 1000, row, col, len))
+        WARN_RL("EXPIRE: cannot schedule '%s'", id);
+}
+
+
+/* SEQ <name> <ms> <command>          - append animation step: command and
+ *                                       pause after it
+ * SEQ <name> CLEAR                    - delete sequence
+ */
+static void
+cmd_seq(WinStarLCD *, char *args)
+{
+    const char *line = args;
+    char name[JOB_ID_LEN];
+    unsigned ms;
+
+    if(!next_token(&args, name, sizeof(name))) {
+        WARN_RL("SEQ: invalid arguments '%s'", line);
+        return;
+    }
+
+    if(0 == strcmp(args, "CLEAR")) {
+        if(!sched_seq_clear(name))
+            DBG("SEQ: no sequence named '%s'", name);
+        return;
+    }
+
+    if(!next_uint(&args, &ms) || '\0' == *args) {
+        WARN_RL("SEQ: invalid arguments '%s'", line);
+        return;
+    }
+
+    if(!sched_seq_add(name, ms, args))
+        WARN_RL("SEQ: no room for step of '%s'", name);
+}
+
+
+/* PLAY <id> <name> [times]            - play sequence once, given number of
+ *                                       times or, if 0, until cancelled
+ */
+static void
+cmd_play(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    char id[JOB_ID_LEN], name[JOB_ID_LEN];
+    unsigned times = 1;
+
+    if(!next_token(&args, id, sizeof(id)) || !next_token(&args, name, sizeof(name))
+            || ('\0' != *args && !next_uint(&args, &times))) {
+        WARN_RL("PLAY: invalid arguments '%s'", line);
+        return;
+    }
+
+    if(!sched_play(lcd, id, name, times))
+        WARN_RL("PLAY: cannot play '%s'", name);
+}
+
+
+/* CANCEL <id>                         - cancel job
+ */
+static void
+cmd_cancel(WinStarLCD *, char *args)
+{
+    const char *line = args;
+    char id[JOB_ID_LEN];
+
+    if(!next_token(&args, id, sizeof(id)) || !sched_cancel(id))
+        WARN_RL("CANCEL: no such job '%s'", line);
+}
+
+
+/* TPL <row> <text with {fields}>      - define template row
+ * TPL CLEAR                           - forget all templates
+ */
+static void
+cmd_tpl(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    unsigned row;
+
+    if(0 == strcmp(args, "CLEAR")) {
+        tpl_clear(lcd);
+        return;
+    }
+
+    if(!next_uint(&args, &row)) {
+        WARN_RL("TPL: invalid arguments '%s'", line);
+        return;
+    }
+
+    tpl_define(lcd, row, args);
+}
+
+
+/* SET <name> <value>                  - set template field value
+ */
+static void
+cmd_set(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    char name[TPL_NAME_LEN];
+
+    if(!next_token(&args, name, sizeof(name))) {
+        WARN_RL("SET: invalid arguments '%s'", line);
+        return;
+    }
+
+    if(0 == tpl_set(lcd, name, args))
+        DBG("SET: no field named '%s'", name);
+}
+
+
+/* CANVAS <rows> <cols>                - create virtual canvas and show it
+ * CANVAS OFF                          - drop canvas, panel is left as is
+ */
+static void
+cmd_canvas(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    unsigned rows, cols;
+
+    if(0 == strcmp(args, "OFF")) {
+        canvas_drop(lcd);
+        return;
+    }
+
+    if(!next_uint(&args, &rows) || !next_uint(&args, &cols) || !canvas_create(lcd, rows, cols))
+        WARN_RL("CANVAS: invalid size '%s', must be %ux%u..%ux%u", line,
+            lcd->rows(), lcd->cols(), MAX_CANVAS_ROWS, MAX_CANVAS_COLS);
+}
+
+
+/* CPUT <row> <col> <text>             - print text into canvas
+ */
+static void
+cmd_cput(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    unsigned row, col;
+
+    if(!next_uint(&args, &row) || !next_uint(&args, &col) || !canvas_put(lcd, row, col, args))
+        WARN_RL("CPUT: invalid arguments or no canvas '%s'", line);
+}
+
+
+/* VIEW <row> [col]                    - move viewport to canvas cell
+ * VIEW +|-<rows> [+|-<cols>]          - move viewport by given number of cells
+ */
+static void
+cmd_view(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    bool relative;
+    long row, col;
+    char *end;
+
+    while(' ' == *args)
+        ++args;
+    relative = ('+' == *args || '-' == *args);
+
+    row = strtol(args, &end, 10);
+    if(end == args || (' ' != *end && '\0' != *end)) {
+        WARN_RL("VIEW: invalid arguments '%s'", line);
+        return;
+    }
+
+    args = end;
+    col = strtol(args, &end, 10);
+    if(end == args)
+        col = relative ? 0 : -1;
+    else if('\0' != *end) {
+        WARN_RL("VIEW: invalid arguments '%s'", line);
+        return;
+    }
+
+    if(!canvas_view(lcd, row, col, relative))
+        WARN_RL("VIEW: no canvas");
+}
+
+
+/* WATCH <id> <row> <col> <w> <h> <name>
+ *                                     - show file or FIFO from WatchDir in region
+ */
+static void
+cmd_watch(WinStarLCD *lcd, char *args)
+{
+    const char *line = args;
+    char id[JOB_ID_LEN];
+    unsigned row, col, w, h;
+
+    if(!next_token(&args, id, sizeof(id)) || !next_uint(&args, &row) || !next_uint(&args, &col)
+            || !next_uint(&args, &w) || !next_uint(&args, &h) || '\0' == *args) {
+        WARN_RL("WATCH: invalid arguments '%s'", line);
+        return;
+    }
+
+    if(!watch_add(lcd, id, row, col, w > 0xFF ? 0xFF : w, h > 0xFF ? 0xFF : h, args))
+        WARN_RL("WATCH: cannot watch '%s'", args);
+}
+
+
+/* UNWATCH <id>                        - unbind region, contents stay on screen
+ */
+static void
+cmd_unwatch(WinStarLCD *, char *args)
+{
+    if(!watch_remove(args))
+        WARN_RL("UNWATCH: no such watch '%s'", args);
+}
+
+
+/* STATS                               - dump metrics in Prometheus text format,
+ *                                       terminated by "# EOF" line
+ */
+static void
+cmd_stats(WinStarLCD *, char *)
+{
+    static char buf[MAX_STATS_SIZE];
+    size_t n;
+
+    n = metrics_format(buf, sizeof(buf) - 6);
+    memcpy(buf + n, "# EOF\n", 6);
+    reply(buf, n + 6);
+}
+
+
+/* SYNC [token]                        - reply "OK [token]" once all preceding
+ *                                       commands reached the bus
+ */
+static void
+cmd_sync(WinStarLCD *lcd, char *args)
+{
+    char buf[MAX_BUF_SIZE + 8];
+    int n;
+
+    lcd->drain();
+    n = snprintf(buf, sizeof(buf), "OK%s%s\r\n", '\0' == *args ? "" : " ", args);
+    reply(buf, n);
+}
+
+
+/* USE <display>                      - send next commands of this client to
+ *                                       display or display group, "main" is
+ *                                       the default
+ */
+static void
+cmd_use(WinStarLCD *, char *args)
+{
+    WinStarLCD *lcd = display_find(args);
+
+    if(NULL == lcd)
+        WARN_RL("USE: no display '%s'", args);
+    else
+        _target = lcd;
+}
+
+
+static struct cmd_keyword _keywords[] = {
+    { "BAR",    cmd_bar },
+    { "GLYPH",  cmd_glyph },
+    { "POS",    cmd_pos },
+    { "CURSOR", cmd_cursor },
+    { "FRAME",  cmd_frame },
+    { "WRITE",  cmd_write },
+    { "LINE",   cmd_line },
+    { "FILL",   cmd_fill },
+    { "AT",     cmd_at },
+    { "EVERY",  cmd_every },
+    { "BLINK",  cmd_blink },
+    { "EXPIRE", cmd_expire },
+    { "SEQ",    cmd_seq },
+    { "PLAY",   cmd_play },
+    { "CANCEL", cmd_cancel },
+    { "TPL",    cmd_tpl },
+    { "SET",    cmd_set },
+    { "CANVAS", cmd_canvas },
+    { "CPUT",   cmd_cput },
+    { "VIEW",   cmd_view },
+    { "WATCH",  cmd_watch },
+    { "UNWATCH", cmd_unwatch },
+    { "STATS",  cmd_stats },
+    { "SYNC",   cmd_sync },
+    { "USE",    cmd_use },
+};
+
+
+/* Executes single protocol command. Keyword commands are matched first (they
+ * are case sensitive and must be followed by space or end of line), then
+ * legacy one-letter commands. Anything else is printed as is.
+ * Replies, if command has any, are sent to fd (-1 for none).
+ * Returns display the next command goes to, changed by USE
+ */
+WinStarLCD *
+exec_command(WinStarLCD *lcd, char *cmd, int fd)
+{
+    unsigned int i;
+    size_t l;
+    int rama;
+
+    for(i=0; i<COUNTOF(_keywords); ++i) {
+        l = strlen(_keywords[i].kw);
+        if(0 == strncmp(cmd, _keywords[i].kw, l) && ('\0' == cmd[l] || ' ' == cmd[l])) {
+            if(cmd_use != _keywords[i].func)
+                lcd->claim();
+            _reply_fd = fd;
+            _target = lcd;
+            _keywords[i].func(lcd, (' ' == cmd[l]) ? &cmd[l+1] : &cmd[l]);
+            _reply_fd = -1;
+            return _target;
+        }
+    }
+
+    lcd->claim();
+    switch(cmd[0]) {
+        case 'A':
+        case 'a':
+            sscanf(&cmd[1], "%2x", &rama);
+            lcd->setAddr(lcd->pageAddr(rama & 0xFF));
+            break;
+        case 'C':
+        case 'c':
+            lcd->clear();
+            break;
+        case 'H':
+        case 'h':
+            lcd->home();
+            break;
+        case '\\':
+            lcd->echo(&cmd[1]);
+            break;
+        default:
+            lcd->echo(cmd);
+            break;
+    }
+
+    return lcd;
+}
+
+
+/* Drops templates, canvas, jobs and watches bound to display which is
+ * going away
+ */
+void
+forget_display(WinStarLCD *lcd)
+{
+    tpl_clear(lcd);
+    canvas_drop(lcd);
+    sched_drop(lcd);
+    watch_drop(lcd);
+}
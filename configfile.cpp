@@ -1,7 +1,10 @@
+#include "config.h"
 #include "common.h"
 #include "logging.h"
 #include "configfile.h"
 #include "utils.h"
+#include "lcd_charset.h"
+#include "lcd_transport.h"
 #include <pwd.h>
 #include <grp.h>
 #include <netdb.h>
@@ -124,6 +127,22 @@ ConfigFile::whatKeyword(const char *kw)
         "unixsocket",
         "ip",
         "port",
+        "charset",
+        "geometry",
+        "loglevel",
+        "logtarget",
+        "statssocket",
+        "recorddir",
+        "statefile",
+        "rtpriority",
+        "cpuaffinity",
+        "lockmemory",
+        "netbackend",
+        "watchdir",
+        "display",
+        "displaygroup",
+        "scrubrate",
+        "transport",
 
         NULL};
 
@@ -162,9 +181,11 @@ ConfigFile::parse_mapfile(const char *arg, int line, run_options_t *opts)
 void
 ConfigFile::parse_spislot(const char *arg, int line, run_options_t *opts)
 {
-    if(arg[0] != 's' && arg[0] != 'S') {
+    if(arg[0] != 's' && arg[0] != 'S' && !isdigit(arg[0])) {
         ERR("%s(%d): Invalid slot name '%s'", _filename, line, arg);
     } else {
+        ::free(opts->slot);
+        opts->slot = strdup(arg);
         LOG("SPI slot: %s", arg);
     }
 }
@@ -298,6 +319,290 @@ ConfigFile::parse_port(const char *arg, int line, run_options_t *opts)
 }
 
 
+void
+ConfigFile::parse_charset(const char *arg, int line, run_options_t *opts)
+{
+    if(NULL == lcd_find_charset(arg)) {
+        ERR("%s(%d): Unknown charset '%s'. Use A00, A02 or Cyrillic", _filename, line, arg);
+    } else {
+        ::free(opts->charset);
+        opts->charset = strdup(arg);
+        LOG("Charset: %s", arg);
+    }
+}
+
+
+void
+ConfigFile::parse_geometry(const char *arg, int line, run_options_t *opts)
+{
+    unsigned cols, rows;
+    char c;
+
+    if(3 != sscanf(arg, "%u%c%u", &cols, &c, &rows) || ('x' != c && 'X' != c)) {
+        ERR("%s(%d): Invalid geometry '%s', expected COLSxROWS", _filename, line, arg);
+        return;
+    }
+
+    if(0 == cols || cols > 40 || (1 != rows && 2 != rows && 4 != rows) || (4 == rows && cols > 20)) {
+        ERR("%s(%d): Unsupported geometry %ux%u", _filename, line, cols, rows);
+        return;
+    }
+
+    opts->cols = cols;
+    opts->rows = rows;
+    LOG("Geometry: %ux%u", cols, rows);
+}
+
+
+void
+ConfigFile::parse_loglevel(const char *arg, int line, run_options_t *opts)
+{
+    if(!log_parse_level(arg, &opts->logLevel))
+        ERR("%s(%d): Log level must be one of debug, info, warn or error", _filename, line);
+}
+
+
+void
+ConfigFile::parse_logtarget(const char *arg, int line, run_options_t *opts)
+{
+    ::free(opts->logTarget);
+    opts->logTarget = strdup(arg);
+}
+
+
+void
+ConfigFile::parse_statssocket(const char *arg, int line, run_options_t *opts)
+{
+    ::free(opts->statsSock);
+    opts->statsSock = strdup(arg);
+}
+
+
+void
+ConfigFile::parse_statefile(const char *arg, int line, run_options_t *opts)
+{
+    ::free(opts->stateFile);
+    opts->stateFile = strdup(arg);
+}
+
+
+void
+ConfigFile::parse_recorddir(const char *arg, int line, run_options_t *opts)
+{
+    struct stat st;
+
+    if(0 != stat(arg, &st) || !S_ISDIR(st.st_mode)) {
+        ERR("%s(%d): '%s' is not a directory, sessions will not be recorded", _filename, line, arg);
+        return;
+    }
+
+    ::free(opts->recordDir);
+    opts->recordDir = strdup(arg);
+}
+
+
+void
+ConfigFile::parse_rtpriority(const char *arg, int line, run_options_t *opts)
+{
+    char *end;
+    long prio;
+
+    prio = strtol(arg, &end, 10);
+    if('\0' != *end || prio < 0 || prio > 99) {
+        ERR("%s(%d): Real-time priority must be 1..99 or 0 to disable, got '%s'", _filename, line, arg);
+        return;
+    }
+
+    opts->rtPriority = prio;
+}
+
+
+/* CPU list: comma separated numbers and ranges, e.g. "1" or "0,2-3"
+ */
+void
+ConfigFile::parse_cpuaffinity(const char *arg, int line, run_options_t *opts)
+{
+    const char *p = arg;
+    uint64_t mask = 0;
+    unsigned lo, hi;
+    int n;
+
+    while('\0' != *p) {
+        if(2 == sscanf(p, "%u-%u%n", &lo, &hi, &n)) {
+            ;
+        } else if(1 == sscanf(p, "%u%n", &lo, &n)) {
+            hi = lo;
+        } else {
+            break;
+        }
+
+        if(lo > hi || hi > 63)
+            break;
+        for(; lo <= hi; ++lo)
+            mask |= (uint64_t)1 << lo;
+
+        p += n;
+        if(',' == *p)
+            ++p;
+    }
+
+    if('\0' != *p || 0 == mask) {
+        ERR("%s(%d): Invalid CPU list '%s', expected e.g. 1 or 0,2-3", _filename, line, arg);
+        return;
+    }
+
+    opts->rtCpus = mask;
+}
+
+
+void
+ConfigFile::parse_lockmemory(const char *arg, int line, run_options_t *opts)
+{
+    int res;
+
+    if(!get_bool(arg, &res))
+         ERR("%s(%d): Argument must be boolean, got '%s'", _filename, line, arg);
+    else
+        opts->lockMemory = res;
+}
+
+
+void
+ConfigFile::parse_netbackend(const char *arg, int line, run_options_t *opts)
+{
+    if(0 == strcasecmp(arg, "poll"))
+        opts->netBackend = NET_POLL;
+    else if(0 == strcasecmp(arg, "uring") || 0 == strcasecmp(arg, "io_uring"))
+        opts->netBackend = NET_URING;
+    else
+        ERR("%s(%d): Network backend must be poll or uring, got '%s'", _filename, line, arg);
+}
+
+
+void
+ConfigFile::parse_watchdir(const char *arg, int line, run_options_t *opts)
+{
+    struct stat st;
+
+    if(0 != stat(arg, &st) || !S_ISDIR(st.st_mode)) {
+        ERR("%s(%d): '%s' is not a directory, WATCH is disabled", _filename, line, arg);
+        return;
+    }
+
+    ::free(opts->watchDir);
+    opts->watchDir = strdup(arg);
+}
+
+
+/* Returns true if name is taken by main display or an earlier Display or
+ * DisplayGroup line
+ */
+static bool
+name_taken(const char *name, const run_options_t *opts)
+{
+    char taken[DISPLAY_NAME_LEN];
+    int i;
+
+    if(0 == strcmp(name, "main"))
+        return true;
+    for(i=0; i<opts->ndisplays; ++i)
+        if(1 == sscanf(opts->displays[i], "%15s", taken) && 0 == strcmp(name, taken))
+            return true;
+    for(i=0; i<opts->ngroups; ++i)
+        if(1 == sscanf(opts->groups[i], "%15s", taken) && 0 == strcmp(name, taken))
+            return true;
+    return false;
+}
+
+
+/* Additional display: "name slot [address]", address of the port extender
+ * defaults to 0x20
+ */
+void
+ConfigFile::parse_display(const char *arg, int line, run_options_t *opts)
+{
+    char name[DISPLAY_NAME_LEN + 1], slot[16];
+    int addr = 0x20, n;
+
+    n = sscanf(arg, "%16s %15s %i", name, slot, &addr);
+    if(n < 2 || strlen(name) >= DISPLAY_NAME_LEN) {
+        ERR("%s(%d): Invalid display '%s', expected NAME SLOT [ADDRESS]", _filename, line, arg);
+        return;
+    }
+
+    if(slot[0] != 's' && slot[0] != 'S' && !isdigit(slot[0])) {
+        ERR("%s(%d): Invalid slot name '%s'", _filename, line, slot);
+        return;
+    }
+
+    if(addr < 0x20 || addr > 0x27) {
+        ERR("%s(%d): Display address must be 0x20..0x27, got '%s'", _filename, line, arg);
+        return;
+    }
+
+    if(name_taken(name, opts) || MAX_DISPLAYS == opts->ndisplays) {
+        ERR("%s(%d): Display '%s' is a duplicate or one too many", _filename, line, name);
+        return;
+    }
+
+    opts->displays[opts->ndisplays++] = strdup(arg);
+}
+
+
+/* Display group: "name member,member...", members are display names
+ */
+void
+ConfigFile::parse_displaygroup(const char *arg, int line, run_options_t *opts)
+{
+    char name[DISPLAY_NAME_LEN + 1], list[MAX_BUF_SIZE];
+
+    if(2 != sscanf(arg, "%16s %255s", name, list) || strlen(name) >= DISPLAY_NAME_LEN) {
+        ERR("%s(%d): Invalid display group '%s', expected NAME DISPLAY,DISPLAY...", _filename, line, arg);
+        return;
+    }
+
+    if(name_taken(name, opts) || MAX_GROUPS == opts->ngroups) {
+        ERR("%s(%d): Display group '%s' is a duplicate or one too many", _filename, line, name);
+        return;
+    }
+
+    opts->groups[opts->ngroups++] = strdup(arg);
+}
+
+
+void
+ConfigFile::parse_scrubrate(const char *arg, int line, run_options_t *opts)
+{
+    char *end;
+    long rate;
+
+    rate = strtol(arg, &end, 10);
+    if('\0' != *end || rate < 0 || rate > MAX_SCRUB_RATE) {
+        ERR("%s(%d): Scrub rate must be 0..%d cells per second, got '%s'", _filename, line, MAX_SCRUB_RATE, arg);
+        return;
+    }
+
+    opts->scrubRate = rate;
+}
+
+
+void
+ConfigFile::parse_transport(const char *arg, int line, run_options_t *opts)
+{
+    lcd_transport *io;
+
+    io = lcd_transport_create(arg);
+    if(NULL == io) {
+        ERR("%s(%d): Transport must be i2cdev, sim or ltps (if built with Ltps), got '%s'", _filename, line, arg);
+        return;
+    }
+    delete io;
+
+    ::free(opts->transport);
+    opts->transport = strdup(arg);
+}
+
+
 void
 ConfigFile::parseArg(const char *kw, const char *arg, int line, run_options_t *opts)
 {
@@ -313,7 +618,23 @@ ConfigFile::parseArg(const char *kw, const char *arg, int line, run_options_t *o
         { "listenon",   &ConfigFile::parse_listenon },
         { "unixsocket", &ConfigFile::parse_unixsocket },
         { "ip",         &ConfigFile::parse_ip },
-        { "port",       &ConfigFile::parse_port }
+        { "port",       &ConfigFile::parse_port },
+        { "charset",    &ConfigFile::parse_charset },
+        { "geometry",   &ConfigFile::parse_geometry },
+        { "loglevel",   &ConfigFile::parse_loglevel },
+        { "logtarget",  &ConfigFile::parse_logtarget },
+        { "statssocket", &ConfigFile::parse_statssocket },
+        { "recorddir",  &ConfigFile::parse_recorddir },
+        { "statefile",  &ConfigFile::parse_statefile },
+        { "rtpriority", &ConfigFile::parse_rtpriority },
+        { "cpuaffinity", &ConfigFile::parse_cpuaffinity },
+        { "lockmemory", &ConfigFile::parse_lockmemory },
+        { "netbackend", &ConfigFile::parse_netbackend },
+        { "watchdir",   &ConfigFile::parse_watchdir },
+        { "display",    &ConfigFile::parse_display },
+        { "displaygroup", &ConfigFile::parse_displaygroup },
+        { "scrubrate",  &ConfigFile::parse_scrubrate },
+        { "transport",  &ConfigFile::parse_transport }
     };
 
     int i;
@@ -0,0 +1,509 @@
+#include "config.h"
+#include "common.h"
+#include "logging.h"
+#include "displays.h"
+#include "metrics.h"
+#include "utils.h"
+#include "winstar_lcd.h"
+#include <new>
+
+
+/* Named displays. The one set up by SpiSlot is "main", more panels are
+ * added by Display lines:
+ *
+ *      Display     side s5 0x21
+ *
+ * Display group is a display object of its own, which drives panels of its
+ * members instead of one panel:
+ *
+ *      DisplayGroup all main,side
+ *
+ * Command sent to the group is encoded once, into the group shadow copy,
+ * and every transaction is written to all member panels. Members on
+ * different buses are written by writer threads in parallel. A panel drawn
+ * by the group and then by a member (or the other way round) is taken
+ * over with claim(), which sends what the previous owner queued and makes
+ * the new one rewrite the cells it draws.
+ *
+ * On reload, displays and groups whose lines are gone or changed are
+ * taken out of service and the new ones are set up; the rest go on as
+ * they are. A group is rebuilt when one of its members comes or goes.
+ *
+ * With ScrubRate set, one cell of every panel is read back now and then,
+ * when the service is about to sleep and no job is due, and rewritten if
+ * the controller lost it.
+ */
+
+
+struct display_t {
+    char name[DISPLAY_NAME_LEN];
+    char def[MAX_BUF_SIZE];     // Display or DisplayGroup line, empty for main
+    WinStarLCD *lcd;
+    bool parallel;              // Group spans more than one bus
+    bool failing;               // Some panel does not respond
+    uint32_t recovered;         // Last seen recoveredPanels()
+};
+
+
+static WinStarLCD _extra[MAX_DISPLAYS];
+static WinStarLCD _groups[MAX_GROUPS];
+static display_t _displays[1 + MAX_DISPLAYS + MAX_GROUPS];
+static int _count;
+static uint32_t _scrub_ms;      // Interval of read-back steps, 0 if disabled
+static uint64_t _scrub_due;
+
+
+static void
+configure(WinStarLCD *lcd, const struct run_options *opts)
+{
+    lcd->setCharset(opts->charset);
+    lcd->setGeometry(opts->cols, opts->rows);
+}
+
+
+static bool
+is_group(const WinStarLCD *lcd)
+{
+    return lcd >= _groups && lcd < _groups + MAX_GROUPS;
+}
+
+
+/* Returns object of the pool which no display uses, in its initial state
+ */
+static WinStarLCD *
+alloc_lcd(WinStarLCD *pool, int n)
+{
+    WinStarLCD *lcd;
+    int i, j;
+
+    for(i=0; i<n; ++i) {
+        lcd = &pool[i];
+        for(j=0; j<_count && _displays[j].lcd != lcd; ++j)
+            ;
+        if(j == _count) {
+            lcd->~WinStarLCD();
+            return new(lcd) WinStarLCD();
+        }
+    }
+    return NULL;
+}
+
+
+static display_t *
+add_display(const char *name, const char *def, WinStarLCD *lcd)
+{
+    display_t *d = &_displays[_count++];
+
+    snprintf(d->name, sizeof(d->name), "%s", name);
+    snprintf(d->def, sizeof(d->def), "%s", def);
+    d->lcd = lcd;
+    d->parallel = false;
+    d->failing = false;
+    d->recovered = 0;
+    return d;
+}
+
+
+/* Initializes display of "name slot [addr]" line. Returns NULL on error
+ */
+static display_t *
+init_display(const char *def, const struct run_options *opts)
+{
+    char name[DISPLAY_NAME_LEN], slot[16];
+    int addr = LCD_DEFAULT_ADDR;
+    WinStarLCD *lcd;
+    display_t *d;
+    int res;
+
+    if(sscanf(def, "%15s %15s %i", name, slot, &addr) < 2)
+        return NULL;
+
+    lcd = alloc_lcd(_extra, MAX_DISPLAYS);
+    if(NULL == lcd) {
+        ERR("Too many displays, '%s' is not set up", name);
+        return NULL;
+    }
+
+    configure(lcd, opts);
+    lcd->setFlushHook(metrics_flush_hook);
+    lcd->setAddress(addr);
+    lcd->setTransport(lcd_transport_create(opts->transport), true);
+
+    res = isdigit(slot[0]) ? lcd->init(atoi(slot), NULL) : lcd->init(slot, NULL);
+    if(-1 == res) {
+        ERR("Failed to init display '%s' at slot %s", name, slot);
+        return NULL;
+    }
+
+    d = add_display(name, def, lcd);
+    LOG("Display '%s' at slot %s, address 0x%02X", name, slot, addr);
+    return d;
+}
+
+
+/* Builds group of "name member,member..." line. Returns NULL on error
+ */
+static display_t *
+init_group(const char *def, const struct run_options *opts)
+{
+    char name[DISPLAY_NAME_LEN], list[MAX_BUF_SIZE];
+    WinStarLCD *lcd, *m, *first;
+    display_t *d;
+    char *p, *save;
+    bool parallel;
+    int i;
+
+    if(2 != sscanf(def, "%15s %255s", name, list))
+        return NULL;
+
+    lcd = alloc_lcd(_groups, MAX_GROUPS);
+    if(NULL == lcd) {
+        ERR("Too many display groups, '%s' is not set up", name);
+        return NULL;
+    }
+
+    configure(lcd, opts);
+    lcd->setFlushHook(metrics_flush_hook);
+
+    for(p=strtok_r(list, ",", &save), first=NULL, parallel=false; NULL != p; p=strtok_r(NULL, ",", &save)) {
+        m = display_find(p);
+        if(NULL == m) {
+            ERR("Display group '%s': no display '%s'", name, p);
+            continue;
+        }
+
+        /* Group has no panel of its own to lend */
+        if(is_group(m) || NULL == m->output()->io) {
+            ERR("Display group '%s': '%s' is not a panel", name, p);
+            continue;
+        }
+
+        for(i=0; i<lcd->outputs() && lcd->outputAt(i) != m->output(); ++i)
+            ;
+        if(i < lcd->outputs()) {
+            ERR("Display group '%s': '%s' is listed twice", name, p);
+            continue;
+        }
+
+        if(!lcd->addOutput(m->output())) {
+            ERR("Display group '%s': too many members", name);
+            break;
+        }
+
+        if(NULL == first)
+            first = m;
+        else if(0 != strcmp(first->output()->bus, m->output()->bus))
+            parallel = true;
+    }
+
+    if(0 == lcd->outputs()) {
+        ERR("Display group '%s' has no members", name);
+        return NULL;
+    }
+
+    d = add_display(name, def, lcd);
+    d->parallel = parallel;
+    LOG("Display group '%s' of %u panels", name, lcd->outputs());
+    return d;
+}
+
+
+/* Registers main display and sets up the ones from Display and DisplayGroup
+ * lines. Called once main display is initialized
+ */
+void
+displays_init(WinStarLCD *main, const struct run_options *opts)
+{
+    int i;
+
+    _count = 0;
+    add_display("main", "", main);
+
+    for(i=0; i<opts->ndisplays; ++i)
+        init_display(opts->displays[i], opts);
+    for(i=0; i<opts->ngroups; ++i)
+        init_group(opts->groups[i], opts);
+}
+
+
+/* Returns true if line is one of the list
+ */
+static bool
+listed(const char *def, char *const *list, int n)
+{
+    int i;
+
+    for(i=0; i<n; ++i)
+        if(0 == strcmp(def, list[i]))
+            return true;
+    return false;
+}
+
+
+/* Returns true if display is set up from one of the lines
+ */
+static bool
+present(const char *def, bool group)
+{
+    int i;
+
+    for(i=1; i<_count; ++i)
+        if(is_group(_displays[i].lcd) == group && 0 == strcmp(_displays[i].def, def))
+            return true;
+    return false;
+}
+
+
+/* Returns true if group line lists display with given name
+ */
+static bool
+group_uses(const char *def, const char *name)
+{
+    char list[MAX_BUF_SIZE], *p, *save;
+
+    if(1 != sscanf(def, "%*s %255s", list))
+        return false;
+
+    for(p=strtok_r(list, ",", &save); NULL != p; p=strtok_r(NULL, ",", &save))
+        if(0 == strcmp(p, name))
+            return true;
+    return false;
+}
+
+
+/* Takes i-th display out of service. Whatever it has queued is sent, and
+ * panels of a group are handed back to their displays, which redraw the
+ * cells they write next. References to it are dropped by the callback
+ */
+static void
+drop_display(int i, display_drop_f drop)
+{
+    WinStarLCD *lcd = _displays[i].lcd;
+    int k, j;
+
+    lcd->drain();
+    for(k=0; k<lcd->outputs(); ++k)
+        for(j=0; j<_count; ++j)
+            if(_displays[j].lcd->output() == lcd->outputAt(k))
+                _displays[j].lcd->claim();
+
+    drop(lcd);
+    LOG("Display%s '%s' removed", is_group(lcd) ? " group" : "", _displays[i].name);
+
+    /* Writer threads are stopped and panel transport is closed */
+    lcd->~WinStarLCD();
+    new(lcd) WinStarLCD();
+
+    --_count;
+    for(; i<_count; ++i)
+        _displays[i] = _displays[i + 1];
+}
+
+
+/* Starts writer thread of display, if it needs one: additional displays
+ * get it in real-time mode only, groups also when their members are on
+ * different buses, so those are written in parallel
+ */
+static void
+start_writer(display_t *d, const struct run_options *opts)
+{
+    lcd_rt_opts rt;
+
+    /* Memory is locked by the main display writer, if asked to */
+    rt.priority = opts->rtPriority;
+    rt.cpus = opts->rtCpus;
+    rt.lock_memory = false;
+
+    d->lcd->stopWriter();
+    if(0 == opts->rtPriority && !d->parallel)
+        return;
+
+    if(-1 == d->lcd->startWriter(0 == opts->rtPriority ? NULL : &rt))
+        ERR("Cannot start bus writer of display '%s': %s", d->name, strerror(errno));
+}
+
+
+/* Applies reloaded configuration to all displays but main one: changed
+ * charset and geometry, removed, changed and new Display and DisplayGroup
+ * lines. Groups go first, then their members, so no group is left with a
+ * panel which is gone; groups listing a display which comes or goes are
+ * rebuilt. New displays get writer threads as the running ones did
+ */
+void
+displays_configure(const struct run_options *opts, display_drop_f drop)
+{
+    char name[DISPLAY_NAME_LEN];
+    display_t *d;
+    int i, j;
+    bool rebuild;
+
+    for(i=_count-1; i>0; --i) {
+        d = &_displays[i];
+        if(!is_group(d->lcd))
+            continue;
+
+        rebuild = !listed(d->def, opts->groups, opts->ngroups);
+        for(j=1; j<_count && !rebuild; ++j)
+            if(!is_group(_displays[j].lcd) && !listed(_displays[j].def, opts->displays, opts->ndisplays))
+                rebuild = group_uses(d->def, _displays[j].name);
+        for(j=0; j<opts->ndisplays && !rebuild; ++j)
+            if(!present(opts->displays[j], false) && 1 == sscanf(opts->displays[j], "%15s", name))
+                rebuild = group_uses(d->def, name);
+
+        if(rebuild)
+            drop_display(i, drop);
+    }
+
+    for(i=_count-1; i>0; --i)
+        if(!is_group(_displays[i].lcd) && !listed(_displays[i].def, opts->displays, opts->ndisplays))
+            drop_display(i, drop);
+
+    for(i=1; i<_count; ++i)
+        configure(_displays[i].lcd, opts);
+
+    for(i=0; i<opts->ndisplays; ++i)
+        if(!present(opts->displays[i], false) && NULL != (d = init_display(opts->displays[i], opts)))
+            start_writer(d, opts);
+    for(i=0; i<opts->ngroups; ++i)
+        if(!present(opts->groups[i], true) && NULL != (d = init_group(opts->groups[i], opts)))
+            start_writer(d, opts);
+}
+
+
+/* (Re)starts writer threads of all displays but main one
+ */
+void
+displays_start_writers(const struct run_options *opts)
+{
+    int i;
+
+    for(i=1; i<_count; ++i)
+        start_writer(&_displays[i], opts);
+}
+
+
+void
+displays_stop_writers()
+{
+    int i;
+
+    for(i=1; i<_count; ++i)
+        _displays[i].lcd->stopWriter();
+}
+
+
+/* Re-initializes panels which stopped responding, when their retry time
+ * comes. Returns ms until the next attempt, -1 if all panels work
+ */
+int
+displays_recover()
+{
+    display_t *d;
+    int i, res, next;
+
+    for(i=0, next=-1; i<_count; ++i) {
+        d = &_displays[i];
+        res = d->lcd->recover();
+
+        if(-1 != res && !d->failing)
+            WARN("Display '%s': I2C transfer failed, will re-initialize", d->name);
+        if(d->lcd->recoveredPanels() != d->recovered)
+            LOG("Display '%s': re-initialized and redrawn", d->name);
+        d->failing = -1 != res;
+        d->recovered = d->lcd->recoveredPanels();
+
+        if(-1 != res && (-1 == next || res < next))
+            next = res;
+    }
+
+    return next;
+}
+
+
+/* Returns total number of panels brought back after I2C failure
+ */
+unsigned
+displays_recovered()
+{
+    unsigned n;
+    int i;
+
+    for(i=0, n=0; i<_count; ++i)
+        n += _displays[i].recovered;
+    return n;
+}
+
+
+/* Sets read-back rate, cells per second of every panel. 0 disables it
+ */
+void
+displays_set_scrub(int rate)
+{
+    _scrub_ms = (0 == rate) ? 0 : 1000 / rate;
+    _scrub_due = 0;
+}
+
+
+/* Reads back next cell of every display when its time comes. Step is
+ * skipped if a job is due in less than SCRUB_GUARD_MS (quiet is ms till
+ * then, -1 if none). Returns ms until the next step, -1 if disabled
+ */
+int
+displays_scrub(int quiet)
+{
+    uint64_t now;
+    int i;
+
+    if(0 == _scrub_ms)
+        return -1;
+
+    now = now_ms();
+    if(now < _scrub_due)
+        return _scrub_due - now;
+
+    if(-1 == quiet || quiet > SCRUB_GUARD_MS)
+        for(i=0; i<_count; ++i)
+            _displays[i].lcd->scrub();
+
+    _scrub_due = now + _scrub_ms;
+    return _scrub_ms;
+}
+
+
+unsigned
+displays_scrubbed()
+{
+    unsigned n;
+    int i;
+
+    for(i=0, n=0; i<_count; ++i)
+        n += _displays[i].lcd->scrubbedCells();
+    return n;
+}
+
+
+unsigned
+displays_repaired()
+{
+    unsigned n;
+    int i;
+
+    for(i=0, n=0; i<_count; ++i)
+        n += _displays[i].lcd->repairedCells();
+    return n;
+}
+
+
+/* Returns display or group with given name, NULL if there is none
+ */
+WinStarLCD *
+display_find(const char *name)
+{
+    int i;
+
+    for(i=0; i<_count; ++i)
+        if(0 == strcmp(_displays[i].name, name))
+            return _displays[i].lcd;
+
+    return NULL;
+}
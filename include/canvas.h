@@ -0,0 +1,14 @@
+#ifndef CANVAS_H
+#define CANVAS_H
+
+
+class WinStarLCD;
+
+
+extern bool canvas_create(WinStarLCD *, unsigned, unsigned);
+extern void canvas_drop(WinStarLCD *);
+extern bool canvas_put(WinStarLCD *, unsigned, unsigned, const char *);
+extern bool canvas_view(WinStarLCD *, int, int, bool);
+
+
+#endif // CANVAS_H
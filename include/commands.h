@@ -0,0 +1,12 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+
+class WinStarLCD;
+
+
+extern WinStarLCD *exec_command(WinStarLCD *, char *, int = -1);
+extern void forget_display(WinStarLCD *);
+
+
+#endif // COMMANDS_H
@@ -31,6 +31,11 @@ enum listen_on {
     TCP
 };
 
+enum net_backend {
+    NET_POLL,
+    NET_URING
+};
+
 typedef struct run_options {
     int goDaemon;
     int doChroot;
@@ -44,6 +49,26 @@ typedef struct run_options {
     int gid;
     listen_on lint;
     int sock;
+    char *charset;
+    int cols;
+    int rows;
+    int logLevel;
+    char *logTarget;
+    char *statsSock;
+    char *recordDir;
+    char *slot;
+    char *stateFile;
+    int rtPriority;             // Bus writer thread SCHED_FIFO priority, 0 for no writer thread
+    uint64_t rtCpus;            // Bus writer CPU affinity mask, 0 for any
+    int lockMemory;
+    net_backend netBackend;
+    char *watchDir;             // WATCH paths are relative to it, NULL disables WATCH
+    char *displays[MAX_DISPLAYS];   // Display lines: "name slot [addr]"
+    int ndisplays;
+    char *groups[MAX_GROUPS];   // DisplayGroup lines: "name member,member..."
+    int ngroups;
+    int scrubRate;              // Cells per second read back for checking, 0 disables
+    char *transport;            // I2C transport of all displays, NULL for the default one
 } run_options_t;
 
 
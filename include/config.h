@@ -15,6 +15,30 @@
 #define DEFAULT_PORT    6116
 #define MAX_CLIENTS     7
 #define MAX_BUF_SIZE    256
+#define DEFAULT_COLS    16
+#define DEFAULT_ROWS    2
+#define MAX_JOBS        32
+#define JOB_ID_LEN      16
+#define MAX_FIELDS      32
+#define TPL_NAME_LEN    16
+#define MAX_SEQS        8
+#define MAX_SEQ_STEPS   64
+#define SEQ_TEXT_SIZE   4096            // Step commands of one sequence
+#define MAX_WATCHES     8
+#define WATCH_FILE_SIZE 1024            // Bytes of watched file shown at most
+#define MAX_CANVAS_ROWS 256
+#define MAX_CANVAS_COLS 80
+#define MAX_DISPLAYS    4               // Besides the main one
+#define MAX_GROUPS      4
+#define DISPLAY_NAME_LEN 16
+#define MAX_SCRUB_RATE  100             // Cells per second read back, at most
+#define SCRUB_GUARD_MS  5               // No read-back when a job is due sooner
+#define LOG_RING_SIZE   256             // Must be power of 2
+#define LOG_MSG_LEN     256
+#define MAX_METRIC_THREADS 16
+#define MAX_STATS_SIZE  8192
+#define URING_ENTRIES   256
+#define URING_BUFS      64              // Receive buffers, power of 2, not less than MAX_CLIENTS
 
 
 #endif // CONFIG_H
@@ -49,6 +49,22 @@ private:
     void parse_unixsocket(const char *, int, run_options_t *);
     void parse_ip(const char *, int, run_options_t *);
     void parse_port(const char *, int, run_options_t *);
+    void parse_charset(const char *, int, run_options_t *);
+    void parse_geometry(const char *, int, run_options_t *);
+    void parse_loglevel(const char *, int, run_options_t *);
+    void parse_logtarget(const char *, int, run_options_t *);
+    void parse_statssocket(const char *, int, run_options_t *);
+    void parse_recorddir(const char *, int, run_options_t *);
+    void parse_statefile(const char *, int, run_options_t *);
+    void parse_rtpriority(const char *, int, run_options_t *);
+    void parse_cpuaffinity(const char *, int, run_options_t *);
+    void parse_lockmemory(const char *, int, run_options_t *);
+    void parse_netbackend(const char *, int, run_options_t *);
+    void parse_watchdir(const char *, int, run_options_t *);
+    void parse_display(const char *, int, run_options_t *);
+    void parse_displaygroup(const char *, int, run_options_t *);
+    void parse_scrubrate(const char *, int, run_options_t *);
+    void parse_transport(const char *, int, run_options_t *);
 private:
     Error _err;
     char *_filename;
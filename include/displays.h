@@ -0,0 +1,26 @@
+#ifndef DISPLAYS_H
+#define DISPLAYS_H
+
+
+class WinStarLCD;
+struct run_options;
+
+
+/* Called for display which is going away, to drop references to it */
+typedef void (*display_drop_f)(WinStarLCD *);
+
+
+extern void displays_init(WinStarLCD *, const struct run_options *);
+extern void displays_configure(const struct run_options *, display_drop_f);
+extern void displays_start_writers(const struct run_options *);
+extern void displays_stop_writers();
+extern int displays_recover();
+extern unsigned displays_recovered();
+extern void displays_set_scrub(int);
+extern int displays_scrub(int);
+extern unsigned displays_scrubbed();
+extern unsigned displays_repaired();
+extern WinStarLCD *display_find(const char *);
+
+
+#endif // DISPLAYS_H
@@ -0,0 +1,88 @@
+#ifndef __TIBBO_LTPS_LCD_ASYNC_INCLUDED__
+#define __TIBBO_LTPS_LCD_ASYNC_INCLUDED__
+
+
+/*! \file lcd_async.h
+ *  \brief Asynchronous front end of WinStarLCD
+ *
+ * Updates are submitted from any thread without waiting for the bus: the
+ * call copies the text into a preallocated queue and returns. A worker
+ * thread owned by the library takes everything queued at once, merges it
+ * into one picture, so a cell updated several times is sent once, and
+ * writes the difference to the display. Completion is reported by a
+ * callback, run in the worker thread, and by an eventfd which becomes
+ * readable, for applications with their own poll loop.
+ */
+
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "winstar_lcd.h"
+
+
+#define LCD_ASYNC_SLOTS     64                  // Submissions queued at most, power of 2
+#define LCD_ASYNC_TEXT      (LCD_MAX_COLS * LCD_MAX_ROWS * 4 + LCD_MAX_ROWS) // UTF-8 of a full screen
+
+
+/*! \brief Called once submission is on the display
+ * \param[in] ctx Context given to submit call
+ * \param[in] seq Sequence number returned by submit call
+ */
+typedef void (*lcd_done_f)(void *ctx, uint32_t seq);
+
+
+class WinStarAsync {
+protected:
+    enum sub_kind {
+        SUB_TEXT = 0,
+        SUB_REGION,
+        SUB_CLEAR
+    };
+    struct sub_t {              // Queued submission
+        uint32_t seq;
+        uint8_t kind;
+        uint8_t row;
+        uint8_t col;
+        uint8_t w;
+        uint8_t h;
+        lcd_done_f done;
+        void *ctx;
+        char text[LCD_ASYNC_TEXT];
+    };
+protected: // Members
+    WinStarLCD *_lcd;
+    sub_t _subs[LCD_ASYNC_SLOTS];
+    uint32_t _head;             // Next slot to fill, guarded by _lock
+    uint32_t _tail;             // Next slot to apply, written by worker
+    uint32_t _seq;              // Last sequence number given out
+    uint32_t _done;             // Last sequence number completed
+    pthread_mutex_t _lock;
+    sem_t _wake;
+    pthread_t _worker;
+    bool _running;
+    bool _stop;
+    int _efd;
+    uint8_t _grid[LCD_MAX_ROWS][LCD_MAX_COLS];  // Picture being merged
+    uint8_t _lo[LCD_MAX_ROWS];  // Columns changed in the picture, lo > hi if none
+    uint8_t _hi[LCD_MAX_ROWS];
+protected: // Methods
+    static void *workerThread(void *);
+    void workerLoop();
+    void apply(const sub_t *);
+    void put(uint8_t, uint8_t, const uint8_t *, uint8_t);
+    int32_t submit(uint8_t, uint8_t, uint8_t, uint8_t, uint8_t, const char *, lcd_done_f, void *);
+public:
+    WinStarAsync(WinStarLCD *);
+    ~WinStarAsync();
+    int start();
+    void stop();
+    int fd() const { return _efd; }
+    uint32_t completed() const { return __atomic_load_n(&_done, __ATOMIC_ACQUIRE); }
+    int32_t submitText(uint8_t, uint8_t, const char *, lcd_done_f = NULL, void * = NULL);
+    int32_t submitRegion(uint8_t, uint8_t, uint8_t, uint8_t, const char *, lcd_done_f = NULL, void * = NULL);
+    int32_t submitClear(lcd_done_f = NULL, void * = NULL);
+};
+
+
+#endif // __TIBBO_LTPS_LCD_ASYNC_INCLUDED__
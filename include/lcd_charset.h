@@ -0,0 +1,35 @@
+#ifndef LCD_CHARSET_H
+#define LCD_CHARSET_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+/*! \file lcd_charset.h
+ *  \brief Character generator ROM tables and UTF-8 decoding helpers
+ */
+
+
+struct lcd_charmap {
+    uint16_t ucs;               // Unicode code point
+    uint8_t code;               // Character code in display ROM
+};
+
+
+struct lcd_charset {
+    const char *name;
+    uint32_t direct[4];         // Bitmap of ASCII codes shown as is
+    const lcd_charmap *map;     // Other code points, sorted by ucs
+    size_t mapsize;
+    bool ascii;                 // All of ASCII is shown as is, direct is full
+};
+
+
+extern const lcd_charset *lcd_find_charset(const char *);
+extern int lcd_charset_lookup(const lcd_charset *, uint32_t);
+extern size_t lcd_ascii_run(const uint8_t *, size_t);
+extern size_t lcd_utf8_decode(const uint8_t *, size_t, uint32_t *);
+
+
+#endif // LCD_CHARSET_H
@@ -0,0 +1,76 @@
+#ifndef __TIBBO_LTPS_LCD_TRANSPORT_INCLUDED__
+#define __TIBBO_LTPS_LCD_TRANSPORT_INCLUDED__
+
+
+/*! \file lcd_transport.h
+ *  \brief I2C transports of WinStarLCD
+ *
+ * Transport carries transactions to the port extender. Messages are passed
+ * the way they go to the wire: register number followed by data, so a
+ * backend may hand the caller buffer to the kernel as is. Backends:
+ * \verbatim
+ *  Name        Bus argument of open()
+ *  ----        ----------------------
+ *  i2cdev      Bus number or /dev/i2c-N path, Linux i2c-dev (I2C_RDWR)
+ *  ltps        Bus number or slot name, Tibbo Ltps library (if built with it)
+ *  sim         Anything, simulated HD44780 panels for testing
+ * \endverbatim
+ */
+
+
+#include <stdint.h>
+
+
+#define LCD_MAX_BURST     128                   // Data bytes of one transaction, at most
+
+
+class lcd_transport {
+public:
+    virtual ~lcd_transport() {}
+
+    /*! \brief Backend name, see the table above */
+    virtual const char *name() const = 0;
+
+    /*! \brief Opens bus, closing the one opened before
+     * \retval 0 on success, -1 on error
+     */
+    virtual int open(const char *) = 0;
+
+    /*! \brief Largest transaction, data bytes after register number */
+    virtual uint16_t maxBurst() const = 0;
+
+    /*! \brief Writes message: register number, then data
+     * \param[in] addr 7-bit device address
+     * \param[in] msg Message
+     * \param[in] len Message length, register number included
+     * \retval 0 on success, -1 on error
+     */
+    virtual int write(uint8_t addr, const uint8_t *msg, uint16_t len) = 0;
+
+    /*! \brief Writes the same message to several devices on the bus, in one
+     * combined transaction if backend can do it
+     * \retval 0 on success, -1 if some write failed
+     */
+    virtual int writeMulti(const uint8_t *addrs, int n, const uint8_t *msg, uint16_t len);
+
+    /*! \brief Tells whether the other transport drives the same bus, so
+     * writeMulti() of this one may reach devices opened through the other
+     */
+    virtual bool sameBus(const lcd_transport *io) const { return io == this; }
+
+    /*! \brief Reads register
+     * \retval 0 on success, -1 on error
+     */
+    virtual int read(uint8_t addr, uint8_t reg, uint8_t *val) = 0;
+
+    int write1(uint8_t addr, uint8_t reg, uint8_t val) {
+        uint8_t msg[2] = { reg, val };
+        return write(addr, msg, 2);
+    }
+};
+
+
+extern lcd_transport *lcd_transport_create(const char *);
+
+
+#endif // __TIBBO_LTPS_LCD_TRANSPORT_INCLUDED__
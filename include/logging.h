@@ -2,6 +2,9 @@
 #define LOGGING_H
 
 
+#include <stdint.h>
+
+
 enum log_level
 {
     LVL_DBG = 0,
@@ -11,13 +14,68 @@ enum log_level
 };
 
 
-extern void log(log_level, const char *, ...);
+enum log_sink
+{
+    SINK_CONSOLE = 0x01,
+    SINK_SYSLOG  = 0x02,
+    SINK_FILE    = 0x04
+};
+
+
+/* Messages below this level are compiled out, together with evaluation of
+ * their arguments. Set by build system, e.g. -DLOG_MIN_LEVEL=1 drops DBG()
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL   LVL_DBG
+#endif
+
+
+/* Per call site rate limit: at most LOG_RL_BURST messages every
+ * LOG_RL_INTERVAL milliseconds
+ */
+#define LOG_RL_BURST    10
+#define LOG_RL_INTERVAL 5000
+
+
+struct log_ratelimit {
+    uint64_t start;
+    unsigned count;
+    unsigned suppressed;
+};
+
+
+extern int log_level_current;
+extern int log_sinks;
+
+extern void log(log_level, const char *, ...) __attribute__((format(printf, 2, 3)));
+extern bool log_ratelimited(log_ratelimit *, log_level);
+extern bool log_parse_level(const char *, int *);
+extern bool log_configure(int, const char *);
+extern void log_set_console(bool);
+extern void log_start();
+extern void log_stop();
+
+
+#define log_enabled(lvl) ((lvl) >= LOG_MIN_LEVEL && (lvl) >= log_level_current && 0 != log_sinks)
+
+#define LOG_AT(lvl, s, ...) \
+    do { if(log_enabled(lvl)) log(lvl, s, ##__VA_ARGS__); } while(0)
+
+#define LOG_RL(lvl, s, ...) \
+    do { \
+        static log_ratelimit _rl; \
+        if(log_enabled(lvl) && !log_ratelimited(&_rl, lvl)) \
+            log(lvl, s, ##__VA_ARGS__); \
+    } while(0)
+
 
+#define ERR(s, ...)  LOG_AT(LVL_ERR, s, ##__VA_ARGS__)
+#define WARN(s, ...) LOG_AT(LVL_WARN, s,  ##__VA_ARGS__)
+#define LOG(s, ...)  LOG_AT(LVL_INFO, s, ##__VA_ARGS__)
+#define DBG(s, ...)  LOG_AT(LVL_DBG, s, ##__VA_ARGS__)
 
-#define ERR(s, ...)  log(LVL_ERR, s, ##__VA_ARGS__)
-#define WARN(s, ...) log(LVL_WARN, s,  ##__VA_ARGS__)
-#define LOG(s, ...)  log(LVL_INFO, s, ##__VA_ARGS__)
-#define DBG(s, ...)  log(LVL_DBG, s, ##__VA_ARGS__)
+#define ERR_RL(s, ...)  LOG_RL(LVL_ERR, s, ##__VA_ARGS__)
+#define WARN_RL(s, ...) LOG_RL(LVL_WARN, s, ##__VA_ARGS__)
 
 
 #endif // LOGGING_H
@@ -0,0 +1,40 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+enum metric_counter {
+    M_COMMANDS = 0,         // Commands executed
+    M_BYTES_PARSED,         // Bytes received from clients
+    M_CONNECTIONS,          // Clients accepted
+    M_FLUSHES,              // I2C transactions
+    M_I2C_BYTES,            // Bytes sent to I2C bus
+    M_I2C_ERRORS,           // Failed I2C transactions
+    M_NCOUNTERS
+};
+
+
+enum metric_hist {
+    H_BUS_LATENCY = 0,      // I2C transaction time, us
+    H_FLUSH_LATENCY,        // Time from receiving command to its flush(), us
+    H_QUEUE_DEPTH,          // Complete commands found in one read
+    H_BUS_WAIT,             // Time I2C transaction waited for writer thread, us
+    H_RECV_TO_GLASS,        // Time from receiving command to end of its I2C transaction, us
+    H_NHIST
+};
+
+
+typedef size_t (*metrics_source_f)(char *, size_t);
+
+
+extern void metrics_inc(metric_counter, uint64_t = 1);
+extern void metrics_observe(metric_hist, uint32_t);
+extern void metrics_add_source(metrics_source_f);
+extern size_t metrics_format(char *, size_t);
+extern void metrics_flush_hook(void *, unsigned, uint32_t, uint32_t, uint32_t, int);
+
+
+#endif // METRICS_H
@@ -0,0 +1,28 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+
+/* Session file format: REC_MAGIC, session start (wall clock time of
+ * accept, microseconds since the Epoch), then one record per read() from
+ * the client: delta from previous record (from session start for the
+ * first one) in microseconds, length and data. Start, delta and length are
+ * unsigned LEB128 numbers (7 bits per byte, least significant first, high
+ * bit set on all bytes but the last).
+ */
+#define REC_MAGIC       "LCDREC02"
+#define REC_MAGIC_LEN   8
+#define REC_SUFFIX      ".lcdrec"
+
+
+extern FILE *rec_open(const char *, struct in_addr, uint16_t, uint64_t *);
+extern void rec_write(FILE *, uint64_t *, uint64_t, const char *, size_t);
+extern void rec_close(FILE *);
+
+
+#endif // RECORD_H
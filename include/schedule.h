@@ -0,0 +1,24 @@
+#ifndef SCHEDULE_H
+#define SCHEDULE_H
+
+
+#include <stdint.h>
+
+
+class WinStarLCD;
+
+
+extern void sched_init();
+extern int sched_timeout();
+extern void sched_run();
+extern bool sched_command(WinStarLCD *, const char *, uint32_t, uint32_t, const char *);
+extern bool sched_blink(WinStarLCD *, const char *, uint32_t, uint8_t, uint8_t, uint8_t);
+extern bool sched_expire(WinStarLCD *, const char *, uint32_t, uint8_t, uint8_t, uint8_t);
+extern bool sched_cancel(const char *);
+extern void sched_drop(WinStarLCD *);
+extern bool sched_seq_add(const char *, uint32_t, const char *);
+extern bool sched_seq_clear(const char *);
+extern bool sched_play(WinStarLCD *, const char *, const char *, uint32_t);
+
+
+#endif // SCHEDULE_H
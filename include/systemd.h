@@ -0,0 +1,9 @@
+#ifndef SYSTEMD_H
+#define SYSTEMD_H
+
+
+extern int sysd_listen_fd();
+extern bool sysd_notify(const char *);
+
+
+#endif // SYSTEMD_H
@@ -0,0 +1,13 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+
+class WinStarLCD;
+
+
+extern bool tpl_define(WinStarLCD *, unsigned, const char *);
+extern void tpl_clear(WinStarLCD *);
+extern int tpl_set(WinStarLCD *, const char *, const char *);
+
+
+#endif // TEMPLATE_H
@@ -0,0 +1,54 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+#define TW_LEVELS       4
+#define TW_SLOT_BITS    6
+#define TW_SLOTS        (1 << TW_SLOT_BITS)
+
+
+struct wtimer;
+typedef void (*wtimer_cb_f)(wtimer *);
+
+
+struct wtimer {
+    wtimer *next;
+    wtimer *prev;
+    uint64_t expires;       // Absolute time, ms
+    uint32_t interval;      // Repeat interval, ms. 0 for one-shot timers
+    uint16_t slot;          // Level and slot the timer is linked to
+    wtimer_cb_f cb;
+    void *arg;
+};
+
+
+/* Hierarchical timing wheel with 1ms resolution. Each level has 64 slots,
+ * one slot of level N spans all 64 slots of level N-1, timers are moved down
+ * one level when their slot comes up ("cascade"). Per-level occupancy bitmaps
+ * let next expiration and idle stretches be found without walking the slots.
+ */
+class TimerWheel {
+public:
+    TimerWheel();
+    void start(uint64_t);
+    void add(wtimer *, uint64_t);
+    void cancel(wtimer *);
+    bool pending(const wtimer *t) const { return NULL != t->prev; }
+    int timeout(uint64_t) const;
+    void run(uint64_t);
+protected:
+    void link(wtimer *, uint64_t);
+    void cascade(int);
+private:
+    wtimer _slots[TW_LEVELS][TW_SLOTS];    // List heads
+    uint64_t _occupied[TW_LEVELS];
+    uint64_t _now;                          // Last processed tick
+    unsigned _count;
+};
+
+
+#endif // TIMERWHEEL_H
@@ -0,0 +1,55 @@
+#ifndef URING_H
+#define URING_H
+
+
+#ifdef HAVE_IO_URING
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+
+/* Minimal io_uring wrapper over raw system calls (liburing is not available
+ * on target): one submission/completion ring pair and one provided buffer
+ * ring (group 0) for receives
+ */
+struct uring_t {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_head;          // First SQE not yet consumed by kernel
+    unsigned sqe_tail;          // Next SQE to fill
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;             // Both rings, IORING_FEAT_SINGLE_MMAP
+    size_t ring_len;
+    size_t sqes_len;
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    uint8_t *bufs;
+    unsigned nbufs;
+    unsigned buf_size;
+    uint16_t br_tail;
+};
+
+
+extern bool uring_init(uring_t *, unsigned, unsigned, unsigned);
+extern void uring_exit(uring_t *);
+extern int uring_wait(uring_t *, int);
+extern struct io_uring_cqe *uring_peek(uring_t *);
+extern void uring_seen(uring_t *);
+extern uint8_t *uring_buf(uring_t *, const struct io_uring_cqe *);
+extern void uring_recycle(uring_t *, const struct io_uring_cqe *);
+extern void uring_accept(uring_t *, int, uint64_t);
+extern void uring_poll(uring_t *, int, uint64_t);
+extern void uring_recv(uring_t *, int, unsigned, uint64_t);
+extern void uring_cancel(uring_t *, uint64_t);
+#endif // HAVE_IO_URING
+
+
+#endif // URING_H
@@ -2,8 +2,15 @@
 #define UTILS_H
 
 
+#include <stdint.h>
+#include <stddef.h>
+
+
 extern char *trim(char *);
 extern bool get_bool(const char *, int *);
+extern uint64_t now_ms();
+extern uint64_t now_us();
+extern void *map_file(const char *, size_t);
 
 
 #endif // UTILS_H
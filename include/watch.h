@@ -0,0 +1,20 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+
+#include <stdint.h>
+
+
+class WinStarLCD;
+
+
+extern int watch_init();
+extern void watch_exit();
+extern void watch_set_dir(const char *);
+extern void watch_run();
+extern bool watch_add(WinStarLCD *, const char *, uint8_t, uint8_t, uint8_t, uint8_t, const char *);
+extern bool watch_remove(const char *);
+extern void watch_drop(WinStarLCD *);
+
+
+#endif // WATCH_H
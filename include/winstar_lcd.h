@@ -23,14 +23,67 @@
 
 
 #include <stdint.h>
-#ifdef __arm__
-#include "ltps/capi/Ci2c_smbus.h"
-#else
-#include "stubs.h"
-#endif
+#include <stddef.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "lcd_transport.h"
+
+
+#define LCD_CGRAM_SIZE    8                     // Number of user-defined glyphs
+#define LCD_MAX_BARS      (LCD_CGRAM_SIZE-1)    // One slot is shared "full cell" glyph
+#define LCD_GLYPH_CHR(n)  (0x08 | (n))          // CGRAM char code, avoids '\0'
+#define LCD_MAX_GLYPH_DEFS 32                   // Fallback glyphs for missing characters
+#define LCD_DDRAM_SIZE    0x80                  // DDRAM address space
+#define LCD_MAX_ROWS      4
+#define LCD_MAX_COLS      40                    // Also DDRAM cells per line
+#define LCD_PAGE_COLS     20                    // DDRAM column of the second frame page
+#define LCD_STATE_MAGIC   0x3144434C            // "LCD1"
+#define LCD_WRITER_SLOTS  64                    // Bursts queued for writer thread, power of 2
+#define LCD_MAX_OUTPUTS   8                     // Panels one object may drive
+#define LCD_DEFAULT_ADDR  0x20                  // Port extender with A0..A2 grounded
+#define LCD_RETRY_MIN_MS  100                   // First re-init attempt after I2C failure
+#define LCD_RETRY_MAX_MS  10000                 // Backoff limit
+
+
+struct lcd_charset;
+class WinStarLCD;
+
+
+/*! \brief Called after every I2C transaction
+ * \param ctx Context pointer passed to WinStarLCD::setFlushHook()
+ * \param len Number of bytes sent
+ * \param wait Time the transaction was queued for writer thread, microseconds.
+ *        Always 0 when writer thread is not running
+ * \param usec Transaction time in microseconds
+ * \param glass Time from receipt of the data (see WinStarLCD::setReceived())
+ *        to the end of the transaction, microseconds. 0 if it is not known
+ * \param result Value returned by I2C driver, negative on error
+ */
+typedef void (*lcd_flush_hook_f)(void *ctx, unsigned len, uint32_t wait, uint32_t usec, uint32_t glass, int result);
+
+
+/*! \brief Scheduling options of bus writer thread, see WinStarLCD::startWriter()
+ */
+struct lcd_rt_opts {
+    int priority;               // SCHED_FIFO priority 1..99, 0 for normal scheduling
+    uint64_t cpus;              // Bitmask of CPUs writer may run on, 0 for any
+    bool lock_memory;           // Lock process memory with mlockall()
+};
 
 
-#define I2C_MAX_BURST_LEN 32
+/*! \brief Panel connection: port extender at some address of I2C bus.
+ * Output of one display may be added to other objects, which then drive
+ * the panel as well (display groups). Object which drew last owns it
+ */
+struct lcd_output {
+    lcd_transport *io;
+    uint8_t addr;
+    char bus[16];               // Bus number or slot name, the same for outputs sharing the bus
+    WinStarLCD *owner;
+    int failed;                 // Transfer failed, nothing is sent until recover()
+    uint32_t backoff;           // Current re-init interval, ms
+    uint64_t retry_at;          // CLOCK_MONOTONIC time of next re-init, ms. 0 if not scheduled
+};
 
 
 class WinStarLCD {
@@ -48,29 +101,206 @@ protected:
         M_READ = 0x02,
         CLOCK_BIT = 0x04
     };
+public:
+    enum bar_dir {
+        BAR_HORIZONTAL = 0,     // Grows left to right, 5 pixels per cell
+        BAR_VERTICAL            // Grows bottom to top, 8 pixels per cell
+    };
+    enum align {
+        ALIGN_LEFT = 0,
+        ALIGN_CENTER,
+        ALIGN_RIGHT
+    };
+protected:
+    struct bar_t {
+        uint8_t used;
+        uint8_t dir;
+        uint8_t glyph;          // CGRAM slot reserved for partial cell
+        uint8_t gpx;            // Pixels currently loaded into glyph, 0 if none
+        uint8_t row;
+        uint8_t col;
+        uint8_t len;            // Bar length in cells
+        uint16_t px;            // Current value in pixels
+    };
+    struct glyph_def {
+        uint32_t ucs;           // Code point drawn by this glyph
+        uint8_t bitmap[8];
+    };
+    struct burst_t {            // I2C transaction queued for writer thread
+        uint64_t queued;        // CLOCK_MONOTONIC time of flush(), us
+        uint64_t rx;            // Receipt of the data, us, 0 if not known
+        uint8_t len;
+        uint8_t refs;           // Lanes which have not sent it yet
+        uint8_t data[LCD_MAX_BURST+1];  // GPIO register number, then data
+    };
+    struct lane_t {             // Writer thread serving outputs on one bus
+        WinStarLCD *lcd;
+        pthread_t thread;
+        uint8_t id;
+        uint32_t tail;          // Next slot to send
+        sem_t used;
+    };
+public:
+    /*! \brief Snapshot of display state, see \c saveState().
+     * Plain data, may be kept in a memory-mapped file
+     */
+    struct state_t {
+        uint32_t magic;         // LCD_STATE_MAGIC
+        uint32_t size;          // sizeof(state_t), guards against layout changes
+        uint32_t valid;         // Zero while snapshot is being written
+        uint8_t cols;
+        uint8_t rows;
+        uint8_t ac;
+        uint8_t ac_cgram;
+        uint8_t disp_ctl;
+        uint8_t entry;
+        uint8_t shift;
+        uint8_t ddram[LCD_DDRAM_SIZE];
+        uint8_t cgram[LCD_CGRAM_SIZE * 8];
+        uint8_t glyphs;
+        int8_t full_glyph;
+        uint8_t gdef_cnt;
+        uint8_t cg_cache;
+        bar_t bars[LCD_MAX_BARS];
+        glyph_def gdefs[LCD_MAX_GLYPH_DEFS];
+        uint32_t cg_ucs[LCD_CGRAM_SIZE];
+        uint32_t cg_stamp[LCD_CGRAM_SIZE];
+        uint32_t cg_clock;
+    };
 protected: // Members
-    uint8_t _buf[I2C_MAX_BURST_LEN];
-    uint8_t _bufp;
+    uint8_t _buf[LCD_MAX_BURST+1];      // GPIO register number, then data
+    uint8_t _bufp;              // Data bytes in _buf
+    uint8_t _burst;             // Data bytes of one transaction every output takes
+    bool _own_io;               // Transport of _own is deleted with the object
     uint8_t _mode;
-    uint8_t _dev_addr;
-    Ci2c_smbus _i2c;
+    lcd_output _own;            // Output set up by init()
+    lcd_output *_outs[LCD_MAX_OUTPUTS];
+    uint8_t _out_lane[LCD_MAX_OUTPUTS];
+    uint8_t _nouts;
+    uint8_t _mask;              // Outputs written, bit per index of _outs
+    uint8_t _ac;                // Address counter, as seen by the controller
+    uint8_t _ac_cgram;          // Address counter points into CGRAM
+    bool _ac_known;             // _ac matches the controller (false after sync)
+    uint8_t _disp_ctl;          // Last display control command, 0xFF if unknown
+    uint8_t _entry;             // Last entry mode command, 0xFF if unknown
+    uint8_t _func;              // Last function set command, 0xFF if unknown
+    uint8_t _shift;             // DDRAM column shown in the leftmost cell, 0..39
+    uint8_t _page_offs;         // DDRAM column of cell (row, 0) for drawing methods
+    bool _frame;                // Frame is being drawn into the hidden page
+    uint32_t _skipped;          // Commands not sent since they change nothing
+    uint32_t _recovered;        // Panels brought back after I2C failure
+    uint16_t _scrub_pos;        // Next visible cell scrub() checks
+    uint32_t _scrub_cells;      // Cells read back by scrub()
+    uint32_t _scrub_fixed;      // Cells scrub() found corrupted and rewrote
+    const lcd_charset *_charset;
+    uint8_t _cols;
+    uint8_t _rows;
+    uint8_t _row_offs[LCD_MAX_ROWS];    // DDRAM address of the first cell of each row
+    uint8_t _ddram[LCD_DDRAM_SIZE];     // Shadow copy of display memory
+    uint8_t _stale[LCD_DDRAM_SIZE / 8]; // Cells some panel may show differently
+    uint8_t _cgram[LCD_CGRAM_SIZE * 8]; // Shadow copy of glyph memory
+    bool _dirty;                // State changed since last saveState()
+    uint8_t _glyphs;            // Bitmask of allocated CGRAM slots
+    int8_t _full_glyph;         // Slot of shared "full cell" glyph or -1
+    bar_t _bars[LCD_MAX_BARS];
+    glyph_def _gdefs[LCD_MAX_GLYPH_DEFS];
+    uint8_t _gdef_cnt;
+    uint8_t _cg_cache;          // Bitmask of CGRAM slots caching fallback glyphs
+    uint32_t _cg_ucs[LCD_CGRAM_SIZE];
+    uint32_t _cg_stamp[LCD_CGRAM_SIZE];
+    uint32_t _cg_clock;
+    lcd_flush_hook_f _hook;
+    void *_hook_ctx;
+    uint64_t _rx;               // Receipt of data being drawn, us, 0 if not known
+    bool _writer_on;            // Transactions go through writer threads
+    bool _lock_memory;
+    lane_t _lanes[LCD_MAX_OUTPUTS];
+    uint8_t _nlanes;
+    burst_t _ring[LCD_WRITER_SLOTS];
+    uint32_t _ring_head;        // Next slot to fill, written by flush()
+    int _drain_wait;            // drain() waits for the ring to empty
+    sem_t _ring_free;
+    sem_t _ring_idle;
 protected: // Methods
+    static void *writerThread(void *);
+    void writerLoop(lane_t *);
+    void busWrite(const uint8_t *, uint8_t, uint64_t, uint64_t, int);
     inline void i2c_out(uint8_t);
     inline void rawdata(uint8_t);
+    bool redundant(uint8_t) const;
+    void stepAc(bool);
+    bool _do_sync();
     void _do_init();
+    void _do_resume(const state_t *);
+    void forget();
+    void setBurst();
+    void loadGlyphs();
+    bool readCell(lcd_output *, uint8_t *);
+    bool pending() const;
+    void scrollTo(uint8_t);
+    uint8_t cellAddr(uint8_t, uint8_t) const;
+    void putCells(uint8_t, uint8_t, const uint8_t *, uint8_t);
+    uint8_t barCell(const bar_t *, uint16_t, uint8_t) const;
+    void barGlyph(bar_t *, uint8_t);
+    int fallbackGlyph(uint32_t, uint32_t);
+    size_t encodeSince(const char *, size_t, uint8_t *, size_t, size_t *, uint32_t);
 public:
     WinStarLCD();
     ~WinStarLCD();
-    int init(int);
-    int init(const char *);
+    int init(int, const state_t * = NULL);
+    int init(const char *, const state_t * = NULL);
+    void setTransport(lcd_transport *, bool = false);
+    void setAddress(uint8_t);
+    lcd_output *output() { return &_own; }
+    bool addOutput(lcd_output *);
+    uint8_t outputs() const { return _nouts; }
+    const lcd_output *outputAt(uint8_t i) const { return _outs[i]; }
+    void claim();
+    bool validState(const state_t *) const;
+    bool saveState(state_t *);
     void flush();
+    void drain();
+    void setFlushHook(lcd_flush_hook_f, void * = NULL);
+    void setReceived(uint64_t);
+    int startWriter(const lcd_rt_opts * = NULL);
+    void stopWriter();
     void command(uint8_t);
     void data(uint8_t);
     void clear();
     void home();
     void echo(const char *);
+    void echo(const char *, size_t);
+    size_t encode(const char *, size_t, uint8_t *, size_t, size_t * = NULL);
+    bool setCharset(const char *);
+    bool defineGlyph(uint32_t, const uint8_t *);
     void setAddr(uint8_t);
-    void showCursor(bool);
+    void showCursor(bool, bool = false);
+    void setEntryMode(bool, bool = false);
+    uint32_t skippedCommands() const { return _skipped; }
+    uint32_t recoveredPanels() const { return _recovered; }
+    int recover();
+    uint32_t scrubbedCells() const { return _scrub_cells; }
+    uint32_t repairedCells() const { return _scrub_fixed; }
+    bool scrub();
+    uint8_t pageAddr(uint8_t) const;
+    bool framesSupported() const { return _cols <= LCD_PAGE_COLS && _rows <= 2; }
+    bool beginFrame();
+    bool endFrame();
+    bool setGeometry(uint8_t, uint8_t);
+    uint8_t cols() const { return _cols; }
+    uint8_t rows() const { return _rows; }
+    void setCursor(uint8_t, uint8_t);
+    void writeAt(uint8_t, uint8_t, const char *, size_t);
+    void writeLine(uint8_t, const char *, align = ALIGN_LEFT);
+    void fillRegion(uint8_t, uint8_t, uint8_t, uint8_t, char = ' ');
+    uint8_t readCells(uint8_t, uint8_t, uint8_t *, uint8_t) const;
+    void writeCells(uint8_t, uint8_t, const uint8_t *, uint8_t);
+    int allocGlyph();
+    void freeGlyph(uint8_t);
+    void setGlyph(uint8_t, const uint8_t *);
+    bool barDefine(uint8_t, bar_dir, uint8_t, uint8_t, uint8_t);
+    void barSet(uint8_t, uint16_t);
+    void barRemove(uint8_t);
 };
 
 
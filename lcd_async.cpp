@@ -0,0 +1,290 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "lcd_async.h"
+
+
+/*! \file lcd_async.cpp
+ *  \brief Asynchronous front end of WinStarLCD.
+ *
+ * Submissions go into a fixed ring guarded by a mutex, held only for the
+ * copy. The worker applies everything queued as one batch: the picture is
+ * taken from the display shadow copy, all submissions are drawn into it
+ * in order, and every changed row span is written once. Display object
+ * must not be used directly while the worker runs.
+ */
+
+
+/*! \brief Constructor
+ * \param[in] lcd Initialized display, driven by the worker once started
+ */
+WinStarAsync::WinStarAsync(WinStarLCD *lcd): _lcd(lcd), _head(0), _tail(0), _seq(0), _done(0),
+    _running(false), _stop(false), _efd(-1)
+{
+    pthread_mutex_init(&_lock, NULL);
+}
+
+
+WinStarAsync::~WinStarAsync()
+{
+    stop();
+    pthread_mutex_destroy(&_lock);
+}
+
+
+void *
+WinStarAsync::workerThread(void *arg)
+{
+    ((WinStarAsync *)arg)->workerLoop();
+    return NULL;
+}
+
+
+/*! \brief Draws codes into the picture, remembering changed span of the row
+ */
+void
+WinStarAsync::put(uint8_t row, uint8_t col, const uint8_t *codes, uint8_t n)
+{
+    if(row >= _lcd->rows() || col >= _lcd->cols() || 0 == n)
+        return;
+    if(n > _lcd->cols() - col)
+        n = _lcd->cols() - col;
+
+    memcpy(&_grid[row][col], codes, n);
+    if(col < _lo[row])
+        _lo[row] = col;
+    if(col + n - 1 > _hi[row])
+        _hi[row] = col + n - 1;
+}
+
+
+/*! \brief Draws one submission into the picture
+ */
+void
+WinStarAsync::apply(const sub_t *s)
+{
+    uint8_t codes[LCD_MAX_COLS];
+    const char *p, *eol;
+    uint8_t r;
+    size_t n;
+
+    switch(s->kind) {
+        case SUB_TEXT:
+            n = _lcd->encode(s->text, strlen(s->text), codes, sizeof(codes));
+            put(s->row, s->col, codes, n);
+            break;
+
+        case SUB_REGION:
+            for(r=0, p=s->text; r<s->h; ++r) {
+                eol = strchr(p, '\n');
+                if(NULL == eol)
+                    eol = p + strlen(p);
+                n = _lcd->encode(p, eol - p, codes, s->w);
+                memset(&codes[n], ' ', s->w - n);
+                put(s->row + r, s->col, codes, s->w);
+                p = ('\0' == *eol) ? eol : eol + 1;
+            }
+            break;
+
+        case SUB_CLEAR:
+            memset(codes, ' ', sizeof(codes));
+            for(r=0; r<_lcd->rows(); ++r)
+                put(r, 0, codes, _lcd->cols());
+            break;
+    }
+}
+
+
+void
+WinStarAsync::workerLoop()
+{
+    uint32_t head, t, last;
+    uint64_t cnt;
+    sub_t *s;
+    uint8_t r;
+
+    for(;;) {
+        while(0 != sem_wait(&_wake))
+            ; // EINTR
+
+        head = __atomic_load_n(&_head, __ATOMIC_ACQUIRE);
+        if(_tail == head) {
+            if(__atomic_load_n(&_stop, __ATOMIC_ACQUIRE))
+                break; // Woken up by stop(), everything is sent
+            continue;
+        }
+
+        for(r=0; r<_lcd->rows(); ++r) {
+            _lcd->readCells(r, 0, _grid[r], _lcd->cols());
+            _lo[r] = 0xFF;
+            _hi[r] = 0;
+        }
+
+        for(t=_tail; t != head; ++t)
+            apply(&_subs[t & (LCD_ASYNC_SLOTS - 1)]);
+
+        for(r=0; r<_lcd->rows(); ++r)
+            if(_lo[r] <= _hi[r])
+                _lcd->writeCells(r, _lo[r], &_grid[r][_lo[r]], _hi[r] - _lo[r] + 1);
+        _lcd->drain();
+
+        for(t=_tail, last=_done; t != head; ++t) {
+            s = &_subs[t & (LCD_ASYNC_SLOTS - 1)];
+            if(NULL != s->done)
+                s->done(s->ctx, s->seq);
+            last = s->seq;
+        }
+
+        cnt = head - _tail;
+        __atomic_store_n(&_done, last, __ATOMIC_RELEASE);
+        __atomic_store_n(&_tail, head, __ATOMIC_RELEASE);
+        if(-1 == write(_efd, &cnt, sizeof(cnt)))
+            continue; // Counter is full: reader is far behind, it wakes anyway
+    }
+}
+
+
+/*! \brief Starts worker thread and creates completion eventfd
+ * \retval 0 on success
+ * \retval -1 on error, errno is set
+ */
+int
+WinStarAsync::start()
+{
+    int res;
+
+    if(_running)
+        return 0;
+
+    _efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(-1 == _efd)
+        return -1;
+
+    _stop = false;
+    sem_init(&_wake, 0, 0);
+    res = pthread_create(&_worker, NULL, workerThread, this);
+    if(0 != res) {
+        sem_destroy(&_wake);
+        close(_efd);
+        _efd = -1;
+        errno = res;
+        return -1;
+    }
+
+    _running = true;
+    return 0;
+}
+
+
+/*! \brief Sends everything submitted and stops worker thread
+ */
+void
+WinStarAsync::stop()
+{
+    if(!_running)
+        return;
+
+    __atomic_store_n(&_stop, true, __ATOMIC_RELEASE);
+    sem_post(&_wake);
+    pthread_join(_worker, NULL);
+    sem_destroy(&_wake);
+    close(_efd);
+    _efd = -1;
+    _running = false;
+}
+
+
+int32_t
+WinStarAsync::submit(uint8_t kind, uint8_t row, uint8_t col, uint8_t w, uint8_t h, const char *text,
+    lcd_done_f done, void *ctx)
+{
+    sub_t *s;
+    int32_t seq;
+
+    if(!_running) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    pthread_mutex_lock(&_lock);
+    if(LCD_ASYNC_SLOTS == _head - __atomic_load_n(&_tail, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&_lock);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    s = &_subs[_head & (LCD_ASYNC_SLOTS - 1)];
+    _seq = (_seq + 1) & 0x7FFFFFFF;
+    if(0 == _seq)
+        _seq = 1;
+    seq = _seq;
+
+    s->seq = seq;
+    s->kind = kind;
+    s->row = row;
+    s->col = col;
+    s->w = (w > LCD_MAX_COLS) ? LCD_MAX_COLS : w;
+    s->h = h;
+    s->done = done;
+    s->ctx = ctx;
+    strncpy(s->text, (NULL == text) ? "" : text, sizeof(s->text) - 1);
+    s->text[sizeof(s->text) - 1] = '\0';
+
+    __atomic_store_n(&_head, _head + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&_lock);
+
+    sem_post(&_wake);
+    return seq;
+}
+
+
+/*! \brief Queues UTF-8 text to be printed starting at given cell. Text is
+ * cut at the end of the row
+ * \param[in] row Row
+ * \param[in] col Column
+ * \param[in] text Text to print
+ * \param[in] done Called from worker thread once text is on the display, may be NULL
+ * \param[in] ctx Context passed to \c done
+ * \retval Sequence number (positive), see \c completed()
+ * \retval -1 if queue is full (errno is EAGAIN) or worker is not running
+ */
+int32_t
+WinStarAsync::submitText(uint8_t row, uint8_t col, const char *text, lcd_done_f done, void *ctx)
+{
+    return submit(SUB_TEXT, row, col, 0, 1, text, done, ctx);
+}
+
+
+/*! \brief Queues region update. Lines of text, separated by '\\n', go to
+ * the rows of the region, cut or padded with spaces to its width; rows
+ * without a line are blanked
+ * \param[in] row Top row of the region
+ * \param[in] col Left column of the region
+ * \param[in] w Region width
+ * \param[in] h Region height
+ * \param[in] text Lines to show
+ * \param[in] done Called from worker thread once region is on the display, may be NULL
+ * \param[in] ctx Context passed to \c done
+ * \retval Sequence number (positive), see \c completed()
+ * \retval -1 if queue is full (errno is EAGAIN) or worker is not running
+ */
+int32_t
+WinStarAsync::submitRegion(uint8_t row, uint8_t col, uint8_t w, uint8_t h, const char *text,
+    lcd_done_f done, void *ctx)
+{
+    return submit(SUB_REGION, row, col, w, h, text, done, ctx);
+}
+
+
+/*! \brief Queues blanking of the whole display
+ * \param[in] done Called from worker thread once display is blank, may be NULL
+ * \param[in] ctx Context passed to \c done
+ * \retval Sequence number (positive), see \c completed()
+ * \retval -1 if queue is full (errno is EAGAIN) or worker is not running
+ */
+int32_t
+WinStarAsync::submitClear(lcd_done_f done, void *ctx)
+{
+    return submit(SUB_CLEAR, 0, 0, 0, 0, NULL, done, ctx);
+}
@@ -0,0 +1,219 @@
+#include <string.h>
+#include <strings.h>
+#include "lcd_charset.h"
+
+
+/* Character generator ROM tables. ASCII part of every ROM is described by
+ * "direct" bitmap, everything else is listed in code point order so lookups
+ * can use binary search.
+ */
+
+/* HD44780U ROM code A00: ASCII (except backslash and tilde), half-width
+ * katakana and some Greek and math symbols
+ */
+static const lcd_charmap _a00_map[] = {
+    { 0x00A2, 0xEC }, { 0x00A5, 0x5C }, { 0x00B0, 0xDF }, { 0x00E4, 0xE1 }, { 0x00F1, 0xEE },
+    { 0x00F6, 0xEF }, { 0x00F7, 0xFD }, { 0x00FC, 0xF5 }, { 0x03A3, 0xF6 }, { 0x03A9, 0xF4 },
+    { 0x03B1, 0xE0 }, { 0x03B2, 0xE2 }, { 0x03B5, 0xE3 }, { 0x03B8, 0xF2 }, { 0x03BC, 0xE4 },
+    { 0x03C0, 0xF7 }, { 0x03C1, 0xE6 }, { 0x03C3, 0xE5 }, { 0x2190, 0x7F }, { 0x2192, 0x7E },
+    { 0x221A, 0xE8 }, { 0x221E, 0xF3 }, { 0x2588, 0xFF }, { 0xFF61, 0xA1 }, { 0xFF62, 0xA2 },
+    { 0xFF63, 0xA3 }, { 0xFF64, 0xA4 }, { 0xFF65, 0xA5 }, { 0xFF66, 0xA6 }, { 0xFF67, 0xA7 },
+    { 0xFF68, 0xA8 }, { 0xFF69, 0xA9 }, { 0xFF6A, 0xAA }, { 0xFF6B, 0xAB }, { 0xFF6C, 0xAC },
+    { 0xFF6D, 0xAD }, { 0xFF6E, 0xAE }, { 0xFF6F, 0xAF }, { 0xFF70, 0xB0 }, { 0xFF71, 0xB1 },
+    { 0xFF72, 0xB2 }, { 0xFF73, 0xB3 }, { 0xFF74, 0xB4 }, { 0xFF75, 0xB5 }, { 0xFF76, 0xB6 },
+    { 0xFF77, 0xB7 }, { 0xFF78, 0xB8 }, { 0xFF79, 0xB9 }, { 0xFF7A, 0xBA }, { 0xFF7B, 0xBB },
+    { 0xFF7C, 0xBC }, { 0xFF7D, 0xBD }, { 0xFF7E, 0xBE }, { 0xFF7F, 0xBF }, { 0xFF80, 0xC0 },
+    { 0xFF81, 0xC1 }, { 0xFF82, 0xC2 }, { 0xFF83, 0xC3 }, { 0xFF84, 0xC4 }, { 0xFF85, 0xC5 },
+    { 0xFF86, 0xC6 }, { 0xFF87, 0xC7 }, { 0xFF88, 0xC8 }, { 0xFF89, 0xC9 }, { 0xFF8A, 0xCA },
+    { 0xFF8B, 0xCB }, { 0xFF8C, 0xCC }, { 0xFF8D, 0xCD }, { 0xFF8E, 0xCE }, { 0xFF8F, 0xCF },
+    { 0xFF90, 0xD0 }, { 0xFF91, 0xD1 }, { 0xFF92, 0xD2 }, { 0xFF93, 0xD3 }, { 0xFF94, 0xD4 },
+    { 0xFF95, 0xD5 }, { 0xFF96, 0xD6 }, { 0xFF97, 0xD7 }, { 0xFF98, 0xD8 }, { 0xFF99, 0xD9 },
+    { 0xFF9A, 0xDA }, { 0xFF9B, 0xDB }, { 0xFF9C, 0xDC }, { 0xFF9D, 0xDD }, { 0xFF9E, 0xDE },
+    { 0xFF9F, 0xDF },
+};
+
+
+/* ROM code A02: ASCII and Latin-1 supplement at their ISO 8859-1 places
+ */
+static const lcd_charmap _a02_map[] = {
+    { 0x00A1, 0xA1 }, { 0x00A2, 0xA2 }, { 0x00A3, 0xA3 }, { 0x00A4, 0xA4 }, { 0x00A5, 0xA5 },
+    { 0x00A6, 0xA6 }, { 0x00A7, 0xA7 }, { 0x00A8, 0xA8 }, { 0x00A9, 0xA9 }, { 0x00AA, 0xAA },
+    { 0x00AB, 0xAB }, { 0x00AC, 0xAC }, { 0x00AD, 0xAD }, { 0x00AE, 0xAE }, { 0x00AF, 0xAF },
+    { 0x00B0, 0xB0 }, { 0x00B1, 0xB1 }, { 0x00B2, 0xB2 }, { 0x00B3, 0xB3 }, { 0x00B4, 0xB4 },
+    { 0x00B5, 0xB5 }, { 0x00B6, 0xB6 }, { 0x00B7, 0xB7 }, { 0x00B8, 0xB8 }, { 0x00B9, 0xB9 },
+    { 0x00BA, 0xBA }, { 0x00BB, 0xBB }, { 0x00BC, 0xBC }, { 0x00BD, 0xBD }, { 0x00BE, 0xBE },
+    { 0x00BF, 0xBF }, { 0x00C0, 0xC0 }, { 0x00C1, 0xC1 }, { 0x00C2, 0xC2 }, { 0x00C3, 0xC3 },
+    { 0x00C4, 0xC4 }, { 0x00C5, 0xC5 }, { 0x00C6, 0xC6 }, { 0x00C7, 0xC7 }, { 0x00C8, 0xC8 },
+    { 0x00C9, 0xC9 }, { 0x00CA, 0xCA }, { 0x00CB, 0xCB }, { 0x00CC, 0xCC }, { 0x00CD, 0xCD },
+    { 0x00CE, 0xCE }, { 0x00CF, 0xCF }, { 0x00D0, 0xD0 }, { 0x00D1, 0xD1 }, { 0x00D2, 0xD2 },
+    { 0x00D3, 0xD3 }, { 0x00D4, 0xD4 }, { 0x00D5, 0xD5 }, { 0x00D6, 0xD6 }, { 0x00D7, 0xD7 },
+    { 0x00D8, 0xD8 }, { 0x00D9, 0xD9 }, { 0x00DA, 0xDA }, { 0x00DB, 0xDB }, { 0x00DC, 0xDC },
+    { 0x00DD, 0xDD }, { 0x00DE, 0xDE }, { 0x00DF, 0xDF }, { 0x00E0, 0xE0 }, { 0x00E1, 0xE1 },
+    { 0x00E2, 0xE2 }, { 0x00E3, 0xE3 }, { 0x00E4, 0xE4 }, { 0x00E5, 0xE5 }, { 0x00E6, 0xE6 },
+    { 0x00E7, 0xE7 }, { 0x00E8, 0xE8 }, { 0x00E9, 0xE9 }, { 0x00EA, 0xEA }, { 0x00EB, 0xEB },
+    { 0x00EC, 0xEC }, { 0x00ED, 0xED }, { 0x00EE, 0xEE }, { 0x00EF, 0xEF }, { 0x00F0, 0xF0 },
+    { 0x00F1, 0xF1 }, { 0x00F2, 0xF2 }, { 0x00F3, 0xF3 }, { 0x00F4, 0xF4 }, { 0x00F5, 0xF5 },
+    { 0x00F6, 0xF6 }, { 0x00F7, 0xF7 }, { 0x00F8, 0xF8 }, { 0x00F9, 0xF9 }, { 0x00FA, 0xFA },
+    { 0x00FB, 0xFB }, { 0x00FC, 0xFC }, { 0x00FD, 0xFD }, { 0x00FE, 0xFE }, { 0x00FF, 0xFF },
+};
+
+
+/* Cyrillic ROM, laid out as Windows-1251 code page
+ */
+static const lcd_charmap _cyrillic_map[] = {
+    { 0x00A0, 0xA0 }, { 0x00A4, 0xA4 }, { 0x00A6, 0xA6 }, { 0x00A7, 0xA7 }, { 0x00A9, 0xA9 },
+    { 0x00AB, 0xAB }, { 0x00AC, 0xAC }, { 0x00AE, 0xAE }, { 0x00B0, 0xB0 }, { 0x00B1, 0xB1 },
+    { 0x00B5, 0xB5 }, { 0x00B6, 0xB6 }, { 0x00B7, 0xB7 }, { 0x00BB, 0xBB }, { 0x0401, 0xA8 },
+    { 0x0404, 0xAA }, { 0x0406, 0xB2 }, { 0x0407, 0xAF }, { 0x040E, 0xA1 }, { 0x0410, 0xC0 },
+    { 0x0411, 0xC1 }, { 0x0412, 0xC2 }, { 0x0413, 0xC3 }, { 0x0414, 0xC4 }, { 0x0415, 0xC5 },
+    { 0x0416, 0xC6 }, { 0x0417, 0xC7 }, { 0x0418, 0xC8 }, { 0x0419, 0xC9 }, { 0x041A, 0xCA },
+    { 0x041B, 0xCB }, { 0x041C, 0xCC }, { 0x041D, 0xCD }, { 0x041E, 0xCE }, { 0x041F, 0xCF },
+    { 0x0420, 0xD0 }, { 0x0421, 0xD1 }, { 0x0422, 0xD2 }, { 0x0423, 0xD3 }, { 0x0424, 0xD4 },
+    { 0x0425, 0xD5 }, { 0x0426, 0xD6 }, { 0x0427, 0xD7 }, { 0x0428, 0xD8 }, { 0x0429, 0xD9 },
+    { 0x042A, 0xDA }, { 0x042B, 0xDB }, { 0x042C, 0xDC }, { 0x042D, 0xDD }, { 0x042E, 0xDE },
+    { 0x042F, 0xDF }, { 0x0430, 0xE0 }, { 0x0431, 0xE1 }, { 0x0432, 0xE2 }, { 0x0433, 0xE3 },
+    { 0x0434, 0xE4 }, { 0x0435, 0xE5 }, { 0x0436, 0xE6 }, { 0x0437, 0xE7 }, { 0x0438, 0xE8 },
+    { 0x0439, 0xE9 }, { 0x043A, 0xEA }, { 0x043B, 0xEB }, { 0x043C, 0xEC }, { 0x043D, 0xED },
+    { 0x043E, 0xEE }, { 0x043F, 0xEF }, { 0x0440, 0xF0 }, { 0x0441, 0xF1 }, { 0x0442, 0xF2 },
+    { 0x0443, 0xF3 }, { 0x0444, 0xF4 }, { 0x0445, 0xF5 }, { 0x0446, 0xF6 }, { 0x0447, 0xF7 },
+    { 0x0448, 0xF8 }, { 0x0449, 0xF9 }, { 0x044A, 0xFA }, { 0x044B, 0xFB }, { 0x044C, 0xFC },
+    { 0x044D, 0xFD }, { 0x044E, 0xFE }, { 0x044F, 0xFF }, { 0x0451, 0xB8 }, { 0x0454, 0xBA },
+    { 0x0456, 0xB3 }, { 0x0457, 0xBF }, { 0x045E, 0xA2 }, { 0x0490, 0xA5 }, { 0x0491, 0xB4 },
+    { 0x2013, 0x96 }, { 0x2014, 0x97 }, { 0x2018, 0x91 }, { 0x2019, 0x92 }, { 0x201C, 0x93 },
+    { 0x201D, 0x94 }, { 0x2022, 0x95 }, { 0x2026, 0x85 }, { 0x20AC, 0x88 }, { 0x2116, 0xB9 },
+    { 0x2122, 0x99 },
+};
+
+
+static const lcd_charset _charsets[] = {
+    { "Cyrillic",   { 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF },
+        _cyrillic_map, sizeof(_cyrillic_map)/sizeof(_cyrillic_map[0]), true },
+    { "A00",        { 0xFFFFFFFF, 0xFFFFFFFF, 0xEFFFFFFF, 0x3FFFFFFF },
+        _a00_map, sizeof(_a00_map)/sizeof(_a00_map[0]), false },
+    { "A02",        { 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF },
+        _a02_map, sizeof(_a02_map)/sizeof(_a02_map[0]), true },
+};
+
+
+/*! \brief Finds charset by name
+ * \param[in] name Charset name, case insensitive. NULL selects default one
+ * \retval Charset descriptor or NULL if there is no charset with such name
+ */
+const lcd_charset *
+lcd_find_charset(const char *name)
+{
+    size_t i;
+
+    if(NULL == name)
+        return &_charsets[0];
+
+    for(i=0; i<sizeof(_charsets)/sizeof(_charsets[0]); ++i)
+        if(0 == strcasecmp(name, _charsets[i].name))
+            return &_charsets[i];
+
+    return NULL;
+}
+
+
+/*! \brief Translates Unicode code point into display ROM code
+ * \param[in] cs Charset
+ * \param[in] ucs Code point
+ * \retval ROM character code
+ * \retval -1 if ROM has no such character
+ */
+int
+lcd_charset_lookup(const lcd_charset *cs, uint32_t ucs)
+{
+    size_t lo, hi, mid;
+
+    if(ucs < 0x80 && 0 != (cs->direct[ucs >> 5] & (1u << (ucs & 0x1F))))
+        return ucs;
+
+    for(lo=0, hi=cs->mapsize; lo < hi; ) {
+        mid = (lo + hi) / 2;
+        if(cs->map[mid].ucs == ucs)
+            return cs->map[mid].code;
+        if(cs->map[mid].ucs < ucs)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return -1;
+}
+
+
+/*! \brief Measures run of 7-bit characters, checking one machine word at a time
+ * \param[in] s String
+ * \param[in] len String length
+ * \retval Number of leading bytes in range 0x00..0x7F
+ */
+size_t
+lcd_ascii_run(const uint8_t *s, size_t len)
+{
+    const unsigned long high = ~0UL / 0xFF * 0x80;
+    unsigned long w;
+    size_t i;
+
+    for(i=0; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, s + i, sizeof(w));
+        if(0 != (w & high))
+            break;
+    }
+
+    while(i < len && s[i] < 0x80)
+        ++i;
+
+    return i;
+}
+
+
+/*! \brief Decodes one UTF-8 sequence
+ * \param[in] s Input bytes
+ * \param[in] len Number of available bytes
+ * \param[out] ucs Decoded code point
+ * \retval Length of sequence
+ * \retval 0 if sequence is malformed, truncated or overlong
+ */
+size_t
+lcd_utf8_decode(const uint8_t *s, size_t len, uint32_t *ucs)
+{
+    static const uint32_t min[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    uint32_t c;
+    size_t n, i;
+
+    if(0 == len)
+        return 0;
+
+    c = s[0];
+    if(c < 0x80) {
+        *ucs = c;
+        return 1;
+    } else if(0xC0 == (c & 0xE0)) {
+        n = 2;
+        c &= 0x1F;
+    } else if(0xE0 == (c & 0xF0)) {
+        n = 3;
+        c &= 0x0F;
+    } else if(0xF0 == (c & 0xF8)) {
+        n = 4;
+        c &= 0x07;
+    } else {
+        return 0;
+    }
+
+    if(n > len)
+        return 0;
+
+    for(i=1; i<n; ++i) {
+        if(0x80 != (s[i] & 0xC0))
+            return 0;
+        c = (c << 6) | (s[i] & 0x3F);
+    }
+
+    if(c < min[n] || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF))
+        return 0;
+
+    *ucs = c;
+    return n;
+}
@@ -0,0 +1,396 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "lcd_transport.h"
+#ifdef HAVE_LTPS
+#include "ltps/capi/Ci2c_smbus.h"
+#endif
+
+
+/*! \file lcd_transport.cpp
+ *  \brief I2C transport backends of WinStarLCD
+ */
+
+
+#define MCP_DIR         0x00            // Port extender registers
+#define MCP_GPIO        0x09
+#define SIM_PANELS      8               // Addresses 0x20..0x27
+#define MAX_MULTI       8               // Messages of one combined transaction
+
+
+int
+lcd_transport::writeMulti(const uint8_t *addrs, int n, const uint8_t *msg, uint16_t len)
+{
+    int i, res;
+
+    for(i=0, res=0; i<n; ++i)
+        if(write(addrs[i], msg, len) < 0)
+            res = -1;
+    return res;
+}
+
+
+/* Linux i2c-dev. Every transaction is one I2C_RDWR ioctl pointing at the
+ * caller buffer; writes to several devices go as messages of one ioctl,
+ * separated by repeated starts
+ */
+class lcd_i2cdev: public lcd_transport {
+private:
+    int _fd;
+    dev_t _dev;                 // Adapter device, tells buses apart
+public:
+    lcd_i2cdev(): _fd(-1), _dev(0) {}
+    ~lcd_i2cdev() { if(-1 != _fd) close(_fd); }
+    const char *name() const { return "i2cdev"; }
+    uint16_t maxBurst() const { return LCD_MAX_BURST; }
+    int open(const char *);
+    int write(uint8_t, const uint8_t *, uint16_t);
+    int writeMulti(const uint8_t *, int, const uint8_t *, uint16_t);
+    bool sameBus(const lcd_transport *) const;
+    int read(uint8_t, uint8_t, uint8_t *);
+};
+
+
+int
+lcd_i2cdev::open(const char *bus)
+{
+    struct stat st;
+    char path[32];
+
+    if(isdigit(bus[0])) {
+        snprintf(path, sizeof(path), "/dev/i2c-%s", bus);
+    } else if('/' == bus[0]) {
+        snprintf(path, sizeof(path), "%s", bus);
+    } else {
+        errno = ENODEV;
+        return -1;
+    }
+
+    if(-1 != _fd)
+        close(_fd);
+    _fd = ::open(path, O_RDWR | O_CLOEXEC);
+    if(-1 == _fd)
+        return -1;
+
+    _dev = (0 == fstat(_fd, &st)) ? st.st_rdev : 0;
+    return 0;
+}
+
+
+bool
+lcd_i2cdev::sameBus(const lcd_transport *io) const
+{
+    if(io == this)
+        return true;
+    return 0 != _dev && 0 == strcmp(io->name(), name()) && ((const lcd_i2cdev *)io)->_dev == _dev;
+}
+
+
+int
+lcd_i2cdev::write(uint8_t addr, const uint8_t *msg, uint16_t len)
+{
+    struct i2c_rdwr_ioctl_data d;
+    struct i2c_msg m;
+
+    m.addr = addr;
+    m.flags = 0;
+    m.len = len;
+    m.buf = (uint8_t *)msg;
+    d.msgs = &m;
+    d.nmsgs = 1;
+    return (ioctl(_fd, I2C_RDWR, &d) < 0) ? -1 : 0;
+}
+
+
+int
+lcd_i2cdev::writeMulti(const uint8_t *addrs, int n, const uint8_t *msg, uint16_t len)
+{
+    struct i2c_rdwr_ioctl_data d;
+    struct i2c_msg m[MAX_MULTI];
+    int i;
+
+    if(n > MAX_MULTI)
+        return lcd_transport::writeMulti(addrs, n, msg, len);
+
+    for(i=0; i<n; ++i) {
+        m[i].addr = addrs[i];
+        m[i].flags = 0;
+        m[i].len = len;
+        m[i].buf = (uint8_t *)msg;
+    }
+    d.msgs = m;
+    d.nmsgs = n;
+    return (ioctl(_fd, I2C_RDWR, &d) < 0) ? -1 : 0;
+}
+
+
+int
+lcd_i2cdev::read(uint8_t addr, uint8_t reg, uint8_t *val)
+{
+    struct i2c_rdwr_ioctl_data d;
+    struct i2c_msg m[2];
+
+    m[0].addr = addr;
+    m[0].flags = 0;
+    m[0].len = 1;
+    m[0].buf = &reg;
+    m[1].addr = addr;
+    m[1].flags = I2C_M_RD;
+    m[1].len = 1;
+    m[1].buf = val;
+    d.msgs = m;
+    d.nmsgs = 2;
+    return (ioctl(_fd, I2C_RDWR, &d) < 0) ? -1 : 0;
+}
+
+
+#ifdef HAVE_LTPS
+/* Tibbo Ltps library. SMBus block writes carry 32 bytes at most
+ */
+class lcd_ltps: public lcd_transport {
+private:
+    Ci2c_smbus _i2c;
+public:
+    const char *name() const { return "ltps"; }
+    uint16_t maxBurst() const { return 32; }
+    int open(const char *);
+    int write(uint8_t, const uint8_t *, uint16_t);
+    int read(uint8_t, uint8_t, uint8_t *);
+};
+
+
+int
+lcd_ltps::open(const char *bus)
+{
+    if(isdigit(bus[0]))
+        return (_i2c.set_bus(atoi(bus)) < 0) ? -1 : 0;
+    return (_i2c.set_bus(bus) < 0) ? -1 : 0;
+}
+
+
+int
+lcd_ltps::write(uint8_t addr, const uint8_t *msg, uint16_t len)
+{
+    if(2 == len)
+        return (_i2c.W1b(addr, msg[0], msg[1]) < 0) ? -1 : 0;
+    return (_i2c.Wbb(addr, msg[0], (uint8_t *)msg + 1, len - 1) < 0) ? -1 : 0;
+}
+
+
+int
+lcd_ltps::read(uint8_t addr, uint8_t reg, uint8_t *val)
+{
+    return (_i2c.R1b(addr, reg, *val) < 0) ? -1 : 0;
+}
+#endif // HAVE_LTPS
+
+
+/* Simulated panels at every port extender address: HD44780 in 4-bit mode
+ * is followed through GPIO writes, display memory can be read back.
+ * LCD_SIM_FAULTS=n environment variable makes every n-th transaction fail,
+ * to exercise error recovery. It is checked on every transaction, so tests
+ * may break and repair the bus on the fly
+ */
+class lcd_sim: public lcd_transport {
+private:
+    struct panel_t {
+        uint8_t ddram[128];
+        uint8_t cgram[64];
+        uint8_t ac;
+        bool cg;                // Address counter points into CGRAM
+        bool inc;               // Entry mode: increment
+        bool bits8;             // Interface is 8-bit, until switched to 4-bit
+        bool half;              // High nibble is latched
+        uint8_t hi;
+        uint8_t gpio;
+        uint8_t out;            // Data lines driven by controller on read
+    };
+    panel_t _panels[SIM_PANELS];
+    unsigned _n;
+private:
+    bool fault();
+    void step(panel_t *);
+    void exec(panel_t *, uint8_t, bool);
+    void gpio(panel_t *, uint8_t);
+public:
+    lcd_sim();
+    const char *name() const { return "sim"; }
+    uint16_t maxBurst() const { return LCD_MAX_BURST; }
+    int open(const char *) { return 0; }
+    int write(uint8_t, const uint8_t *, uint16_t);
+    int read(uint8_t, uint8_t, uint8_t *);
+};
+
+
+lcd_sim::lcd_sim(): _n(0)
+{
+    int i;
+
+    memset(_panels, 0, sizeof(_panels));
+    for(i=0; i<SIM_PANELS; ++i) {
+        memset(_panels[i].ddram, ' ', sizeof(_panels[i].ddram));
+        _panels[i].bits8 = true;
+        _panels[i].inc = true;
+    }
+}
+
+
+bool
+lcd_sim::fault()
+{
+    const char *s = getenv("LCD_SIM_FAULTS");
+    int every;
+
+    every = (NULL == s) ? 0 : atoi(s);
+    return every > 0 && 0 == __atomic_add_fetch(&_n, 1, __ATOMIC_RELAXED) % every;
+}
+
+
+/* Moves address counter after data access, two-line DDRAM layout
+ */
+void
+lcd_sim::step(panel_t *p)
+{
+    if(p->cg)
+        p->ac = (p->ac + (p->inc ? 1 : -1)) & 0x3F;
+    else if(p->inc)
+        p->ac = (0x27 == p->ac) ? 0x40 : (0x67 == p->ac) ? 0x00 : p->ac + 1;
+    else
+        p->ac = (0x40 == p->ac) ? 0x27 : (0x00 == p->ac) ? 0x67 : p->ac - 1;
+}
+
+
+void
+lcd_sim::exec(panel_t *p, uint8_t v, bool rs)
+{
+    if(rs) {
+        if(p->cg)
+            p->cgram[p->ac & 0x3F] = v;
+        else
+            p->ddram[p->ac & 0x7F] = v;
+        step(p);
+    } else if(v & 0x80) {
+        p->ac = v & 0x7F;
+        p->cg = false;
+    } else if(v & 0x40) {
+        p->ac = v & 0x3F;
+        p->cg = true;
+    } else if(v & 0x20) {
+        p->bits8 = 0 != (v & 0x10);
+        p->half = false;
+    } else if(v & 0x04 && 0 == (v & 0x18)) {
+        p->inc = 0 != (v & 0x02);
+    } else if(v <= 0x03) {
+        if(0x01 == v)
+            memset(p->ddram, ' ', sizeof(p->ddram));
+        p->ac = 0;
+        p->cg = false;
+    }
+}
+
+
+/* GPIO write. Controller latches data lines when E rises
+ */
+void
+lcd_sim::gpio(panel_t *p, uint8_t v)
+{
+    uint8_t nib, c;
+    bool rise;
+
+    rise = 0 == (p->gpio & 0x04) && 0 != (v & 0x04);
+    p->gpio = v;
+    if(!rise)
+        return;
+
+    if(v & 0x02) { // Read: high nibble, then low one
+        c = p->cg ? p->cgram[p->ac & 0x3F] : p->ddram[p->ac & 0x7F];
+        p->out = ((p->half ? c & 0x0F : c >> 4) << 3);
+        if(p->half)
+            step(p);
+        p->half = !p->half;
+        return;
+    }
+
+    nib = (v >> 3) & 0x0F;
+    if(p->bits8) {
+        exec(p, nib << 4, v & 0x01);
+    } else if(!p->half) {
+        p->hi = nib;
+        p->half = true;
+    } else {
+        p->half = false;
+        exec(p, (p->hi << 4) | nib, v & 0x01);
+    }
+}
+
+
+int
+lcd_sim::write(uint8_t addr, const uint8_t *msg, uint16_t len)
+{
+    panel_t *p;
+    uint16_t i;
+
+    if(fault())
+        return -1;
+    if(addr < 0x20 || addr >= 0x20 + SIM_PANELS)
+        return -1;
+
+    p = &_panels[addr - 0x20];
+    if(MCP_GPIO == msg[0])
+        for(i=1; i<len; ++i)
+            gpio(p, msg[i]);
+    return 0;
+}
+
+
+int
+lcd_sim::read(uint8_t addr, uint8_t reg, uint8_t *val)
+{
+    panel_t *p;
+
+    if(fault())
+        return -1;
+    if(addr < 0x20 || addr >= 0x20 + SIM_PANELS)
+        return -1;
+
+    p = &_panels[addr - 0x20];
+    *val = (MCP_GPIO == reg) ? (p->gpio & 0x07) | p->out : 0;
+    return 0;
+}
+
+
+/*! \brief Creates transport backend
+ * \param[in] kind Backend name: i2cdev, ltps or sim. NULL for the default
+ *          one, which is ltps when built with Ltps library and i2cdev otherwise
+ * \retval Transport, to be deleted by the caller
+ * \retval NULL if there is no such backend
+ */
+lcd_transport *
+lcd_transport_create(const char *kind)
+{
+    if(NULL == kind) {
+#ifdef HAVE_LTPS
+        kind = "ltps";
+#else
+        kind = "i2cdev";
+#endif
+    }
+
+    if(0 == strcmp(kind, "i2cdev"))
+        return new lcd_i2cdev();
+#ifdef HAVE_LTPS
+    if(0 == strcmp(kind, "ltps"))
+        return new lcd_ltps();
+#endif
+    if(0 == strcmp(kind, "sim"))
+        return new lcd_sim();
+    return NULL;
+}
@@ -0,0 +1,194 @@
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "winstar_lcd.h"
+
+
+/*! \file lcd_writer.cpp
+ *  \brief Bus writer thread of WinStarLCD.
+ *
+ * flush() copies the transaction into a preallocated ring and the writer
+ * thread sends it to the bus, so timing of I2C bursts does not depend on
+ * the caller being scheduled. Optionally the thread runs with SCHED_FIFO
+ * priority, pinned to some CPUs, with process memory locked: then the
+ * path from flush() to the bus never allocates or page-faults.
+ *
+ * Display group drives panels on several buses: there is a thread (lane)
+ * per bus then, and every queued transaction is sent by all of them in
+ * parallel. The slot is freed by the lane which sends it last. Panels on
+ * the same bus are written by one lane back to back.
+ */
+
+
+#define WRITER_STACK_SIZE (64 * 1024)
+
+
+void *
+WinStarLCD::writerThread(void *arg)
+{
+    ((lane_t *)arg)->lcd->writerLoop((lane_t *)arg);
+    return NULL;
+}
+
+
+void
+WinStarLCD::writerLoop(lane_t *ln)
+{
+    volatile uint8_t stack[WRITER_STACK_SIZE / 2];
+    burst_t *b;
+
+    /* Fault in stack pages which will be used, they stay locked then */
+    if(_lock_memory)
+        memset((void *)stack, 0, sizeof(stack));
+
+    for(;;) {
+        while(0 != sem_wait(&ln->used))
+            ; // EINTR
+
+        if(ln->tail == __atomic_load_n(&_ring_head, __ATOMIC_ACQUIRE))
+            break; // Woken up by stopWriter()
+
+        b = &_ring[ln->tail & (LCD_WRITER_SLOTS - 1)];
+        busWrite(b->data, b->len, b->queued, b->rx, ln->id);
+
+        __atomic_store_n(&ln->tail, ln->tail + 1, __ATOMIC_SEQ_CST);
+        if(1 == __atomic_fetch_sub(&b->refs, 1, __ATOMIC_ACQ_REL))
+            sem_post(&_ring_free);
+
+        if(__atomic_load_n(&_drain_wait, __ATOMIC_SEQ_CST) && ln->tail == __atomic_load_n(&_ring_head, __ATOMIC_SEQ_CST))
+            sem_post(&_ring_idle);
+    }
+}
+
+
+/*! \brief Starts bus writer threads, one per bus of the outputs.
+ * Transactions issued by \c flush() are sent by the threads from then on.
+ * \param[in] rt Scheduling options, NULL for defaults
+ * \retval 0 on success
+ * \retval -1 on error, errno is set. Transactions are sent synchronously then
+ */
+int
+WinStarLCD::startWriter(const lcd_rt_opts *rt)
+{
+    struct sched_param sp;
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    int i, j, res;
+
+    if(_writer_on)
+        return 0;
+
+    /* Outputs with the same bus label share a lane */
+    for(i=0, _nlanes=0; i<_nouts; ++i) {
+        for(j=0; j<i && 0 != strcmp(_outs[j]->bus, _outs[i]->bus); ++j)
+            ;
+        _out_lane[i] = (j < i) ? _out_lane[j] : _nlanes++;
+    }
+    if(0 == _nlanes) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    flush();
+    if(NULL != rt && rt->lock_memory && -1 == mlockall(MCL_CURRENT | MCL_FUTURE))
+        return -1;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, WRITER_STACK_SIZE);
+
+    if(NULL != rt && 0 != rt->priority) {
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = rt->priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &sp);
+    }
+
+    if(NULL != rt && 0 != rt->cpus) {
+        CPU_ZERO(&cpus);
+        for(i=0; i<64; ++i)
+            if(0 != (rt->cpus & ((uint64_t)1 << i)))
+                CPU_SET(i, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    }
+
+    _lock_memory = NULL != rt && rt->lock_memory;
+    _ring_head = 0;
+    sem_init(&_ring_free, 0, LCD_WRITER_SLOTS);
+    sem_init(&_ring_idle, 0, 0);
+
+    for(i=0, res=0; i<_nlanes && 0 == res; ++i) {
+        _lanes[i].lcd = this;
+        _lanes[i].id = i;
+        _lanes[i].tail = 0;
+        sem_init(&_lanes[i].used, 0, 0);
+        res = pthread_create(&_lanes[i].thread, &attr, writerThread, &_lanes[i]);
+        if(0 != res)
+            sem_destroy(&_lanes[i].used);
+    }
+    pthread_attr_destroy(&attr);
+
+    if(0 != res) {
+        /* Nothing was queued, lanes already started see empty ring and exit */
+        for(j=0; j<i-1; ++j) {
+            sem_post(&_lanes[j].used);
+            pthread_join(_lanes[j].thread, NULL);
+            sem_destroy(&_lanes[j].used);
+        }
+        sem_destroy(&_ring_free);
+        sem_destroy(&_ring_idle);
+        _nlanes = 0;
+        errno = res;
+        return -1;
+    }
+
+    _writer_on = true;
+    return 0;
+}
+
+
+/*! \brief Sends all queued transactions and stops writer thread
+ */
+void
+WinStarLCD::stopWriter()
+{
+    int i;
+
+    if(!_writer_on)
+        return;
+
+    drain();
+    _writer_on = false;
+    for(i=0; i<_nlanes; ++i) {
+        sem_post(&_lanes[i].used);
+        pthread_join(_lanes[i].thread, NULL);
+        sem_destroy(&_lanes[i].used);
+    }
+    _nlanes = 0;
+    if(_lock_memory)
+        munlockall();
+
+    sem_destroy(&_ring_free);
+    sem_destroy(&_ring_idle);
+}
+
+
+/*! \brief Flushes internal buffer and waits until all queued transactions
+ * reach every bus
+ */
+void
+WinStarLCD::drain()
+{
+    int i;
+
+    flush();
+    if(!_writer_on)
+        return;
+
+    __atomic_store_n(&_drain_wait, 1, __ATOMIC_SEQ_CST);
+    for(i=0; i<_nlanes; ++i)
+        while(__atomic_load_n(&_lanes[i].tail, __ATOMIC_SEQ_CST) != _ring_head)
+            sem_wait(&_ring_idle); // Stale wakeups are harmless, condition is checked again
+    __atomic_store_n(&_drain_wait, 0, __ATOMIC_SEQ_CST);
+}
@@ -1,49 +1,361 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
 #include "config.h"
 #include "logging.h"
+#include "utils.h"
+
+
+/* Logging backend. Until log_start() is called messages are written
+ * synchronously. After that, callers only format message into a slot of
+ * lock-free ring buffer (bounded MPMC queue by D. Vyukov, used here with
+ * single consumer) and background thread writes them to the sinks. When
+ * the ring is full, messages are dropped and counted, callers never block.
+ */
+
+
+struct log_entry {
+    uint32_t seq;               // Slot sequence number
+    uint8_t lvl;
+    struct timeval tv;
+    char msg[LOG_MSG_LEN];
+};
+
+
+int log_level_current = LVL_INFO;
+int log_sinks = SINK_CONSOLE;
+
+
+static log_entry _ring[LOG_RING_SIZE];
+static uint32_t _head;          // Next slot to fill, shared by producers
+static uint32_t _tail;          // Next slot to drain, owned by the thread
+static uint32_t _dropped;
+static int _running;
+static int _waiting;            // Thread sleeps, producers must wake it
+static pthread_t _thread;
+static pthread_mutex_t _wait_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _wait_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t _sink_mtx = PTHREAD_MUTEX_INITIALIZER;
+static FILE *_file;
+
+
+static const char *_cats[] = { "DEBUG:", "INFO:", "WARN:", "ERROR:" };
+static const int _prios[] = { LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERR };
+
+
+/* Writes formatted message to all enabled sinks
+ */
+static void
+emit(int lvl, const struct timeval *tv, const char *msg)
+{
+    struct tm tm;
+    char ts[32];
+
+    if(lvl < LVL_DBG || lvl > LVL_ERR)
+        return;
+
+    if(0 != (log_sinks & SINK_CONSOLE))
+        fprintf(lvl >= LVL_WARN ? stderr : stdout, "%s: %-6s %s\n", APPNAME, _cats[lvl], msg);
+
+    if(0 != (log_sinks & SINK_SYSLOG))
+        syslog(_prios[lvl], "%s", msg);
+
+    if(0 != (log_sinks & SINK_FILE) && NULL != _file) {
+        localtime_r(&tv->tv_sec, &tm);
+        strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm);
+        fprintf(_file, "%s.%03ld %-6s %s\n", ts, (long)tv->tv_usec / 1000, _cats[lvl], msg);
+    }
+}
+
+
+/* True if there is nothing to drain
+ */
+static bool
+ring_empty()
+{
+    log_entry *e = &_ring[_tail & (LOG_RING_SIZE - 1)];
+
+    return (int32_t)(__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) - (_tail + 1)) < 0;
+}
+
+
+/* Drains the ring. Returns number of messages written
+ */
+static unsigned
+drain()
+{
+    struct timeval tv;
+    log_entry *e;
+    uint32_t dropped;
+    unsigned n;
+    char tmp[64];
+
+    pthread_mutex_lock(&_sink_mtx);
+
+    for(n=0; !ring_empty(); ++n) {
+        e = &_ring[_tail & (LOG_RING_SIZE - 1)];
+        emit(e->lvl, &e->tv, e->msg);
+        __atomic_store_n(&e->seq, _tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        ++_tail;
+    }
+
+    dropped = __atomic_exchange_n(&_dropped, 0, __ATOMIC_RELAXED);
+    if(0 != dropped) {
+        gettimeofday(&tv, NULL);
+        snprintf(tmp, sizeof(tmp), "%u log messages dropped", dropped);
+        emit(LVL_WARN, &tv, tmp);
+    }
+
+    if(0 != n) {
+        fflush(stdout);
+        if(NULL != _file)
+            fflush(_file);
+    }
+
+    pthread_mutex_unlock(&_sink_mtx);
+    return n;
+}
+
+
+static void *
+log_thread(void *)
+{
+    struct timespec ts;
+
+    while(__atomic_load_n(&_running, __ATOMIC_ACQUIRE)) {
+        if(0 != drain())
+            continue;
+
+        /* Nothing to do: announce that we sleep, then check once more to
+         * not miss a message posted in between. Wait is bounded anyway
+         */
+        pthread_mutex_lock(&_wait_mtx);
+        __atomic_store_n(&_waiting, 1, __ATOMIC_SEQ_CST);
+        if(ring_empty() && __atomic_load_n(&_running, __ATOMIC_ACQUIRE)) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 200 * 1000000;
+            if(ts.tv_nsec >= 1000000000) {
+                ts.tv_nsec -= 1000000000;
+                ++ts.tv_sec;
+            }
+            pthread_cond_timedwait(&_wait_cond, &_wait_mtx, &ts);
+        }
+        __atomic_store_n(&_waiting, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&_wait_mtx);
+    }
+
+    drain();
+    return NULL;
+}
 
 
 void
 log(log_level lvl, const char *msg, ...)
 {
+    struct timeval tv;
+    log_entry *e;
+    uint32_t pos, seq;
+    int32_t diff;
     va_list ap;
-    char tmp[1024];
-    FILE *out;
-    const char *cat;
+    char tmp[LOG_MSG_LEN];
+
+    if(!__atomic_load_n(&_running, __ATOMIC_ACQUIRE)) {
+        va_start(ap, msg);
+        vsnprintf(tmp, sizeof(tmp), msg, ap);
+        va_end(ap);
 
+        gettimeofday(&tv, NULL);
+        pthread_mutex_lock(&_sink_mtx);
+        emit(lvl, &tv, tmp);
+        pthread_mutex_unlock(&_sink_mtx);
+        return;
+    }
+
+    /* Claim a slot */
+    pos = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+    for(;;) {
+        e = &_ring[pos & (LOG_RING_SIZE - 1)];
+        seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+        diff = (int32_t)(seq - pos);
+        if(0 == diff) {
+            if(__atomic_compare_exchange_n(&_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff < 0) {
+            __atomic_add_fetch(&_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    e->lvl = lvl;
+    gettimeofday(&e->tv, NULL);
     va_start(ap, msg);
-    vsnprintf(tmp, sizeof(tmp), msg, ap);
+    vsnprintf(e->msg, sizeof(e->msg), msg, ap);
     va_end(ap);
+    __atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if(__atomic_load_n(&_waiting, __ATOMIC_SEQ_CST))
+        pthread_cond_signal(&_wait_cond);
+}
+
+
+/* Per call site rate limiter. Returns true if message must be suppressed.
+ * Call site state is not protected, so rate limited messages are meant for
+ * the main thread
+ */
+bool
+log_ratelimited(log_ratelimit *rl, log_level lvl)
+{
+    uint64_t now = now_ms();
+    unsigned suppressed;
+
+    if(now - rl->start >= LOG_RL_INTERVAL) {
+        suppressed = rl->suppressed;
+        rl->start = now;
+        rl->count = 0;
+        rl->suppressed = 0;
+        if(0 != suppressed)
+            log(lvl, "%u similar messages suppressed", suppressed);
+    }
+
+    if(rl->count < LOG_RL_BURST) {
+        ++rl->count;
+        return false;
+    }
+
+    ++rl->suppressed;
+    return true;
+}
+
+
+bool
+log_parse_level(const char *arg, int *lvl)
+{
+    if(0 == strcasecmp(arg, "debug"))
+        *lvl = LVL_DBG;
+    else if(0 == strcasecmp(arg, "info"))
+        *lvl = LVL_INFO;
+    else if(0 == strcasecmp(arg, "warn") || 0 == strcasecmp(arg, "warning"))
+        *lvl = LVL_WARN;
+    else if(0 == strcasecmp(arg, "error"))
+        *lvl = LVL_ERR;
+    else
+        return false;
+
+    return true;
+}
+
+
+/* Sets runtime level and sinks. Target is comma separated list of
+ * "console", "syslog" and file names (absolute paths). NULL target keeps
+ * current sinks
+ */
+bool
+log_configure(int lvl, const char *target)
+{
+    char buf[256], *tok, *save;
+    FILE *fp = NULL;
+    int sinks = 0;
+
+    __atomic_store_n(&log_level_current, lvl, __ATOMIC_RELAXED);
+    if(NULL == target)
+        return true;
+
+    snprintf(buf, sizeof(buf), "%s", target);
+    for(tok=strtok_r(buf, ", ", &save); NULL != tok; tok=strtok_r(NULL, ", ", &save)) {
+        if(0 == strcasecmp(tok, "console")) {
+            sinks |= SINK_CONSOLE;
+        } else if(0 == strcasecmp(tok, "syslog")) {
+            sinks |= SINK_SYSLOG;
+        } else if('/' == tok[0] && NULL == fp) {
+            fp = fopen(tok, "a");
+            if(NULL == fp)
+                return false;
+            sinks |= SINK_FILE;
+        } else {
+            if(NULL != fp)
+                fclose(fp);
+            return false;
+        }
+    }
+
+    if(0 != (sinks & SINK_SYSLOG))
+        openlog(APPNAME, LOG_PID, LOG_DAEMON);
+
+    pthread_mutex_lock(&_sink_mtx);
+    if(NULL != _file)
+        fclose(_file);
+    _file = fp;
+    __atomic_store_n(&log_sinks, sinks, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&_sink_mtx);
+
+    return true;
+}
+
+
+/* Turns console sink on or off. Once the service detaches from terminal its
+ * console output goes to syslog, unless some other sink is configured
+ */
+void
+log_set_console(bool on)
+{
+    int sinks = log_sinks;
+
+    if(on) {
+        sinks |= SINK_CONSOLE;
+    } else if(0 != (sinks & SINK_CONSOLE)) {
+        sinks &= ~SINK_CONSOLE;
+        if(0 == sinks) {
+            openlog(APPNAME, LOG_PID, LOG_DAEMON);
+            sinks = SINK_SYSLOG;
+        }
+    }
 
-    switch(lvl) {
-        case LVL_DBG:
-            out = stdout;
-            cat = "DEBUG:";
-            break;
+    __atomic_store_n(&log_sinks, sinks, __ATOMIC_RELAXED);
+}
 
-        case LVL_INFO:
-            out = stdout;
-            cat = "INFO:";
-            break;
 
-        case LVL_WARN:
-            out = stderr;
-            cat = "WARN:";
-            break;
+/* Starts background writer. Must be called after daemonize(), threads do
+ * not survive fork()
+ */
+void
+log_start()
+{
+    uint32_t i;
 
-        case LVL_ERR:
-            out = stderr;
-            cat = "ERROR:";
-            break;
+    if(_running)
+        return;
 
-        default:
-            out = NULL;
-            cat = "";
-            break;
+    for(i=0; i<LOG_RING_SIZE; ++i)
+        _ring[i].seq = i;
+    _head = _tail = 0;
+
+    __atomic_store_n(&_running, 1, __ATOMIC_RELEASE);
+    if(0 != pthread_create(&_thread, NULL, log_thread, NULL)) {
+        _running = 0;
+        ERR("Cannot start logging thread, logging synchronously");
     }
+}
+
 
+/* Stops background writer, flushing all pending messages
+ */
+void
+log_stop()
+{
+    if(!_running)
+        return;
 
-    if(NULL != out)
-        fprintf(out, "%s: %-6s %s\n", APPNAME, cat, tmp);
+    __atomic_store_n(&_running, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&_wait_mtx);
+    pthread_cond_signal(&_wait_cond);
+    pthread_mutex_unlock(&_wait_mtx);
+    pthread_join(_thread, NULL);
 }
@@ -2,19 +2,58 @@
 #include "common.h"
 #include "logging.h"
 #include "configfile.h"
+#include "commands.h"
+#include "displays.h"
+#include "schedule.h"
+#include "metrics.h"
+#include "record.h"
+#include "systemd.h"
+#include "uring.h"
+#include "utils.h"
+#include "watch.h"
 #include "winstar_lcd.h"
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
 
 
-extern char *trim(char *);
+/* Client state is split: fields touched on every read live in client_t,
+ * peer address, statistics and recording in client_info_t. Both come from
+ * fixed pools, so accept and disconnect never touch the allocator
+ */
+struct client_info_t {
+    struct in_addr ip;
+    uint16_t port;
+    uint64_t cmds;              // Commands executed
+    uint64_t bytes;             // Bytes received
+    uint64_t win_start;         // Start of commands rate window, ms
+    uint32_t win_cnt;           // Commands in current window
+    uint32_t rate;              // Commands per second in previous window
+    FILE *rec;                  // Session recording or NULL
+    uint64_t rec_last;          // Time of last recorded read or of accept, us
+};
 
 
 struct client_t {
     int fd;
-    struct in_addr ip;
-    char buf[MAX_BUF_SIZE+1];
+    int idx;                    // Index in _clients
+    bool pending;               // Receive is queued (io_uring backend)
     uint32_t cb;
-    struct client_t *next;
-};
+    uint64_t rx;                // Time of last read, us
+    WinStarLCD *lcd;            // Display commands go to, see USE
+    struct client_t *next;      // Free list link
+    struct client_info_t *info;
+    char buf[MAX_BUF_SIZE+1];
+} __attribute__((aligned(64)));
+
+
+// fds[0] is listening socket, fds[1] is stats socket (or -1), fds[2] is signalfd,
+// fds[3] is eventfd signalled when display initialization is over (then -1),
+// fds[4] is epoll set of watched files and FIFOs (or -1)
+#define FIRST_CLIENT_FD 5
 
 
 /* Global application options
@@ -23,7 +62,7 @@ run_options_t opts;
 
 
 static struct option _options[] = {
-    { "nodaemon",   no_argument,       &opts.goDaemon, 1 }, // 0
+    { "nodaemon",   no_argument,       NULL, 0 },           // 0
     { "pidfile",    required_argument, NULL, 0 },           // 1
     { "socket",     required_argument, NULL, 0 },           // 2
     { "ip",         required_argument, NULL, 0 },           // 3
@@ -36,9 +75,25 @@ static struct option _options[] = {
 
 
 WinStarLCD _lcd;
-
-
-static char _optstr[] = "dp:s:i:t:o:h";
+static struct client_t _pool[MAX_CLIENTS];
+static struct client_info_t _pool_info[MAX_CLIENTS];
+static struct client_t *_free;          // Free pool entries
+static struct client_t *_clients[MAX_CLIENTS]; // Connected, in fds[] order
+static int _clicnt;
+static int _stats_sock = -1;
+static char _config_path[PATH_MAX] = CONFIG_FILE;
+static sigset_t _sigmask;
+static WinStarLCD::state_t *_state;    // Memory-mapped StateFile or NULL
+static bool _foreground;                // -d given on command line
+static bool _activated;                 // Listening socket passed by systemd
+static int _lcd_ready;                  // Display initialization is over
+static int _init_result;
+static int _init_efd = -1;
+static int _sig_fd = -1;
+static int _watch_fd = -1;
+
+
+static char _optstr[] = "c:dp:s:i:t:o:h";
 static char _helpstr[] =
 "%s: LCD gateway.\r\n"
 "Usage: %s <options>\r\n"
@@ -62,57 +117,170 @@ static char _helpstr[] =
 ;
 
 
+static void
+pool_init()
+{
+    int i;
+
+    for(i=0, _free=NULL; i<MAX_CLIENTS; ++i) {
+        _pool[i].info = &_pool_info[i];
+        _pool[i].next = _free;
+        _free = &_pool[i];
+    }
+    _clicnt = 0;
+}
+
+
+/* Takes client from the pool and appends it to the connected ones. Returns
+ * NULL if there are MAX_CLIENTS connected already
+ */
 static struct client_t *
-remove_client(struct client_t *head, int fd)
+add_client(int fd)
 {
-    struct client_t *cli, *prev;
+    struct client_t *c = _free;
 
-    if(NULL == head)
+    if(NULL == c)
         return NULL;
 
-    for(cli=head, prev=NULL; cli != NULL; prev=cli, cli=cli->next)
-        if(cli->fd == fd)
-            break;
+    _free = c->next;
+    c->fd = fd;
+    c->cb = 0;
+    c->rx = 0;
+    c->pending = false;
+    c->lcd = &_lcd;
+    c->idx = _clicnt;
+    memset(c->info, 0, sizeof(*c->info));
+    _clients[_clicnt++] = c;
+    return c;
+}
 
-    if(NULL == cli)
-        return head; // not found
 
-    if(NULL == prev) { // head
-        cli = head->next;
-        free(head);
-        return cli;
-    }
+/* Closes client at index idx of connected ones and returns it to the pool.
+ * The last client takes its place, both in _clients and fds
+ */
+static void
+remove_client(int idx, pollfd *fds)
+{
+    struct client_t *c = _clients[idx];
 
-    // found at middle or end of the list
-    prev->next = cli->next;
-    free(cli);
-    return head;
+    close(c->fd);
+    rec_close(c->info->rec);
+
+    c->next = _free;
+    _free = c;
+
+    --_clicnt;
+    _clients[idx] = _clients[_clicnt];
+    _clients[idx]->idx = idx;
+    if(NULL != fds)
+        fds[FIRST_CLIENT_FD + idx] = fds[FIRST_CLIENT_FD + _clicnt];
 }
 
 
-static struct client_t *
-find_client(struct client_t *list, int fd)
+/* Until display is initialized commands are queued in client buffers.
+ * Client with full buffer is not read until then
+ */
+static bool
+readable(const struct client_t *c)
+{
+    return __atomic_load_n(&_lcd_ready, __ATOMIC_ACQUIRE) || c->cb < MAX_BUF_SIZE;
+}
+
+
+static void
+fill_fds(pollfd *fds)
 {
-    for(; list != NULL; list=list->next)
-        if(list->fd == fd)
-            return list;
+    int i;
 
-    return NULL;
+    for(i=0; i<_clicnt; ++i) {
+        fds[FIRST_CLIENT_FD + i].fd = _clients[i]->fd;
+        fds[FIRST_CLIENT_FD + i].events = readable(_clients[i]) ? POLLIN | POLLHUP : POLLHUP;
+        fds[FIRST_CLIENT_FD + i].revents = 0;
+    }
 }
 
 
+/* Updates per-client command counters. Rate is measured over windows of
+ * at least one second
+ */
 static void
-fill_fds(struct client_t *list, pollfd *fds)
+count_command(struct client_info_t *c, uint64_t now)
 {
+    ++c->cmds;
+    ++c->win_cnt;
+    if(now - c->win_start >= 1000) {
+        c->rate = c->win_cnt * 1000 / (now - c->win_start);
+        c->win_cnt = 0;
+        c->win_start = now;
+    }
+}
+
+
+/* Metrics source: per-client counters
+ */
+static size_t
+format_clients(char *buf, size_t size)
+{
+    struct client_info_t *c;
+    uint64_t now = now_ms();
+    size_t n = 0;
     int i;
 
-    // fds[0] is always reserved for listening socket
-    //
-    for(i=1; list != NULL; ++i, list=list->next) {
-        fds[i].fd = list->fd;
-        fds[i].events = POLLIN | POLLOUT | POLLHUP;
-        fds[i].revents = 0;
+#define OUT(...) do { if(n < size) n += snprintf(buf + n, size - n, __VA_ARGS__); } while(0)
+#define PEER "{peer=\"%s:%u\"}"
+
+    OUT("# HELP " APPNAME "_clients Connected clients\n");
+    OUT("# TYPE " APPNAME "_clients gauge\n");
+    OUT(APPNAME "_clients %d\n", _clicnt);
+
+    OUT("# HELP " APPNAME "_client_commands_total Commands executed per client\n");
+    OUT("# TYPE " APPNAME "_client_commands_total counter\n");
+    for(i=0; i<_clicnt; ++i) {
+        c = _clients[i]->info;
+        OUT(APPNAME "_client_commands_total" PEER " %llu\n", inet_ntoa(c->ip), c->port, (unsigned long long)c->cmds);
+    }
+
+    OUT("# HELP " APPNAME "_client_commands_per_second Recent command rate per client\n");
+    OUT("# TYPE " APPNAME "_client_commands_per_second gauge\n");
+    for(i=0; i<_clicnt; ++i) {
+        c = _clients[i]->info;
+        OUT(APPNAME "_client_commands_per_second" PEER " %u\n", inet_ntoa(c->ip), c->port,
+            now - c->win_start >= 1000 ? (unsigned)(c->win_cnt * 1000 / (now - c->win_start)) : c->rate);
+    }
+
+    OUT("# HELP " APPNAME "_client_bytes_total Bytes received per client\n");
+    OUT("# TYPE " APPNAME "_client_bytes_total counter\n");
+    for(i=0; i<_clicnt; ++i) {
+        c = _clients[i]->info;
+        OUT(APPNAME "_client_bytes_total" PEER " %llu\n", inet_ntoa(c->ip), c->port, (unsigned long long)c->bytes);
     }
+
+#undef PEER
+#undef OUT
+
+    return n;
+}
+
+
+/* Metrics source: display driver counters
+ */
+static size_t
+format_lcd(char *buf, size_t size)
+{
+    return snprintf(buf, size,
+        "# HELP " APPNAME "_lcd_commands_skipped_total Controller commands not sent since they change nothing\n"
+        "# TYPE " APPNAME "_lcd_commands_skipped_total counter\n"
+        APPNAME "_lcd_commands_skipped_total %u\n"
+        "# HELP " APPNAME "_lcd_recoveries_total Panels re-initialized and redrawn after I2C failure\n"
+        "# TYPE " APPNAME "_lcd_recoveries_total counter\n"
+        APPNAME "_lcd_recoveries_total %u\n"
+        "# HELP " APPNAME "_lcd_scrub_cells_total Cells read back from panels for checking\n"
+        "# TYPE " APPNAME "_lcd_scrub_cells_total counter\n"
+        APPNAME "_lcd_scrub_cells_total %u\n"
+        "# HELP " APPNAME "_lcd_scrub_repairs_total Cells found corrupted on read-back and rewritten\n"
+        "# TYPE " APPNAME "_lcd_scrub_repairs_total counter\n"
+        APPNAME "_lcd_scrub_repairs_total %u\n",
+        _lcd.skippedCommands(), displays_recovered(), displays_scrubbed(), displays_repaired());
 }
 
 
@@ -163,16 +331,34 @@ initOptions(struct run_options *opts)
     opts->port = DEFAULT_PORT;
     opts->mapFile = strdup(MAP_FILE);
     opts->unixSock = strdup(UNIX_SOCK);
+    opts->cols = DEFAULT_COLS;
+    opts->rows = DEFAULT_ROWS;
+    opts->logLevel = LVL_INFO;
+    opts->slot = strdup("4");
 }
 
 
 static void
 cleanupOptions(struct run_options *opts)
 {
+    int i;
+
     free(opts->pidfile);
     free(opts->ip);
     free(opts->mapFile);
     free(opts->unixSock);
+    free(opts->charset);
+    free(opts->logTarget);
+    free(opts->statsSock);
+    free(opts->recordDir);
+    free(opts->slot);
+    free(opts->stateFile);
+    free(opts->watchDir);
+    free(opts->transport);
+    for(i=0; i<opts->ndisplays; ++i)
+        free(opts->displays[i]);
+    for(i=0; i<opts->ngroups; ++i)
+        free(opts->groups[i]);
 }
 
 
@@ -227,6 +413,7 @@ daemonize(bool noClose)
     if(!noClose) {
         syslog(LOG_DEBUG, "Redirecting file descriptors");
         redirectFileDescriptors();
+        log_set_console(false);
     }
 
     syslog(LOG_INFO, "Switched to daemon mode");
@@ -255,12 +442,18 @@ parseCommandLine(struct run_options *opts, int argc, char *argv[])
                 case 'h':
                     index = 6;
                     break;
+                case 'c':
+                    index = 7;
+                    break;
+                case 'd':
+                    index = 0;
+                    break;
             }
         }
 
         switch(index) {
             case 0: // --nodaemon
-                opts->goDaemon = 0;
+                _foreground = true;
                 break;
 
             case 1: // --PID_FILE
@@ -273,6 +466,10 @@ parseCommandLine(struct run_options *opts, int argc, char *argv[])
                 _exit(EXIT_SUCCESS);
                 break;
 
+            case 7: // --config
+                snprintf(_config_path, sizeof(_config_path), "%s", optarg);
+                break;
+
             default:
                 break;
         }
@@ -285,6 +482,7 @@ initSocket(struct run_options *opts)
 {
     struct sockaddr_in addr;
     struct in_addr ina;
+    int one = 1;
 
 #if 0
     struct hostent *hn;
@@ -304,6 +502,11 @@ initSocket(struct run_options *opts)
     if(-1 == opts->sock)
         return -1;
 
+    /* Allow restart (or rebinding on reload) while old connections are
+     * still in TIME_WAIT
+     */
+    setsockopt(opts->sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
     addr.sin_family = AF_INET;
     addr.sin_port = htons(opts->port);
 #if 0
@@ -314,11 +517,13 @@ initSocket(struct run_options *opts)
 
     if(-1 == bind(opts->sock, (struct sockaddr *)&addr, sizeof(addr))) {
         ERR("Cannot bind socket to %s:%u. %s", inet_ntoa(ina), opts->port, strerror(errno));
+        close(opts->sock);
         return -1;
     }
 
-    if(-1 == listen(opts->sock, 0)) {
+    if(-1 == listen(opts->sock, SOMAXCONN)) {
         ERR("listen() failed. %s", strerror(errno));
+        close(opts->sock);
         return -1;
     }
 
@@ -328,15 +533,266 @@ initSocket(struct run_options *opts)
 }
 
 
+/* Creates UNIX socket which dumps metrics to every connecting client
+ */
+static int
+initStatsSocket(struct run_options *opts)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if(strlen(opts->statsSock) >= sizeof(addr.sun_path)) {
+        ERR("Stats socket path '%s' is too long", opts->statsSock);
+        return -1;
+    }
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(-1 == sock)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, opts->statsSock);
+    unlink(opts->statsSock);
+
+    if(-1 == bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || -1 == listen(sock, 4)) {
+        ERR("Cannot create stats socket '%s'. %s", opts->statsSock, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    LOG("Serving metrics on %s", opts->statsSock);
+    return sock;
+}
+
+
+static void
+serveStats(int lsock)
+{
+    static char buf[MAX_STATS_SIZE];
+    size_t n;
+    int sock;
+
+    sock = accept(lsock, NULL, NULL);
+    if(-1 == sock) {
+        WARN_RL("Stats connection failed: %s", strerror(errno));
+        return;
+    }
+
+    n = metrics_format(buf, sizeof(buf));
+    if(send(sock, buf, n, MSG_NOSIGNAL | MSG_DONTWAIT) < (ssize_t)n)
+        WARN_RL("Stats reply truncated");
+    close(sock);
+}
+
+
+/* Initializes display at given slot: bus number or symbolic slot name.
+ * Display is resumed without clearing if st holds valid snapshot
+ */
+static int
+initDisplay(const char *slot, const WinStarLCD::state_t *st = NULL)
+{
+    if(isdigit(slot[0]))
+        return _lcd.init(atoi(slot), st);
+    return _lcd.init(slot, st);
+}
+
+
+static bool
+strdiff(const char *a, const char *b)
+{
+    if(NULL == a || NULL == b)
+        return a != b;
+    return 0 != strcmp(a, b);
+}
+
+
+/* Starts bus writer thread if real-time mode is configured. Otherwise I2C
+ * transactions are sent from the main loop
+ */
+static void
+initWriter(const struct run_options *opts)
+{
+    lcd_rt_opts rt;
+
+    _lcd.stopWriter();
+    displays_start_writers(opts);
+    if(0 == opts->rtPriority)
+        return;
+
+    rt.priority = opts->rtPriority;
+    rt.cpus = opts->rtCpus;
+    rt.lock_memory = opts->lockMemory;
+    if(-1 == _lcd.startWriter(&rt))
+        ERR("Cannot start real-time bus writer: %s", strerror(errno));
+    else
+        LOG("Bus writer runs at SCHED_FIFO priority %d", rt.priority);
+}
+
+
+/* Display or group removed on reload: clients using it go back to the
+ * main one, jobs, watches and templates bound to it are dropped
+ */
+static void
+dropDisplay(WinStarLCD *lcd)
+{
+    int i;
+
+    for(i=0; i<_clicnt; ++i)
+        if(_clients[i]->lcd == lcd)
+            _clients[i]->lcd = &_lcd;
+    forget_display(lcd);
+}
+
+
+/* Re-reads configuration file and applies changed options in place. Client
+ * connections, jobs and screen contents are kept. Options which cannot be
+ * changed on the fly keep their old values until restart
+ */
+static void
+reloadConfig(struct run_options *opts)
+{
+    run_options_t nopts;
+    ConfigFile cfg;
+    char *tmp;
+    int sock;
+
+    LOG("Reloading configuration from %s", _config_path);
+
+    memset(&nopts, 0, sizeof(nopts));
+    initOptions(&nopts);
+    nopts.goDaemon = opts->goDaemon;
+
+    cfg.setName(_config_path);
+    if(!cfg.load(&nopts)) {
+        ERR("Configuration not reloaded");
+        cleanupOptions(&nopts);
+        return;
+    }
+
+    /* Logging first, so the rest is reported at the new level
+     */
+    if(!log_configure(nopts.logLevel, nopts.logTarget))
+        ERR("Invalid log target '%s'", nopts.logTarget);
+    else if(opts->goDaemon)
+        log_set_console(false);
+
+    /* Listener. Old one is closed only when the new one is up
+     */
+    nopts.sock = opts->sock;
+    if(_activated) {
+        if(nopts.port != opts->port || strdiff(nopts.ip, opts->ip))
+            WARN("Listening socket is managed by systemd, IP and Port are ignored");
+    } else if(nopts.port != opts->port || strdiff(nopts.ip, opts->ip)) {
+        sock = opts->sock;
+        if(0 == initSocket(&nopts)) {
+            close(sock);
+        } else {
+            ERR("Keep listening on %s:%d", opts->ip, opts->port);
+            nopts.sock = sock;
+            nopts.port = opts->port;
+            tmp = nopts.ip;
+            nopts.ip = opts->ip;
+            opts->ip = tmp;
+        }
+    }
+
+    /* Stats socket
+     */
+    if(strdiff(nopts.statsSock, opts->statsSock)) {
+        if(-1 != _stats_sock) {
+            close(_stats_sock);
+            unlink(opts->statsSock);
+            _stats_sock = -1;
+        }
+        if(NULL != nopts.statsSock)
+            _stats_sock = initStatsSocket(&nopts);
+    }
+
+    /* Display. Changing charset or geometry keeps what is on the glass,
+     * different slot means different display, which gets initialized
+     */
+    if(strdiff(nopts.charset, opts->charset) && !_lcd.setCharset(nopts.charset))
+        ERR("Unknown charset '%s'", nopts.charset);
+    if(nopts.cols != opts->cols || nopts.rows != opts->rows)
+        _lcd.setGeometry(nopts.cols, nopts.rows);
+    displays_configure(&nopts, dropDisplay);
+    if(nopts.scrubRate != opts->scrubRate)
+        displays_set_scrub(nopts.scrubRate);
+    if(strdiff(nopts.slot, opts->slot)) {
+        LOG("Switching display to slot %s", nopts.slot);
+        if(-1 == initDisplay(nopts.slot))
+            ERR("Failed to init LCD at slot %s", nopts.slot);
+    }
+
+    if(nopts.rtPriority != opts->rtPriority || nopts.rtCpus != opts->rtCpus || nopts.lockMemory != opts->lockMemory)
+        initWriter(&nopts);
+
+    if(strdiff(nopts.watchDir, opts->watchDir))
+        watch_set_dir(nopts.watchDir);
+
+    if(strdiff(nopts.pidfile, opts->pidfile) || nopts.uid != opts->uid || nopts.gid != opts->gid
+            || nopts.doChroot != opts->doChroot || strdiff(nopts.chrootDir, opts->chrootDir))
+        WARN("PID file, user, group and chroot changes take effect after restart");
+    if(strdiff(nopts.transport, opts->transport))
+        WARN("Transport change takes effect after restart");
+
+    cleanupOptions(opts);
+    *opts = nopts;
+    LOG("Configuration reloaded");
+}
+
+
+/* Blocks signals handled by the main loop, so they are delivered only
+ * through signalfd. Must be called before any thread is created
+ */
+static void
+blockSignals()
+{
+    sigemptyset(&_sigmask);
+    sigaddset(&_sigmask, SIGHUP);
+    sigaddset(&_sigmask, SIGTERM);
+    sigaddset(&_sigmask, SIGINT);
+    sigprocmask(SIG_BLOCK, &_sigmask, NULL);
+
+    signal(SIGPIPE, SIG_IGN);
+}
+
+
 static int
 allocateResources(struct run_options *opts)
 {
-    if(-1 == _lcd.init(4)) {
-        ERR("Failed to init LCD");
+    lcd_transport *io;
+
+    io = lcd_transport_create(opts->transport);
+    if(NULL == io) {
+        ERR("No I2C transport available");
+        return -1;
+    }
+    LOG("Using %s I2C transport", io->name());
+
+    _lcd.setTransport(io, true);
+    _lcd.setCharset(opts->charset);
+    _lcd.setGeometry(opts->cols, opts->rows);
+    _lcd.setFlushHook(metrics_flush_hook);
+    metrics_add_source(format_clients);
+    metrics_add_source(format_lcd);
+
+    /* Pages of shared mapping survive crash of the process, so the last
+     * snapshot is there on restart
+     */
+    if(NULL != opts->stateFile)
+        _state = (WinStarLCD::state_t *)map_file(opts->stateFile, sizeof(WinStarLCD::state_t));
+
+    opts->sock = sysd_listen_fd();
+    if(-1 != opts->sock) {
+        _activated = true;
+        LOG("Listening on socket passed by systemd");
+    } else if(-1 == initSocket(opts)) {
         return -1;
     }
 
-    if(-1 == initSocket(opts))
+    if(NULL != opts->statsSock && -1 == (_stats_sock = initStatsSocket(opts)))
         return -1;
 
     /* And, finally daemonize, if flag 'nodaemon' is not specified
@@ -353,36 +809,259 @@ allocateResources(struct run_options *opts)
 }
 
 
+/* Display initialization thread. Main loop meanwhile accepts clients and
+ * queues their commands
+ */
+static void *
+initThread(void *arg)
+{
+    struct run_options *opts = (struct run_options *)arg;
+    uint64_t one = 1;
+
+    if(_lcd.validState(_state))
+        LOG("Resuming display from %s", opts->stateFile);
+
+    _init_result = initDisplay(opts->slot, _state);
+    if(-1 != _init_result)
+        displays_init(&_lcd, opts);
+    displays_set_scrub(opts->scrubRate);
+    __atomic_store_n(&_lcd_ready, 1, __ATOMIC_RELEASE);
+
+    if(sizeof(one) != write(_init_efd, &one, sizeof(one)))
+        ERR("Cannot signal end of display initialization");
+    return NULL;
+}
+
+
+/* Executes all complete commands received from client, keeping the
+ * incomplete tail in the buffer
+ */
 static void
-runService(struct run_options *opts)
+execCommands(struct client_t *c)
 {
-    struct client_t *clients, *newc;
-    struct sockaddr_in addr;
-    struct pollfd fds[MAX_CLIENTS+1];
-    socklen_t slen;
-    int i, clicnt, sock, rama;
-    int res, nb;
-    char *s;
+    WinStarLCD *lcd;
+    char *s, *p;
+    int depth;
+
+    for(p=c->buf, depth=0; NULL != (s = strstr(p, "\r\n")); p=s+2, ++depth) {
+        *s = '\0';
+        DBG("Cmd: %s", p);
+
+        lcd = c->lcd;
+        lcd->setReceived(c->rx);
+        c->lcd = exec_command(lcd, p, c->fd);
+        c->lcd->flush();
+        lcd->setReceived(0);
+
+        count_command(c->info, c->rx / 1000);
+        metrics_inc(M_COMMANDS);
+        metrics_observe(H_FLUSH_LATENCY, now_us() - c->rx);
+    }
 
-    LOG(APPNAME " service is up and running");
+    metrics_observe(H_QUEUE_DEPTH, depth);
+    c->cb -= p - c->buf;
+    memmove(c->buf, p, c->cb);
+
+    if(NULL != _state)
+        _lcd.saveState(_state);
+}
+
+
+/* Returns how long the main loop may sleep: until the next scheduled job,
+ * display re-initialization attempt or read-back step, -1 for forever.
+ * Panels due for re-initialization or read-back are handled here, as all
+ * input is processed by then
+ */
+static int
+loopTimeout()
+{
+    int timeout, retry, scrub;
+
+    timeout = sched_timeout();
+    if(!__atomic_load_n(&_lcd_ready, __ATOMIC_ACQUIRE) || -1 == _init_result)
+        return timeout;
+
+    retry = displays_recover();
+    if(-1 != retry && (-1 == timeout || retry < timeout))
+        timeout = retry;
+
+    scrub = displays_scrub(timeout);
+    if(-1 != scrub && (-1 == timeout || scrub < timeout))
+        timeout = scrub;
+    return timeout;
+}
+
+
+/* Connection accepted on listening socket. Returns the new client, or NULL
+ * if it was rejected
+ */
+static struct client_t *
+onAccept(struct run_options *opts, int sock, const struct sockaddr_in *addr)
+{
+    struct client_t *c;
+    struct client_info_t *info;
+
+    c = add_client(sock);
+    if(NULL == c) {
+        WARN_RL("Too many clients, %s rejected", inet_ntoa(addr->sin_addr));
+        close(sock);
+        return NULL;
+    }
+
+    info = c->info;
+    info->ip = addr->sin_addr;
+    info->port = ntohs(addr->sin_port);
+    info->win_start = now_ms();
+    if(NULL != opts->recordDir)
+        info->rec = rec_open(opts->recordDir, info->ip, info->port, &info->rec_last);
+
+    metrics_inc(M_CONNECTIONS);
+    LOG("Client #%d %s connected", _clicnt, inet_ntoa(addr->sin_addr));
+    return c;
+}
+
+
+/* nb bytes were received into client buffer, after its current contents
+ */
+static void
+onReceived(struct client_t *c, int nb)
+{
+    c->rx = now_us();
+    if(NULL != c->info->rec)
+        rec_write(c->info->rec, &c->info->rec_last, c->rx, &c->buf[c->cb], nb);
+    c->cb += nb;
+    c->buf[c->cb] = '\0';
+    c->info->bytes += nb;
+    metrics_inc(M_BYTES_PARSED, nb);
+
+    if(_lcd_ready)
+        execCommands(c);
+}
+
+
+/* Display initialization thread finished. Returns false if it failed
+ */
+static bool
+onDisplayReady(struct run_options *opts)
+{
+    int i;
 
-    clients = NULL;
-    clicnt = 0;
+    close(_init_efd);
+    _init_efd = -1;
+
+    if(-1 == _init_result) {
+        ERR("Failed to init LCD");
+        return false;
+    }
+
+    LOG("Display is ready");
+    initWriter(opts);
+    sysd_notify("READY=1");
+
+    /* Run commands queued during initialization
+     */
+    for(i=0; i<_clicnt; ++i)
+        execCommands(_clients[i]);
+    return true;
+}
+
+
+/* Handles signal pending on signalfd. Returns false if service must stop
+ */
+static bool
+onSignal(struct run_options *opts)
+{
+    struct signalfd_siginfo si;
+
+    if(sizeof(si) != read(_sig_fd, &si, sizeof(si)))
+        return true;
+
+    if(SIGHUP != si.ssi_signo) {
+        LOG("Terminating on signal %d", si.ssi_signo);
+        sysd_notify("STOPPING=1");
+        return false;
+    }
+
+    if(!_lcd_ready) {
+        WARN("Display is being initialized, reload ignored");
+    } else {
+        sysd_notify("RELOADING=1");
+        reloadConfig(opts);
+        sysd_notify("READY=1");
+    }
+    return true;
+}
+
+
+static void
+runPoll(struct run_options *opts)
+{
+    struct client_t *newc;
+    struct sockaddr_in addr;
+    struct pollfd fds[MAX_CLIENTS+FIRST_CLIENT_FD];
+    socklen_t slen;
+    int i, sock;
+    int res, nb, timeout;
 
     fds[0].fd = opts->sock;
-    fds[0].events = POLLIN | POLLOUT;
+    fds[0].events = POLLIN;
     fds[0].revents = 0;
 
-    for(;;) {
-        res = poll(fds, clicnt+1, 1000);
-        if(0 == res)
-            continue; // timeout
+    fds[1].fd = _stats_sock; // poll() ignores negative descriptors
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    fds[2].fd = _sig_fd;
+    fds[2].events = POLLIN;
+    fds[2].revents = 0;
+
+    fds[3].fd = _init_efd;
+    fds[3].events = POLLIN;
+    fds[3].revents = 0;
+
+    fds[4].fd = _watch_fd;
+    fds[4].events = POLLIN;
+    fds[4].revents = 0;
 
+    for(;;) {
+        /* Sleep until the next scheduled job or panel re-initialization
+         * is due, or forever if there is none
+         */
+        timeout = loopTimeout();
+        res = poll(fds, _clicnt+FIRST_CLIENT_FD, timeout);
         if(res < 0) {
+            if(EINTR == errno)
+                continue;
             ERR("poll(): %s", strerror(errno));
             break;
         }
 
+        sched_run();
+        if(NULL != _state && _lcd_ready)
+            _lcd.saveState(_state);
+        if(0 == res)
+            continue; // timeout
+
+        if(0 != (fds[3].revents & POLLIN)) {
+            fds[3].fd = -1;
+            if(!onDisplayReady(opts))
+                break;
+            fill_fds(fds);
+        }
+
+        if(0 != (fds[2].revents & POLLIN)) {
+            if(!onSignal(opts))
+                break;
+            fds[0].fd = opts->sock;
+            fds[1].fd = _stats_sock;
+        }
+
+        if(0 != (fds[1].revents & POLLIN))
+            serveStats(fds[1].fd);
+
+        if(0 != (fds[4].revents & POLLIN))
+            watch_run();
+
         if(0 != (fds[0].revents & POLLIN)) {
             // New client connection accepted
             memset(&addr, 0, sizeof(addr));
@@ -392,109 +1071,307 @@ runService(struct run_options *opts)
             if(-1 == sock) {
                 ERR("Client connection failed on fd %d: %s", fds[0].fd, strerror(errno));
 
-            } else {
-                newc = (struct client_t *)malloc(sizeof(clients[0]));
-                if(NULL == newc) {
-                    ERR("malloc() failed.");
-                    break;
-                }
-
-                newc->fd = sock;
-                newc->ip = addr.sin_addr;
-                newc->cb = 0;
-                newc->next = clients;
-                clients = newc;
-
-                fill_fds(clients, fds);
-                ++clicnt;
-
-                LOG("Client #%d %s connected", clicnt, inet_ntoa(addr.sin_addr));
+            } else if(NULL != (newc = onAccept(opts, sock, &addr))) {
+                i = FIRST_CLIENT_FD + _clicnt - 1;
+                fds[i].fd = sock;
+                fds[i].events = readable(newc) ? POLLIN | POLLHUP : POLLHUP;
+                fds[i].revents = 0;
             }
         }
 
-        for(i=1; i<clicnt+1; ++i) {
+        /* fds[FIRST_CLIENT_FD + n] belongs to _clients[n]. Client removal
+         * moves the last one in place of removed, so the same index is
+         * checked again. Just accepted client has no events yet
+         */
+        for(i=FIRST_CLIENT_FD; i<_clicnt+FIRST_CLIENT_FD; ++i) {
+            newc = _clients[i - FIRST_CLIENT_FD];
             if(0 != (fds[i].revents & POLLIN)) {
-                newc = find_client(clients, fds[i].fd);
-                if(NULL == newc) {
-                    ERR("Unknown client in read() (internal error)");
-                    return;
+                if(!readable(newc)) {
+                    fds[i].events = POLLHUP;
+                    continue; // Commands are queued until display is ready
                 }
 
-                if((MAX_BUF_SIZE-1) == newc->cb)
+                if(MAX_BUF_SIZE == newc->cb)
                     newc->cb = 0; // Discard all received data to prevent communication hangup
 
                 nb = read(fds[i].fd, &newc->buf[newc->cb], MAX_BUF_SIZE-newc->cb);
                 if(nb > 0) {
-                    newc->cb += nb;
-                    newc->buf[newc->cb+1] = '\0';
-
-                    s = strstr(newc->buf, "\r\n");
-                    if(NULL != s) {
-                        *s = '\0';
-                        nb = newc->buf + newc->cb - s - 2;
-                        LOG("Cmd: %s", newc->buf);
-
-                        switch(newc->buf[0]) {
-                            case 'A':
-                            case 'a':
-                                sscanf(&newc->buf[1], "%2x", &rama);
-                                _lcd.setAddr(rama & 0xFF);
-                                break;
-                            case 'C':
-                            case 'c':
-                                _lcd.clear();
-                                break;
-                            case 'H':
-                            case 'h':
-                                _lcd.home();
-                                break;
-                            case '\\':
-                                _lcd.echo(&newc->buf[1]);
-                                break;
-                            default:
-                                _lcd.echo(newc->buf);
-                                break;
-                        }
-
-                        _lcd.flush();
-
-                        memcpy(s+2, newc->buf, nb);
-                        newc->cb = nb;
-                    }
+                    onReceived(newc, nb);
                 } else if(0 == nb) {
                     /* Client dropped? */
-                    LOG("Client disconneced");
-                    clients = remove_client(clients, fds[i].fd);
-                    --clicnt;
-                    fill_fds(clients, fds);
+                    fds[i].revents |= POLLHUP;
                 }
             }
             if(0 != (fds[i].revents & POLLHUP)) {
                 LOG("Client disconneced");
-                clients = remove_client(clients, fds[i].fd);
-                --clicnt;
-                fill_fds(clients, fds);
+                remove_client(i - FIRST_CLIENT_FD, fds);
+                --i;
+            }
+        }
+    }
+}
+
+
+#ifdef HAVE_IO_URING
+/* io_uring request tags: kind in high 32 bits, client pool slot in low ones
+ */
+enum uring_tag {
+    TAG_NONE = 0,
+    TAG_LISTEN,
+    TAG_STATS,
+    TAG_SIGNAL,
+    TAG_INIT,
+    TAG_WATCH,
+    TAG_CLIENT
+};
+#define URING_TAG(kind, n) ((uint64_t)(kind) << 32 | (n))
+
+
+/* Queues receive into client buffer, unless commands are being queued
+ * until display is ready and the buffer is full
+ */
+static void
+armRecv(uring_t *r, struct client_t *c)
+{
+    if(c->pending || !readable(c))
+        return;
+
+    if(MAX_BUF_SIZE == c->cb)
+        c->cb = 0; // Discard all received data to prevent communication hangup
+
+    uring_recv(r, c->fd, MAX_BUF_SIZE - c->cb, URING_TAG(TAG_CLIENT, c - _pool));
+    c->pending = true;
+}
+
+
+/* Event loop on io_uring: multishot accept, multishot polls for stats
+ * socket and signalfd, and receives into provided buffers. Everything
+ * prepared during one iteration is submitted by the single io_uring_enter()
+ * which also waits for completions. Returns false if io_uring cannot be
+ * used, poll() loop runs then
+ */
+static bool
+runUring(struct run_options *opts)
+{
+    uring_t r;
+    struct io_uring_cqe *cqe;
+    struct client_t *c;
+    struct sockaddr_in addr;
+    socklen_t slen;
+    int i, res, listen_fd, stats_fd;
+    uint8_t *data;
+    bool stop;
+
+    if(!uring_init(&r, URING_ENTRIES, URING_BUFS, MAX_BUF_SIZE)) {
+        WARN("io_uring is not available (%s), using poll()", strerror(errno));
+        return false;
+    }
+    LOG("Using io_uring network backend");
+
+    listen_fd = opts->sock;
+    stats_fd = _stats_sock;
+    uring_accept(&r, listen_fd, URING_TAG(TAG_LISTEN, 0));
+    if(-1 != stats_fd)
+        uring_poll(&r, stats_fd, URING_TAG(TAG_STATS, 0));
+    uring_poll(&r, _sig_fd, URING_TAG(TAG_SIGNAL, 0));
+    uring_poll(&r, _init_efd, URING_TAG(TAG_INIT, 0));
+    if(-1 != _watch_fd)
+        uring_poll(&r, _watch_fd, URING_TAG(TAG_WATCH, 0));
+
+    for(stop=false; !stop; ) {
+        if(-1 == uring_wait(&r, loopTimeout())) {
+            ERR("io_uring_enter(): %s", strerror(errno));
+            break;
+        }
+
+        sched_run();
+
+        for(; !stop && NULL != (cqe = uring_peek(&r)); uring_seen(&r)) {
+            res = cqe->res;
+            switch(cqe->user_data >> 32) {
+                case TAG_LISTEN:
+                    if(res >= 0) {
+                        memset(&addr, 0, sizeof(addr));
+                        slen = sizeof(addr);
+                        getpeername(res, (struct sockaddr *)&addr, &slen);
+                        if(NULL != (c = onAccept(opts, res, &addr)))
+                            armRecv(&r, c);
+                    } else if(-ECANCELED != res) {
+                        ERR("Client connection failed on fd %d: %s", listen_fd, strerror(-res));
+                    }
+                    if(0 == (cqe->flags & IORING_CQE_F_MORE) && -ECANCELED != res)
+                        uring_accept(&r, listen_fd, URING_TAG(TAG_LISTEN, 0));
+                    break;
+
+                case TAG_STATS:
+                    if(res > 0)
+                        serveStats(stats_fd);
+                    if(0 == (cqe->flags & IORING_CQE_F_MORE) && -ECANCELED != res)
+                        uring_poll(&r, stats_fd, URING_TAG(TAG_STATS, 0));
+                    break;
+
+                case TAG_SIGNAL:
+                    if(0 == (cqe->flags & IORING_CQE_F_MORE))
+                        uring_poll(&r, _sig_fd, URING_TAG(TAG_SIGNAL, 0));
+                    if(!onSignal(opts)) {
+                        stop = true;
+                        break;
+                    }
+
+                    /* Reload may move listening and stats sockets. Cancel
+                     * goes first in the same submission, so it does not
+                     * hit requests for the new ones
+                     */
+                    if(opts->sock != listen_fd) {
+                        uring_cancel(&r, URING_TAG(TAG_LISTEN, 0));
+                        listen_fd = opts->sock;
+                        uring_accept(&r, listen_fd, URING_TAG(TAG_LISTEN, 0));
+                    }
+                    if(_stats_sock != stats_fd) {
+                        if(-1 != stats_fd)
+                            uring_cancel(&r, URING_TAG(TAG_STATS, 0));
+                        stats_fd = _stats_sock;
+                        if(-1 != stats_fd)
+                            uring_poll(&r, stats_fd, URING_TAG(TAG_STATS, 0));
+                    }
+                    break;
+
+                case TAG_WATCH:
+                    if(res > 0)
+                        watch_run();
+                    if(0 == (cqe->flags & IORING_CQE_F_MORE) && -ECANCELED != res)
+                        uring_poll(&r, _watch_fd, URING_TAG(TAG_WATCH, 0));
+                    break;
+
+                case TAG_INIT:
+                    if(-1 == _init_efd)
+                        break;
+                    uring_cancel(&r, URING_TAG(TAG_INIT, 0));
+                    if(!onDisplayReady(opts)) {
+                        stop = true;
+                        break;
+                    }
+                    for(i=0; i<_clicnt; ++i)
+                        armRecv(&r, _clients[i]);
+                    break;
+
+                case TAG_CLIENT:
+                    c = &_pool[(uint32_t)cqe->user_data];
+                    c->pending = false;
+                    data = uring_buf(&r, cqe);
+                    if(res > 0 && NULL != data) {
+                        memcpy(&c->buf[c->cb], data, res);
+                        uring_recycle(&r, cqe);
+                        onReceived(c, res);
+                        armRecv(&r, c);
+                    } else if(-ENOBUFS == res || -EAGAIN == res || -EINTR == res) {
+                        armRecv(&r, c);
+                    } else {
+                        uring_recycle(&r, cqe);
+                        LOG("Client disconneced");
+                        remove_client(c->idx, NULL);
+                    }
+                    break;
             }
         }
+
+        if(NULL != _state && _lcd_ready)
+            _lcd.saveState(_state);
     }
+
+    uring_exit(&r);
+    return true;
 }
+#endif // HAVE_IO_URING
+
+
+static void
+runService(struct run_options *opts)
+{
+    pthread_t tid;
 
+    LOG(APPNAME " service is up and running");
+
+    pool_init();
+
+    _sig_fd = signalfd(-1, &_sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(-1 == _sig_fd)
+        ERR("signalfd(): %s", strerror(errno));
+
+    /* Initialize display in background, so clients which connect (or were
+     * queued by systemd) during that time are served as soon as possible
+     */
+    _init_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(-1 == _init_efd || 0 != pthread_create(&tid, NULL, initThread, opts)) {
+        ERR("Cannot initialize display in background: %s", strerror(errno));
+        return;
+    }
+    pthread_detach(tid);
+
+    sched_init();
+    _watch_fd = watch_init();
+    watch_set_dir(opts->watchDir);
+
+#ifdef HAVE_IO_URING
+    if(NET_URING != opts->netBackend || !runUring(opts))
+        runPoll(opts);
+#else
+    if(NET_URING == opts->netBackend)
+        WARN("Built without io_uring support, using poll()");
+    runPoll(opts);
+#endif
+
+    /* Shutdown: close client sessions (and their recordings) and sockets
+     */
+    while(_clicnt > 0)
+        remove_client(0, NULL);
+    watch_exit();
+    watch_set_dir(NULL);
+    displays_stop_writers();
+    _lcd.stopWriter();
+
+    if(-1 != _stats_sock) {
+        close(_stats_sock);
+        unlink(opts->statsSock);
+    }
+    close(_sig_fd);
+    close(opts->sock);
+}
 
 int
 main(int argc, char *argv[])
 {
     ConfigFile cfg;
+    char path[PATH_MAX];
 
     initOptions(&opts);
     parseCommandLine(&opts, argc, argv);
 
-    cfg.setName(CONFIG_FILE);
+    /* Remember absolute path, daemon changes working directory but
+     * reloads configuration on SIGHUP
+     */
+    if(NULL != realpath(_config_path, path))
+        snprintf(_config_path, sizeof(_config_path), "%s", path);
+
+    cfg.setName(_config_path);
     cfg.load(&opts);
+    blockSignals();
+
+    /* Under systemd (Type=notify) the service must not fork
+     */
+    if(_foreground || NULL != getenv("NOTIFY_SOCKET"))
+        opts.goDaemon = 0;
+
+    if(!log_configure(opts.logLevel, opts.logTarget))
+        ERR("Invalid log target '%s'", opts.logTarget);
 
     LOG("Starting");
-    if(0 == allocateResources(&opts))
+    if(0 == allocateResources(&opts)) {
+        log_start();
         runService(&opts);
+    }
 
+    log_stop();
     cleanupOptions(&opts);
     return EXIT_SUCCESS;
 }
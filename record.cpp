@@ -0,0 +1,74 @@
+#include "config.h"
+#include "common.h"
+#include "logging.h"
+#include "utils.h"
+#include "record.h"
+#include <limits.h>
+#include <time.h>
+
+
+/* Client session recorder. Raw bytes are stored exactly as received, along
+ * with receive times, so replaying a session reproduces both its content
+ * and the way it was split into reads
+ */
+
+
+static void
+put_uint(FILE *fp, uint64_t v)
+{
+    while(v >= 0x80) {
+        putc((v & 0x7F) | 0x80, fp);
+        v >>= 7;
+    }
+    putc(v, fp);
+}
+
+
+/* Creates session file <dir>/<ip>-<port>-<time>.lcdrec and stores session
+ * start in it. Called at accept: last gets monotonic time of the start, so
+ * the first record keeps the gap between connect and the first read.
+ * Returns NULL if file cannot be created
+ */
+FILE *
+rec_open(const char *dir, struct in_addr ip, uint16_t port, uint64_t *last)
+{
+    char name[PATH_MAX];
+    struct timespec ts;
+    FILE *fp;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    *last = now_us();
+
+    snprintf(name, sizeof(name), "%s/%s-%u-%lu" REC_SUFFIX, dir, inet_ntoa(ip), port, (unsigned long)ts.tv_sec);
+    fp = fopen(name, "wb");
+    if(NULL == fp) {
+        WARN_RL("Cannot create session file %s. %s", name, strerror(errno));
+        return NULL;
+    }
+
+    fwrite(REC_MAGIC, 1, REC_MAGIC_LEN, fp);
+    put_uint(fp, (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+    DBG("Recording session to %s", name);
+    return fp;
+}
+
+
+/* Appends record. last holds time of the previous record, or of session
+ * start before the first one
+ */
+void
+rec_write(FILE *fp, uint64_t *last, uint64_t now, const char *buf, size_t len)
+{
+    put_uint(fp, now - *last);
+    put_uint(fp, len);
+    fwrite(buf, 1, len, fp);
+    *last = now;
+}
+
+
+void
+rec_close(FILE *fp)
+{
+    if(NULL != fp)
+        fclose(fp);
+}
@@ -0,0 +1,457 @@
+#include "config.h"
+#include "common.h"
+#include "logging.h"
+#include "utils.h"
+#include "commands.h"
+#include "schedule.h"
+#include "timerwheel.h"
+#include "winstar_lcd.h"
+
+
+/* Daemon-side jobs: delayed and periodic commands, blinking and expiring
+ * regions, animations. All of them are driven by the timer wheel from the
+ * main loop, so no client traffic is needed while they run.
+ *
+ * Animation plays a sequence: list of protocol commands, each followed by
+ * a pause. Steps with zero pause run together with the next one, so a
+ * step may be a whole frame (FRAME BEGIN, a few WRITEs, FRAME END) or a
+ * single changed cell.
+ */
+
+
+enum job_kind {
+    JOB_COMMAND,
+    JOB_BLINK,
+    JOB_EXPIRE,
+    JOB_ANIM
+};
+
+
+struct job_t {
+    wtimer timer;
+    int used;
+    job_kind kind;
+    char id[JOB_ID_LEN];
+    WinStarLCD *lcd;
+    uint8_t row;
+    uint8_t col;
+    uint8_t len;
+    uint8_t off;                    // Blinking region is blanked now
+    uint8_t saved[LCD_MAX_COLS];    // Blinking region contents
+    char cmd[MAX_BUF_SIZE+1];
+    uint8_t seq;                    // Sequence being played
+    uint16_t step;                  // Next step to run
+    uint32_t loops;                 // Passes left, 0 to play forever
+    uint64_t due;                   // When the next step is due, ms
+};
+
+
+struct seq_t {
+    char name[JOB_ID_LEN];          // Empty if slot is free
+    uint16_t nsteps;
+    uint16_t used;                  // Bytes of text taken
+    uint32_t ms[MAX_SEQ_STEPS];     // Pause after the step
+    uint16_t off[MAX_SEQ_STEPS];    // Step command in text
+    char text[SEQ_TEXT_SIZE];
+};
+
+
+static TimerWheel _wheel;
+static job_t _jobs[MAX_JOBS];
+static seq_t _seqs[MAX_SEQS];
+
+
+static void
+free_job(job_t *job)
+{
+    _wheel.cancel(&job->timer);
+    job->used = 0;
+}
+
+
+/* Shows blinking region again, if it is blanked now. Cells written while
+ * it was blank are no longer blank: those are kept, the saved copy is
+ * stale for them
+ */
+static void
+unblank(job_t *job)
+{
+    uint8_t now[LCD_MAX_COLS];
+    uint8_t i, n;
+
+    if(job->off) {
+        job->lcd->claim();
+        n = job->lcd->readCells(job->row, job->col, now, job->len);
+        for(i=0; i<n; ++i)
+            if(' ' != now[i])
+                job->saved[i] = now[i];
+        job->lcd->writeCells(job->row, job->col, job->saved, job->len);
+        job->off = 0;
+    }
+}
+
+
+/* Runs animation steps up to the next one with non-zero pause. Next steps
+ * are timed from when this one was due, not when it ran, so late wakeups
+ * do not add up
+ */
+static void
+anim_step(job_t *job)
+{
+    seq_t *s = &_seqs[job->seq];
+    WinStarLCD *lcd = job->lcd;
+    char cmd[MAX_BUF_SIZE+1];
+    bool wrapped;
+    uint64_t now;
+    uint32_t ms;
+
+    for(wrapped=(0 == job->step); ; ) {
+        if(job->step >= s->nsteps) {
+            if(1 == job->loops) {
+                free_job(job);
+                break;
+            }
+            if(0 != job->loops)
+                --job->loops;
+            job->step = 0;
+
+            /* Whole pass took no time: go on at the next tick, not here */
+            if(wrapped) {
+                ms = 1;
+                break;
+            }
+            wrapped = true;
+        }
+
+        strcpy(cmd, s->text + s->off[job->step]);
+        ms = s->ms[job->step++];
+        exec_command(lcd, cmd);
+
+        /* Step may have cancelled the job or scheduled another one with
+         * the same id
+         */
+        if(!job->used || _wheel.pending(&job->timer) || JOB_ANIM != job->kind)
+            break;
+        if(0 != ms)
+            break;
+    }
+
+    lcd->flush();
+    if(!job->used || _wheel.pending(&job->timer) || JOB_ANIM != job->kind)
+        return;
+
+    now = now_ms();
+    job->due += ms;
+    if(job->due < now)
+        job->due = now; // Fell behind by more than a step, do not rush
+    _wheel.add(&job->timer, job->due);
+}
+
+
+static void
+job_fire(wtimer *t)
+{
+    job_t *job = (job_t *)t->arg;
+    WinStarLCD *lcd = job->lcd;
+    char cmd[MAX_BUF_SIZE+1];
+
+    switch(job->kind) {
+        case JOB_COMMAND:
+            /* Job slot is released before the command runs, so it may
+             * reschedule itself under the same id
+             */
+            strcpy(cmd, job->cmd);
+            if(0 == job->timer.interval)
+                free_job(job);
+            exec_command(lcd, cmd);
+            lcd->flush();
+            break;
+
+        case JOB_BLINK:
+            if(job->off) {
+                unblank(job);
+            } else {
+                job->lcd->claim();
+                job->len = job->lcd->readCells(job->row, job->col, job->saved, job->len);
+                job->lcd->fillRegion(job->row, job->col, job->len, 1);
+                job->off = 1;
+            }
+            break;
+
+        case JOB_EXPIRE:
+            free_job(job);
+            job->lcd->claim();
+            job->lcd->fillRegion(job->row, job->col, job->len, 1);
+            break;
+
+        case JOB_ANIM:
+            anim_step(job);
+            break;
+    }
+}
+
+
+/* Finds job by id, or allocates new one. Existing job with the same id is
+ * cancelled and its slot is reused
+ */
+static job_t *
+get_job(const char *id)
+{
+    job_t *free_slot = NULL;
+    int i;
+
+    if(strlen(id) >= JOB_ID_LEN) {
+        WARN_RL("Job id '%s' is too long", id);
+        return NULL;
+    }
+
+    for(i=0; i<MAX_JOBS; ++i) {
+        if(_jobs[i].used && 0 == strcmp(_jobs[i].id, id)) {
+            if(JOB_BLINK == _jobs[i].kind)
+                unblank(&_jobs[i]);
+            free_job(&_jobs[i]);
+            free_slot = &_jobs[i];
+            break;
+        }
+        if(!_jobs[i].used && NULL == free_slot)
+            free_slot = &_jobs[i];
+    }
+
+    if(NULL == free_slot) {
+        WARN_RL("Too many jobs, '%s' is not scheduled", id);
+        return NULL;
+    }
+
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->used = 1;
+    strcpy(free_slot->id, id);
+    free_slot->timer.cb = job_fire;
+    free_slot->timer.arg = free_slot;
+    return free_slot;
+}
+
+
+void
+sched_init()
+{
+    _wheel.start(now_ms());
+}
+
+
+/* Returns poll() timeout until the next job is due, -1 if there are no jobs
+ */
+int
+sched_timeout()
+{
+    return _wheel.timeout(now_ms());
+}
+
+
+/* Runs all jobs which are due
+ */
+void
+sched_run()
+{
+    _wheel.run(now_ms());
+}
+
+
+/* Schedules protocol command to be executed after delay, and then every
+ * interval milliseconds if interval is not zero
+ */
+bool
+sched_command(WinStarLCD *lcd, const char *id, uint32_t delay, uint32_t interval, const char *cmd)
+{
+    job_t *job;
+
+    if(strlen(cmd) > MAX_BUF_SIZE)
+        return false;
+
+    job = get_job(id);
+    if(NULL == job)
+        return false;
+
+    job->kind = JOB_COMMAND;
+    job->lcd = lcd;
+    strcpy(job->cmd, cmd);
+    job->timer.interval = interval;
+    _wheel.add(&job->timer, now_ms() + delay);
+
+    DBG("Job '%s': '%s' in %ums, every %ums", id, cmd, delay, interval);
+    return true;
+}
+
+
+/* Blinks part of the row: contents are blanked and restored every period
+ * milliseconds until the job is cancelled
+ */
+bool
+sched_blink(WinStarLCD *lcd, const char *id, uint32_t period, uint8_t row, uint8_t col, uint8_t len)
+{
+    job_t *job;
+
+    if(0 == period || 0 == len)
+        return false;
+
+    job = get_job(id);
+    if(NULL == job)
+        return false;
+
+    job->kind = JOB_BLINK;
+    job->lcd = lcd;
+    job->row = row;
+    job->col = col;
+    job->len = len > LCD_MAX_COLS ? LCD_MAX_COLS : len;
+    job->timer.interval = period;
+    _wheel.add(&job->timer, now_ms() + period);
+    return true;
+}
+
+
+/* Blanks part of the row after delay
+ */
+bool
+sched_expire(WinStarLCD *lcd, const char *id, uint32_t delay, uint8_t row, uint8_t col, uint8_t len)
+{
+    job_t *job;
+
+    job = get_job(id);
+    if(NULL == job)
+        return false;
+
+    job->kind = JOB_EXPIRE;
+    job->lcd = lcd;
+    job->row = row;
+    job->col = col;
+    job->len = len;
+    _wheel.add(&job->timer, now_ms() + delay);
+    return true;
+}
+
+
+/* Cancels job. Blinking region is left visible
+ */
+bool
+sched_cancel(const char *id)
+{
+    int i;
+
+    for(i=0; i<MAX_JOBS; ++i)
+        if(_jobs[i].used && 0 == strcmp(_jobs[i].id, id)) {
+            if(JOB_BLINK == _jobs[i].kind)
+                unblank(&_jobs[i]);
+            free_job(&_jobs[i]);
+            return true;
+        }
+
+    return false;
+}
+
+
+/* Cancels all jobs of the display, which is going away. Nothing is drawn
+ */
+void
+sched_drop(WinStarLCD *lcd)
+{
+    int i;
+
+    for(i=0; i<MAX_JOBS; ++i)
+        if(_jobs[i].used && _jobs[i].lcd == lcd)
+            free_job(&_jobs[i]);
+}
+
+
+static seq_t *
+find_seq(const char *name)
+{
+    int i;
+
+    for(i=0; i<MAX_SEQS; ++i)
+        if(0 == strcmp(_seqs[i].name, name))
+            return &_seqs[i];
+    return NULL;
+}
+
+
+/* Appends step to the sequence, creating it if necessary. Steps may be
+ * added while the sequence plays
+ */
+bool
+sched_seq_add(const char *name, uint32_t ms, const char *cmd)
+{
+    seq_t *s;
+    size_t l;
+
+    if('\0' == *name || strlen(name) >= JOB_ID_LEN)
+        return false;
+
+    s = find_seq(name);
+    if(NULL == s) {
+        s = find_seq("");
+        if(NULL == s)
+            return false;
+        strcpy(s->name, name);
+    }
+
+    l = strlen(cmd) + 1;
+    if(MAX_SEQ_STEPS == s->nsteps || l > (size_t)(SEQ_TEXT_SIZE - s->used))
+        return false;
+
+    s->ms[s->nsteps] = ms;
+    s->off[s->nsteps] = s->used;
+    memcpy(s->text + s->used, cmd, l);
+    s->used += l;
+    ++s->nsteps;
+    return true;
+}
+
+
+/* Deletes sequence and stops animations playing it. Screen contents are
+ * left as they are
+ */
+bool
+sched_seq_clear(const char *name)
+{
+    seq_t *s;
+    int i;
+
+    s = find_seq(name);
+    if(NULL == s || '\0' == *name)
+        return false;
+
+    for(i=0; i<MAX_JOBS; ++i)
+        if(_jobs[i].used && JOB_ANIM == _jobs[i].kind && &_seqs[_jobs[i].seq] == s)
+            free_job(&_jobs[i]);
+
+    memset(s, 0, sizeof(*s));
+    return true;
+}
+
+
+/* Plays sequence given number of times, 0 to loop until cancelled. First
+ * step runs on the next pass of the main loop
+ */
+bool
+sched_play(WinStarLCD *lcd, const char *id, const char *name, uint32_t times)
+{
+    job_t *job;
+    seq_t *s;
+
+    s = find_seq(name);
+    if(NULL == s || '\0' == *name || 0 == s->nsteps)
+        return false;
+
+    job = get_job(id);
+    if(NULL == job)
+        return false;
+
+    job->kind = JOB_ANIM;
+    job->lcd = lcd;
+    job->seq = s - _seqs;
+    job->loops = times;
+    job->due = now_ms();
+    _wheel.add(&job->timer, job->due);
+
+    DBG("Job '%s': playing '%s' %u times", id, name, times);
+    return true;
+}
@@ -0,0 +1,80 @@
+#include "config.h"
+#include "common.h"
+#include "logging.h"
+#include "systemd.h"
+#include <stddef.h>
+#include <sys/un.h>
+
+
+/* Minimal implementation of systemd socket activation and readiness
+ * protocols, see sd_listen_fds(3) and sd_notify(3). Does not need
+ * libsystemd, which is not available on target
+ */
+
+
+#define SD_LISTEN_FDS_START 3
+
+
+/* Returns listening socket passed by systemd, or -1 if service was not
+ * socket-activated. Environment variables are cleared, so they are not
+ * inherited by child processes
+ */
+int
+sysd_listen_fd()
+{
+    const char *pid, *fds;
+    int n;
+
+    pid = getenv("LISTEN_PID");
+    fds = getenv("LISTEN_FDS");
+    if(NULL == pid || NULL == fds || (pid_t)strtol(pid, NULL, 10) != getpid())
+        return -1;
+
+    n = atoi(fds);
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    if(n < 1)
+        return -1;
+    if(n > 1)
+        WARN("%d sockets passed by systemd, using the first one", n);
+
+    fcntl(SD_LISTEN_FDS_START, F_SETFD, FD_CLOEXEC);
+    return SD_LISTEN_FDS_START;
+}
+
+
+/* Sends state string ("READY=1", "RELOADING=1", "STOPPING=1"...) to the
+ * service manager. Returns false if service was not started by systemd
+ * with Type=notify
+ */
+bool
+sysd_notify(const char *state)
+{
+    struct sockaddr_un addr;
+    const char *path;
+    socklen_t len;
+    int fd;
+
+    path = getenv("NOTIFY_SOCKET");
+    if(NULL == path || ('/' != path[0] && '@' != path[0]) || strlen(path) >= sizeof(addr.sun_path))
+        return false;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if('@' == path[0])
+        addr.sun_path[0] = '\0'; // abstract namespace
+    len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(-1 == fd)
+        return false;
+
+    if(sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr, len) < 0)
+        WARN_RL("sd_notify(%s) failed: %s", state, strerror(errno));
+
+    close(fd);
+    return true;
+}
@@ -0,0 +1,209 @@
+#include "config.h"
+#include "common.h"
+#include "logging.h"
+#include "template.h"
+#include "winstar_lcd.h"
+
+
+/* Screen templates. Template row is a text with named fields, like
+ *
+ *      T: {t:>5.1}C  H: {h:3}%
+ *
+ * Field is written as {name[:[align][width][.prec]]}, where align is one of
+ * '<', '>' or '^'. Width defaults to the length of the placeholder itself,
+ * so the template looks like the screen. Numbers are right-aligned and text
+ * is left-aligned unless told otherwise. When precision is given, value is
+ * printed as a fixed point number.
+ */
+
+
+struct tpl_field {
+    WinStarLCD *lcd;
+    char name[TPL_NAME_LEN];
+    uint8_t row;
+    uint8_t col;
+    uint8_t width;
+    int8_t prec;                // -1 if value is printed as is
+    char align;                 // '<', '>', '^' or 0 for automatic
+};
+
+
+static tpl_field _fields[MAX_FIELDS];
+static int _nfields;
+
+
+/* Parses field spec between braces. Returns false if it is malformed
+ */
+static bool
+parse_field(const char *spec, size_t len, tpl_field *f)
+{
+    const char *p, *end = spec + len;
+    size_t nl;
+
+    p = (const char *)memchr(spec, ':', len);
+    nl = (NULL == p) ? len : (size_t)(p - spec);
+    if(0 == nl || nl >= TPL_NAME_LEN)
+        return false;
+
+    memcpy(f->name, spec, nl);
+    f->name[nl] = '\0';
+    f->align = 0;
+    f->prec = -1;
+    f->width = len + 2;         // placeholder with braces
+
+    if(NULL == p)
+        return true;
+
+    ++p;
+    if(p < end && ('<' == *p || '>' == *p || '^' == *p))
+        f->align = *p++;
+
+    if(p < end && isdigit(*p)) {
+        f->width = 0;
+        for(; p < end && isdigit(*p); ++p)
+            f->width = f->width * 10 + (*p - '0');
+    }
+
+    if(p < end && '.' == *p) {
+        f->prec = 0;
+        for(++p; p < end && isdigit(*p); ++p)
+            f->prec = f->prec * 10 + (*p - '0');
+    }
+
+    return p == end && 0 != f->width;
+}
+
+
+/* Drops fields of the row, or all fields of the display if row is negative
+ */
+static void
+drop_fields(WinStarLCD *lcd, int row)
+{
+    int i, j;
+
+    for(i=0, j=0; i<_nfields; ++i)
+        if(_fields[i].lcd != lcd || (row >= 0 && _fields[i].row != row))
+            _fields[j++] = _fields[i];
+
+    _nfields = j;
+}
+
+
+/* Defines template row: draws its static text and remembers field positions.
+ * Previous template of the row is replaced
+ */
+bool
+tpl_define(WinStarLCD *lcd, unsigned row, const char *text)
+{
+    char line[MAX_BUF_SIZE+1];
+    const char *p, *close;
+    tpl_field f;
+    unsigned col;
+    size_t n;
+
+    if(row >= lcd->rows())
+        return false;
+
+    drop_fields(lcd, row);
+
+    for(p=text, n=0, col=0; '\0' != *p && n < sizeof(line) - 1; ) {
+        close = ('{' == *p) ? strchr(p, '}') : NULL;
+        if(NULL == close) {
+            if(0x80 != (*p & 0xC0))
+                ++col;
+            line[n++] = *p++;
+            continue;
+        }
+
+        if(!parse_field(p + 1, close - p - 1, &f)) {
+            WARN_RL("TPL: invalid field '%.*s'", (int)(close - p + 1), p);
+            return false;
+        }
+
+        if(MAX_FIELDS == _nfields) {
+            WARN_RL("TPL: too many fields");
+            return false;
+        }
+
+        f.lcd = lcd;
+        f.row = row;
+        f.col = col;
+        if(col >= lcd->cols())
+            break;
+        if(f.width > lcd->cols() - col)
+            f.width = lcd->cols() - col;
+        _fields[_nfields++] = f;
+
+        /* Field cells are blank until the value is set */
+        for(col += f.width; 0 != f.width && n < sizeof(line) - 1; --f.width)
+            line[n++] = ' ';
+        p = close + 1;
+    }
+
+    line[n] = '\0';
+    lcd->writeLine(row, line);
+    return true;
+}
+
+
+/* Removes all templates of the display. Screen contents are left intact
+ */
+void
+tpl_clear(WinStarLCD *lcd)
+{
+    drop_fields(lcd, -1);
+}
+
+
+/* Formats value into every field with given name. Only cells which change
+ * are sent to the display. Returns number of fields updated
+ */
+int
+tpl_set(WinStarLCD *lcd, const char *name, const char *value)
+{
+    tpl_field *f;
+    char num[64];
+    const char *v;
+    uint8_t codes[LCD_MAX_COLS], cell[LCD_MAX_COLS];
+    unsigned n, pad;
+    char *end;
+    double d;
+    bool numeric;
+    int i, updated;
+
+    d = strtod(value, &end);
+    numeric = ('\0' != *value && '\0' == *end);
+
+    for(i=0, updated=0; i<_nfields; ++i) {
+        f = &_fields[i];
+        if(f->lcd != lcd || 0 != strcmp(f->name, name))
+            continue;
+
+        v = value;
+        if(numeric && f->prec >= 0) {
+            snprintf(num, sizeof(num), "%.*f", f->prec, d);
+            v = num;
+        }
+
+        n = lcd->encode(v, strlen(v), codes, f->width);
+
+        switch(f->align ? f->align : (numeric ? '>' : '<')) {
+            case '>':
+                pad = f->width - n;
+                break;
+            case '^':
+                pad = (f->width - n) / 2;
+                break;
+            default:
+                pad = 0;
+                break;
+        }
+
+        memset(cell, ' ', f->width);
+        memcpy(&cell[pad], codes, n);
+        lcd->writeCells(f->row, f->col, cell, f->width);
+        ++updated;
+    }
+
+    return updated;
+}
@@ -0,0 +1,72 @@
+#include "test_util.h"
+
+
+/* Error recovery over the sim transport. LCD_SIM_FAULTS=1 makes every
+ * transaction fail until it is unset. Retry times are not waited for:
+ * retry_at of the output is moved into the past instead
+ */
+
+
+static void
+draw(WinStarLCD *lcd, const char *top, const char *bottom)
+{
+    static const uint8_t degree[8] = { 0x0C, 0x12, 0x12, 0x0C, 0x00, 0x00, 0x00, 0x00 };
+
+    lcd->defineGlyph(0x2103, degree);
+    lcd->writeLine(0, top);
+    lcd->writeLine(1, bottom);
+    lcd->barDefine(0, WinStarLCD::BAR_HORIZONTAL, 1, 10, 6);
+    lcd->barSet(0, 17);
+    lcd->drain();
+}
+
+
+int
+main()
+{
+    lcd_transport *io = lcd_transport_create("sim");
+    WinStarLCD lcd;
+    lcd_output *o;
+    uint32_t backoff;
+    int next;
+
+    unsetenv("LCD_SIM_FAULTS");
+    lcd.setTransport(io, true);
+    CHECK(0 == lcd.init(1));
+    o = lcd.output();
+
+    draw(&lcd, "before", "ok");
+    CHECK(!o->failed && -1 == lcd.recover());
+    CHECK(sim_matches(&lcd, io, LCD_DEFAULT_ADDR));
+
+    /* Failed write marks the output, drawing goes on in the shadow copy */
+    setenv("LCD_SIM_FAULTS", "1", 1);
+    draw(&lcd, "bus is down \xe2\x84\x83", "still drawn");
+    CHECK(o->failed);
+
+    /* First call schedules the retry, every failed attempt doubles it */
+    CHECK(LCD_RETRY_MIN_MS == lcd.recover());
+    CHECK(LCD_RETRY_MIN_MS == o->backoff && 0 != o->retry_at);
+    for(backoff=LCD_RETRY_MIN_MS; backoff < LCD_RETRY_MAX_MS; ) {
+        backoff = (backoff * 2 > LCD_RETRY_MAX_MS) ? LCD_RETRY_MAX_MS : backoff * 2;
+        o->retry_at = 1;
+        next = lcd.recover();
+        CHECK((int)backoff == next && backoff == o->backoff && o->failed);
+    }
+
+    /* Interval stays at the limit */
+    o->retry_at = 1;
+    CHECK(LCD_RETRY_MAX_MS == lcd.recover() && LCD_RETRY_MAX_MS == o->backoff);
+    CHECK(0 == lcd.recoveredPanels());
+
+    /* Bus is back: the panel is re-initialized and shows the shadow copy */
+    unsetenv("LCD_SIM_FAULTS");
+    o->retry_at = 1;
+    CHECK(-1 == lcd.recover());
+    CHECK(!o->failed && 0 == o->retry_at && 1 == lcd.recoveredPanels());
+    CHECK(sim_matches(&lcd, io, LCD_DEFAULT_ADDR));
+
+    draw(&lcd, "after", "recovered");
+    CHECK(!o->failed && sim_matches(&lcd, io, LCD_DEFAULT_ADDR));
+    return test_result("test_recovery");
+}
@@ -0,0 +1,215 @@
+#include <stdarg.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "test_util.h"
+
+
+/* Transport tests. The i2cdev backend is opened on /dev/null and its
+ * I2C_RDWR ioctls are taken over below: every message is logged and passed
+ * to a simulator, so the backend is checked without an I2C adapter. The
+ * same drawing sent through the sim backend must give the same messages
+ */
+
+
+#define LOG_SIZE        65536
+
+
+struct msg_log {
+    uint8_t data[LOG_SIZE];
+    size_t len;
+};
+
+
+static msg_log _dev_log;        // Messages of i2cdev ioctls
+static msg_log _sim_log;        // Messages of sim transport
+static lcd_transport *_dev_sim; // Panels behind i2cdev
+static int _combined;           // Ioctls with more than one write
+
+
+static void
+log_msg(msg_log *l, uint8_t addr, const uint8_t *msg, uint16_t len)
+{
+    if(l->len + 3 + len > LOG_SIZE)
+        return;
+
+    l->data[l->len++] = addr;
+    l->data[l->len++] = len & 0xFF;
+    l->data[l->len++] = len >> 8;
+    memcpy(l->data + l->len, msg, len);
+    l->len += len;
+}
+
+
+extern "C" int
+ioctl(int, unsigned long req, ...) noexcept
+{
+    struct i2c_rdwr_ioctl_data *d;
+    va_list ap;
+    unsigned i;
+
+    va_start(ap, req);
+    d = va_arg(ap, struct i2c_rdwr_ioctl_data *);
+    va_end(ap);
+    if(I2C_RDWR != req)
+        return -1;
+
+    if(d->nmsgs > 1 && 0 == (d->msgs[1].flags & I2C_M_RD))
+        ++_combined;
+
+    for(i=0; i<d->nmsgs; ++i) {
+        if(i + 1 < d->nmsgs && (d->msgs[i+1].flags & I2C_M_RD)) {
+            if(_dev_sim->read(d->msgs[i].addr, d->msgs[i].buf[0], d->msgs[i+1].buf) < 0)
+                return -1;
+            ++i;
+            continue;
+        }
+
+        log_msg(&_dev_log, d->msgs[i].addr, d->msgs[i].buf, d->msgs[i].len);
+        if(_dev_sim->write(d->msgs[i].addr, d->msgs[i].buf, d->msgs[i].len) < 0)
+            return -1;
+    }
+    return d->nmsgs;
+}
+
+
+/* Sim transport logging what it is asked to write
+ */
+class sim_logger: public lcd_transport {
+private:
+    lcd_transport *_sim;
+public:
+    sim_logger(): _sim(lcd_transport_create("sim")) {}
+    ~sim_logger() { delete _sim; }
+    const char *name() const { return "sim"; }
+    uint16_t maxBurst() const { return _sim->maxBurst(); }
+    int open(const char *bus) { return _sim->open(bus); }
+    int write(uint8_t addr, const uint8_t *msg, uint16_t len) {
+        log_msg(&_sim_log, addr, msg, len);
+        return _sim->write(addr, msg, len);
+    }
+    int read(uint8_t addr, uint8_t reg, uint8_t *v) { return _sim->read(addr, reg, v); }
+    lcd_transport *sim() { return _sim; }
+};
+
+
+static void
+draw(WinStarLCD *lcd)
+{
+    static const uint8_t arrow[8] = { 0x04, 0x0E, 0x15, 0x04, 0x04, 0x04, 0x04, 0x00 };
+    int i;
+
+    lcd->defineGlyph(0x2191, arrow);
+    lcd->writeLine(0, "Transport \xe2\x86\x91", WinStarLCD::ALIGN_CENTER);
+    lcd->barDefine(0, WinStarLCD::BAR_HORIZONTAL, 1, 0, 10);
+    for(i=0; i<=50; i+=7)
+        lcd->barSet(0, i);
+    lcd->writeAt(1, 12, "done", 4);
+    lcd->drain();
+}
+
+
+/* Library must hand both backends the same bytes, and both must leave the
+ * panel showing the shadow copy
+ */
+static void
+test_parity()
+{
+    WinStarLCD dev, sim;
+    sim_logger *log = new sim_logger();
+    lcd_transport *io;
+
+    io = lcd_transport_create("i2cdev");
+    CHECK(NULL != io && 0 == strcmp(io->name(), "i2cdev"));
+    dev.setTransport(io, true);
+    CHECK(0 == dev.init("/dev/null"));
+    sim.setTransport(log, true);
+    CHECK(0 == sim.init(1));
+
+    draw(&dev);
+    draw(&sim);
+    CHECK(0 != _dev_log.len && _dev_log.len == _sim_log.len);
+    CHECK(0 == memcmp(_dev_log.data, _sim_log.data, _dev_log.len));
+
+    CHECK(sim_matches(&dev, _dev_sim, LCD_DEFAULT_ADDR));
+    CHECK(sim_matches(&sim, log->sim(), LCD_DEFAULT_ADDR));
+}
+
+
+/* Group members on one adapter are written by combined ioctls, and both
+ * panels get the picture
+ */
+static void
+test_combined()
+{
+    WinStarLCD a, b, group;
+    lcd_transport *io;
+    int before;
+
+    /* Fresh panels: glyphs loaded by the previous test are not in the group CGRAM */
+    delete _dev_sim;
+    _dev_sim = lcd_transport_create("sim");
+
+    io = lcd_transport_create("i2cdev");
+    a.setTransport(io, true);
+    CHECK(0 == a.init("/dev/null"));
+    b.setTransport(io);
+    b.setAddress(LCD_DEFAULT_ADDR + 1);
+    CHECK(0 == b.init("/dev/null"));
+
+    CHECK(group.addOutput(a.output()) && group.addOutput(b.output()));
+    group.claim();
+    before = _combined;
+    group.clear();
+    group.writeLine(0, "both panels");
+    group.drain();
+    CHECK(_combined > before);
+
+    CHECK(sim_matches(&group, _dev_sim, LCD_DEFAULT_ADDR));
+    CHECK(sim_matches(&group, _dev_sim, LCD_DEFAULT_ADDR + 1));
+    b.setTransport(NULL);
+}
+
+
+/* scrub() reads cells back through the transport: a cell changed behind
+ * the library back is found and rewritten, intact ones are left alone
+ */
+static void
+test_readback()
+{
+    lcd_transport *io = lcd_transport_create("sim");
+    WinStarLCD lcd;
+    int i;
+
+    lcd.setTransport(io, true);
+    CHECK(0 == lcd.init(1));
+    lcd.writeLine(0, "read back");
+    lcd.writeLine(1, "0123456789ABCDEF");
+    lcd.drain();
+
+    for(i=0; i<lcd.rows() * lcd.cols(); ++i)
+        CHECK(lcd.scrub());
+    CHECK(32 == lcd.scrubbedCells() && 0 == lcd.repairedCells());
+
+    sim_byte(io, LCD_DEFAULT_ADDR, 0x80 | 0x43, false);
+    sim_byte(io, LCD_DEFAULT_ADDR, 'X', true);
+    for(i=0; i<lcd.rows() * lcd.cols(); ++i)
+        lcd.scrub();
+    CHECK(64 == lcd.scrubbedCells() && 1 == lcd.repairedCells());
+    CHECK(sim_matches(&lcd, io, LCD_DEFAULT_ADDR));
+}
+
+
+int
+main()
+{
+    unsetenv("LCD_SIM_FAULTS");
+    _dev_sim = lcd_transport_create("sim");
+    CHECK(NULL == lcd_transport_create("nosuch"));
+
+    test_parity();
+    test_combined();
+    test_readback();
+
+    delete _dev_sim;
+    return test_result("test_transport");
+}
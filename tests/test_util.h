@@ -0,0 +1,113 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "winstar_lcd.h"
+
+
+/* Helpers of library tests. Panels are driven over the sim transport, and
+ * its memory is read back through the same GPIO cycles the library uses,
+ * so nothing but the transport interface is assumed
+ */
+
+
+#define SIM_GPIO        0x09
+#define SIM_DIR         0x00
+#define SIM_RS          0x01
+#define SIM_RW          0x02
+#define SIM_E           0x04
+
+
+static int _failures;
+
+
+#define CHECK(cond) do { \
+        if(!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            ++_failures; \
+        } \
+    } while(0)
+
+
+/* Clocks byte into controller as two nibbles
+ */
+static void
+sim_byte(lcd_transport *io, uint8_t addr, uint8_t v, bool rs)
+{
+    uint8_t msg[5];
+    uint8_t ctl = rs ? SIM_RS : 0;
+
+    msg[0] = SIM_GPIO;
+    msg[1] = ((v >> 4) << 3) | ctl | SIM_E;
+    msg[2] = ((v >> 4) << 3) | ctl;
+    msg[3] = ((v & 0x0F) << 3) | ctl | SIM_E;
+    msg[4] = ((v & 0x0F) << 3) | ctl;
+    io->write(addr, msg, sizeof(msg));
+}
+
+
+/* Reads n bytes of display (cg false) or glyph memory from address a
+ */
+static bool
+sim_read(lcd_transport *io, uint8_t addr, bool cg, uint8_t a, uint8_t *out, int n)
+{
+    const uint8_t ctl = SIM_RS | SIM_RW;
+    uint8_t hi, lo;
+    bool ok;
+    int i;
+
+    sim_byte(io, addr, (cg ? 0x40 : 0x80) | a, false);
+    ok = io->write1(addr, SIM_DIR, 0x78) >= 0;
+    for(i=0; i<n && ok; ++i) {
+        ok = io->write1(addr, SIM_GPIO, ctl | SIM_E) >= 0
+            && io->read(addr, SIM_GPIO, &hi) >= 0
+            && io->write1(addr, SIM_GPIO, ctl) >= 0
+            && io->write1(addr, SIM_GPIO, ctl | SIM_E) >= 0
+            && io->read(addr, SIM_GPIO, &lo) >= 0
+            && io->write1(addr, SIM_GPIO, ctl) >= 0;
+        out[i] = (((hi >> 3) & 0x0F) << 4) | ((lo >> 3) & 0x0F);
+    }
+    io->write1(addr, SIM_DIR, 0x00);
+    return ok;
+}
+
+
+/* Compares panel memory with display shadow copy: both DDRAM lines and
+ * all of CGRAM
+ */
+static bool
+sim_matches(WinStarLCD *lcd, lcd_transport *io, uint8_t addr)
+{
+    WinStarLCD::state_t st;
+    uint8_t ddram[80], cgram[LCD_CGRAM_SIZE * 8];
+
+    memset(&st, 0, sizeof(st));
+    lcd->saveState(&st);
+    lcd->drain();
+
+    if(!sim_read(io, addr, false, 0x00, ddram, 80) || !sim_read(io, addr, true, 0x00, cgram, sizeof(cgram)))
+        return false;
+
+    /* Address counter goes back where the object expects it */
+    sim_byte(io, addr, (st.ac_cgram ? 0x40 : 0x80) | st.ac, false);
+    return 0 == memcmp(ddram, st.ddram, 40) && 0 == memcmp(ddram + 40, st.ddram + 0x40, 40)
+        && 0 == memcmp(cgram, st.cgram, sizeof(cgram));
+}
+
+
+static int
+test_result(const char *name)
+{
+    if(0 != _failures) {
+        fprintf(stderr, "%s: %d checks failed\n", name, _failures);
+        return 1;
+    }
+    printf("%s: passed\n", name);
+    return 0;
+}
+
+
+#endif // TEST_UTIL_H
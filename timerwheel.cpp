@@ -0,0 +1,212 @@
+#include <stddef.h>
+#include "timerwheel.h"
+
+
+#define LEVEL_SHIFT(l)  ((l) * TW_SLOT_BITS)
+#define SLOT_MASK       (TW_SLOTS - 1)
+
+
+TimerWheel::TimerWheel(): _now(0), _count(0)
+{
+    int l, s;
+
+    for(l=0; l<TW_LEVELS; ++l) {
+        _occupied[l] = 0;
+        for(s=0; s<TW_SLOTS; ++s)
+            _slots[l][s].next = _slots[l][s].prev = &_slots[l][s];
+    }
+}
+
+
+/* Sets current time. Must be called once before any timer is added
+ */
+void
+TimerWheel::start(uint64_t now)
+{
+    _now = now;
+}
+
+
+/* Puts timer into the slot matching its expiration time. Timers which are
+ * already due go to the slot of \c base tick
+ */
+void
+TimerWheel::link(wtimer *t, uint64_t base)
+{
+    uint64_t delta, when;
+    wtimer *head;
+    int l, s;
+
+    when = (t->expires > base) ? t->expires : base;
+    delta = when - _now;
+
+    for(l=0; l<TW_LEVELS-1; ++l)
+        if(delta < (1ULL << LEVEL_SHIFT(l+1)))
+            break;
+
+    /* Timers beyond the wheel range park in the farthest slot of the top
+     * level and are re-linked when that slot cascades
+     */
+    if(delta >= (1ULL << LEVEL_SHIFT(TW_LEVELS)))
+        when = _now + (1ULL << LEVEL_SHIFT(TW_LEVELS)) - 1;
+
+    s = (when >> LEVEL_SHIFT(l)) & SLOT_MASK;
+    head = &_slots[l][s];
+
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    t->slot = l * TW_SLOTS + s;
+    _occupied[l] |= 1ULL << s;
+}
+
+
+/* Schedules timer. Already pending timer is rescheduled
+ */
+void
+TimerWheel::add(wtimer *t, uint64_t expires)
+{
+    if(pending(t))
+        cancel(t);
+
+    t->expires = expires;
+    link(t, _now + 1);
+    ++_count;
+}
+
+
+void
+TimerWheel::cancel(wtimer *t)
+{
+    int l, s;
+
+    if(!pending(t))
+        return;
+
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    --_count;
+
+    /* Clear occupancy bit if the slot became empty */
+    l = t->slot / TW_SLOTS;
+    s = t->slot % TW_SLOTS;
+    if(_slots[l][s].next == &_slots[l][s])
+        _occupied[l] &= ~(1ULL << s);
+}
+
+
+/* Moves timers of the current slot of given level one level down
+ */
+void
+TimerWheel::cascade(int l)
+{
+    wtimer *head, *t, *next;
+    int s;
+
+    s = (_now >> LEVEL_SHIFT(l)) & SLOT_MASK;
+    if(0 == (_occupied[l] & (1ULL << s)))
+        return;
+
+    head = &_slots[l][s];
+    t = head->next;
+    head->next = head->prev = head;
+    _occupied[l] &= ~(1ULL << s);
+
+    for(; t != head; t = next) {
+        next = t->next;
+        link(t, _now);
+    }
+}
+
+
+/* Returns number of milliseconds until the next timer is due, -1 when
+ * nothing is scheduled. Result for timers on upper levels is a lower bound:
+ * caller wakes up at the slot boundary, cascades and asks again.
+ */
+int
+TimerWheel::timeout(uint64_t now) const
+{
+    uint64_t bits, when, next;
+    int l, pos;
+
+    if(0 == _count)
+        return -1;
+
+    for(l=0, next=~0ULL; l<TW_LEVELS; ++l) {
+        if(0 == _occupied[l])
+            continue;
+
+        /* Rotate bitmap so that bit 0 is the slot after current one */
+        pos = ((_now >> LEVEL_SHIFT(l)) + 1) & SLOT_MASK;
+        bits = (_occupied[l] >> pos) | (0 == pos ? 0 : _occupied[l] << (TW_SLOTS - pos));
+
+        when = ((_now >> LEVEL_SHIFT(l)) + 1 + __builtin_ctzll(bits)) << LEVEL_SHIFT(l);
+        if(when < next)
+            next = when;
+    }
+
+    if(next <= now)
+        return 0;
+    if(next - now > 0x7FFFFFFF)
+        return 0x7FFFFFFF;
+    return next - now;
+}
+
+
+/* Advances the wheel up to given time, firing expired timers. Periodic
+ * timers are re-armed before their callback is invoked, so the callback
+ * may cancel them.
+ */
+void
+TimerWheel::run(uint64_t now)
+{
+    wtimer *head, *t;
+    uint64_t span;
+    int l, s;
+
+    if(0 == _count) {
+        if(now > _now)
+            _now = now;
+        return;
+    }
+
+    while(_now < now) {
+        /* Skip ticks that cannot fire anything: when levels 0..l are
+         * empty, nothing happens until the next level l+1 slot boundary
+         */
+        for(l=0, span=0; l<TW_LEVELS-1 && 0 == _occupied[l]; ++l)
+            span = (1ULL << LEVEL_SHIFT(l+1)) - 1;
+        if(0 != span && (_now | span) > _now) {
+            _now = ((_now | span) < now) ? (_now | span) : now;
+            if(_now == now)
+                break;
+        }
+
+        ++_now;
+        for(l=1; l<TW_LEVELS; ++l) {
+            if(0 != (_now & ((1ULL << LEVEL_SHIFT(l)) - 1)))
+                break;
+            cascade(l);
+        }
+
+        s = _now & SLOT_MASK;
+        head = &_slots[0][s];
+        while(head->next != head) {
+            t = head->next;
+            cancel(t);
+
+            if(0 != t->interval) {
+                do
+                    t->expires += t->interval;
+                while(t->expires <= _now);
+                link(t, _now + 1);
+                ++_count;
+            }
+
+            t->cb(t);
+        }
+        _occupied[0] &= ~(1ULL << s);
+    }
+}
@@ -0,0 +1,363 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+/* Load generator for lcdsrv. Opens several connections and sends a mix of
+ * commands, each batch followed by "SYNC <seq>". Time from sending SYNC to
+ * receiving its "OK <seq>" is the ack latency: all commands of the batch
+ * have been executed and flushed to the bus by then.
+ */
+
+
+#define MAX_CONNS       64
+#define MAX_INFLIGHT    64          // Unacknowledged SYNCs per connection
+#define MAX_BATCH       32          // Commands per SYNC
+#define REPLY_BUF       512
+
+
+enum cmd_kind {
+    K_ECHO = 0,
+    K_ADDR,
+    K_CLEAR,
+    K_HOME,
+    K_WRITE,
+    K_NKINDS
+};
+
+
+struct conn_t {
+    int fd;
+    uint32_t seq;               // Next SYNC sequence number
+    uint32_t inflight;
+    uint64_t sent_at[MAX_INFLIGHT];
+    char rbuf[REPLY_BUF];
+    size_t rlen;
+};
+
+
+static const char *_kind_names[K_NKINDS] = { "echo", "A", "C", "H", "write" };
+
+static const char _optstr[] = "i:t:c:r:d:m:k:w:h";
+static const char _helpstr[] =
+"%s: lcdsrv load generator.\n"
+"Usage: %s <options>\n"
+"Options:\n"
+"   -i IP           Service address, default 127.0.0.1\n"
+"   -t PORT         Service port, default 6116\n"
+"   -c N            Number of connections, default 1\n"
+"   -r RATE         Total commands per second, 0 for as fast as acks allow\n"
+"   -d SEC          Test duration in seconds, default 10\n"
+"   -m MIX          Command mix as kind:weight list, kinds are\n"
+"                   echo, A, C, H and write. Default echo:8,A:1,H:1\n"
+"   -k N            Send SYNC after every N commands, default 1\n"
+"   -w N            Max unacknowledged SYNCs per connection, default 16\n"
+"   -h              Print this message and exit\n"
+;
+
+
+static conn_t _conns[MAX_CONNS];
+static unsigned _weights[K_NKINDS];
+static uint32_t *_lat;             // Latency samples, us
+static size_t _nlat, _lat_size;
+
+
+static uint64_t
+now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static bool
+parse_mix(const char *arg)
+{
+    char name[16];
+    unsigned w;
+    int i, n;
+
+    memset(_weights, 0, sizeof(_weights));
+    while('\0' != *arg) {
+        if(2 != sscanf(arg, "%15[^:]:%u%n", name, &w, &n))
+            return false;
+
+        for(i=0; i<K_NKINDS; ++i)
+            if(0 == strcmp(name, _kind_names[i]))
+                break;
+        if(K_NKINDS == i)
+            return false;
+
+        _weights[i] = w;
+        arg += n;
+        if(',' == *arg)
+            ++arg;
+    }
+
+    for(i=0; i<K_NKINDS; ++i)
+        if(0 != _weights[i])
+            return true;
+    return false;
+}
+
+
+/* Builds random command according to the mix
+ */
+static int
+make_command(char *buf, size_t size, uint32_t n)
+{
+    unsigned total, r;
+    int i;
+
+    for(i=0, total=0; i<K_NKINDS; ++i)
+        total += _weights[i];
+
+    r = rand() % total;
+    for(i=0; r >= _weights[i]; ++i)
+        r -= _weights[i];
+
+    switch(i) {
+        case K_ECHO:
+            return snprintf(buf, size, "\\bench %08u\r\n", n);
+        case K_ADDR:
+            return snprintf(buf, size, "A%02X\r\n", rand() % 0x10);
+        case K_CLEAR:
+            return snprintf(buf, size, "C\r\n");
+        case K_HOME:
+            return snprintf(buf, size, "H\r\n");
+        default:
+            return snprintf(buf, size, "WRITE %d 0 %08u\r\n", rand() % 2, n);
+    }
+}
+
+
+static void
+add_sample(uint32_t v)
+{
+    uint32_t *p;
+
+    if(_nlat == _lat_size) {
+        _lat_size = _lat_size ? _lat_size * 2 : 4096;
+        p = (uint32_t *)realloc(_lat, _lat_size * sizeof(*_lat));
+        if(NULL == p) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        _lat = p;
+    }
+    _lat[_nlat++] = v;
+}
+
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static int
+connect_to(const char *ip, int port)
+{
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(0 == inet_aton(ip, &addr.sin_addr)) {
+        fprintf(stderr, "Invalid address '%s'\n", ip);
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(-1 == fd)
+        return -1;
+
+    if(-1 == connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "Cannot connect to %s:%d. %s\n", ip, port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+
+/* Reads replies, matching "OK <seq>" lines with send times. Returns false
+ * if connection was closed
+ */
+static bool
+read_replies(conn_t *c, uint64_t now)
+{
+    char *p, *eol;
+    ssize_t nb;
+    unsigned long seq;
+
+    nb = read(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen - 1);
+    if(nb <= 0)
+        return false;
+
+    c->rlen += nb;
+    c->rbuf[c->rlen] = '\0';
+
+    for(p=c->rbuf; NULL != (eol = strchr(p, '\n')); p=eol+1) {
+        if(1 == sscanf(p, "OK %lu", &seq) && c->inflight > 0) {
+            add_sample(now - c->sent_at[seq % MAX_INFLIGHT]);
+            --c->inflight;
+        }
+    }
+
+    c->rlen -= p - c->rbuf;
+    memmove(c->rbuf, p, c->rlen);
+    if(sizeof(c->rbuf) - 1 == c->rlen)
+        c->rlen = 0;
+    return true;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    const char *ip = "127.0.0.1";
+    int port = 6116, nconns = 1, rate = 0, duration = 10, every = 1, window = 16;
+    struct pollfd fds[MAX_CONNS];
+    char buf[(MAX_BATCH + 1) * 32];
+    uint64_t start, end, now, next, interval;
+    uint64_t sent = 0, stalled = 0;
+    int i, n, len, rr, full, timeout;
+    double secs;
+
+    _weights[K_ECHO] = 8;
+    _weights[K_ADDR] = 1;
+    _weights[K_HOME] = 1;
+
+    while(-1 != (n = getopt(argc, argv, _optstr))) {
+        switch(n) {
+            case 'i': ip = optarg; break;
+            case 't': port = atoi(optarg); break;
+            case 'c': nconns = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'k': every = atoi(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            case 'm':
+                if(!parse_mix(optarg)) {
+                    fprintf(stderr, "Invalid command mix '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                fprintf(stdout, _helpstr, argv[0], argv[0]);
+                return EXIT_SUCCESS;
+        }
+    }
+
+    if(nconns < 1 || nconns > MAX_CONNS || every < 1 || every > MAX_BATCH || window < 1 || window > MAX_INFLIGHT) {
+        fprintf(stderr, "Connections must be 1..%d, batch 1..%d, window 1..%d\n", MAX_CONNS, MAX_BATCH, MAX_INFLIGHT);
+        return EXIT_FAILURE;
+    }
+
+    for(i=0; i<nconns; ++i) {
+        _conns[i].fd = connect_to(ip, port);
+        if(-1 == _conns[i].fd)
+            return EXIT_FAILURE;
+        fds[i].fd = _conns[i].fd;
+        fds[i].events = POLLIN;
+    }
+
+    interval = rate > 0 ? 1000000 / rate : 0;
+    start = next = now_us();
+    end = start + (uint64_t)duration * 1000000;
+    rr = 0;
+
+    for(now=start; now < end; now=now_us()) {
+        /* Send every batch which is due. In open loop (fixed rate) mode
+         * batches for connections with full window are counted as stalled
+         */
+        for(full=0; next <= now && full < nconns; ) {
+            conn_t *c = &_conns[rr];
+
+            rr = (rr + 1) % nconns;
+            if(c->inflight >= (uint32_t)window) {
+                if(0 == interval) {
+                    ++full;
+                    continue;
+                }
+                ++stalled;
+                next += interval * every;
+                continue;
+            }
+
+            for(i=0, len=0; i<every; ++i)
+                len += make_command(buf + len, sizeof(buf) - len, (uint32_t)(sent + i));
+            len += snprintf(buf + len, sizeof(buf) - len, "SYNC %u\r\n", c->seq);
+
+            c->sent_at[c->seq % MAX_INFLIGHT] = now_us();
+            if(len != send(c->fd, buf, len, MSG_NOSIGNAL)) {
+                fprintf(stderr, "send() failed. %s\n", strerror(errno));
+                return EXIT_FAILURE;
+            }
+            ++c->seq;
+            ++c->inflight;
+            full = 0;
+            sent += every;
+            next += interval * every;
+        }
+
+        if(0 == interval)
+            timeout = 100;
+        else
+            timeout = next > now ? (int)((next - now + 999) / 1000) : 0;
+
+        n = poll(fds, nconns, timeout);
+        if(n < 0 && EINTR != errno)
+            break;
+
+        now = now_us();
+        for(i=0; n > 0 && i<nconns; ++i) {
+            if(0 == fds[i].revents)
+                continue;
+            if(!read_replies(&_conns[i], now)) {
+                fprintf(stderr, "Connection %d closed by service\n", i);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    secs = (now_us() - start) / 1e6;
+    printf("Connections:     %d\n", nconns);
+    printf("Duration:        %.2f s\n", secs);
+    printf("Commands sent:   %llu\n", (unsigned long long)sent);
+    printf("Acked:           %llu\n", (unsigned long long)_nlat * every);
+    if(0 != stalled)
+        printf("Stalled:         %llu batches (window full)\n", (unsigned long long)stalled);
+    printf("Throughput:      %.0f cmd/s\n", _nlat * every / secs);
+
+    if(0 != _nlat) {
+        qsort(_lat, _nlat, sizeof(*_lat), cmp_u32);
+        printf("Ack latency, us: min %u  p50 %u  p90 %u  p99 %u  p99.9 %u  max %u\n",
+            _lat[0], _lat[_nlat / 2], _lat[_nlat * 9 / 10], _lat[_nlat * 99 / 100],
+            _lat[_nlat * 999 / 1000], _lat[_nlat - 1]);
+    }
+
+    for(i=0; i<nconns; ++i)
+        close(_conns[i].fd);
+    free(_lat);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "record.h"
+
+
+/* Replays sessions recorded by lcdsrv (RecordDir option). Every session
+ * gets its own connection, all of them run concurrently and keep their
+ * offsets from the earliest one. Each recorded read is sent with a single
+ * send() at its original time divided by speed, so pipelining and burst
+ * structure of the traffic are kept. When session data
+ * is over, "SYNC" is sent and time until its reply is the drain time.
+ */
+
+
+#define MAX_SESSIONS    64
+#define SYNC_TOKEN      "lcdreplay"
+
+
+struct rec_t {
+    uint64_t at;                // Time from the earliest session start, us
+    uint32_t off;               // Offset of data in session buffer
+    uint32_t len;
+};
+
+
+struct session_t {
+    const char *name;
+    int fd;
+    uint64_t start;             // Wall clock time of accept, us
+    uint8_t *data;
+    rec_t *recs;
+    size_t nrecs;
+    size_t next;                // Next record to send
+    uint64_t sync_at;           // When SYNC was sent, 0 if not yet
+    uint64_t drain;             // SYNC reply latency, us
+    bool done;
+    char rbuf[256];
+    size_t rlen;
+};
+
+
+static const char _sync[] = "SYNC " SYNC_TOKEN "\r\n";
+static const char _optstr[] = "i:t:s:h";
+static const char _helpstr[] =
+"%s: replays sessions recorded by lcdsrv.\n"
+"Usage: %s <options> FILE...\n"
+"Options:\n"
+"   -i IP           Service address, default 127.0.0.1\n"
+"   -t PORT         Service port, default 6116\n"
+"   -s SPEED        Speed factor: 1 for real time, N for N times faster,\n"
+"                   0 for as fast as possible. Default 1\n"
+"   -h              Print this message and exit\n"
+;
+
+
+static session_t _sessions[MAX_SESSIONS];
+
+
+static uint64_t
+now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static bool
+get_uint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    int shift;
+
+    for(*v=0, shift=0; *p < end && shift < 64; shift+=7) {
+        *v |= (uint64_t)(**p & 0x7F) << shift;
+        if(0 == (*(*p)++ & 0x80))
+            return true;
+    }
+    return false;
+}
+
+
+/* Reads session file into memory and indexes its records
+ */
+static bool
+load_session(session_t *s, const char *name)
+{
+    const uint8_t *p, *end;
+    uint64_t delta, len, at;
+    size_t size, cap;
+    FILE *fp;
+    long fsize;
+
+    s->name = name;
+    fp = fopen(name, "rb");
+    if(NULL == fp) {
+        fprintf(stderr, "Cannot open %s. %s\n", name, strerror(errno));
+        return false;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    fsize = ftell(fp);
+    rewind(fp);
+
+    s->data = (uint8_t *)malloc(fsize > 0 ? fsize : 1);
+    size = (NULL == s->data) ? 0 : fread(s->data, 1, fsize, fp);
+    fclose(fp);
+
+    if(fsize < REC_MAGIC_LEN || size != (size_t)fsize || 0 != memcmp(s->data, REC_MAGIC, REC_MAGIC_LEN)) {
+        fprintf(stderr, "%s is not a session file of this version\n", name);
+        return false;
+    }
+
+    p = s->data + REC_MAGIC_LEN;
+    end = s->data + size;
+    if(!get_uint(&p, end, &s->start)) {
+        fprintf(stderr, "%s: no session start\n", name);
+        return false;
+    }
+    cap = 0;
+    at = 0;
+
+    while(p < end) {
+        if(!get_uint(&p, end, &delta) || !get_uint(&p, end, &len) || len > (uint64_t)(end - p)) {
+            fprintf(stderr, "%s: truncated record #%u, replaying preceding ones\n", name, (unsigned)s->nrecs);
+            break;
+        }
+
+        if(s->nrecs == cap) {
+            cap = cap ? cap * 2 : 256;
+            s->recs = (rec_t *)realloc(s->recs, cap * sizeof(rec_t));
+            if(NULL == s->recs) {
+                fprintf(stderr, "Out of memory\n");
+                return false;
+            }
+        }
+
+        at += delta;
+        s->recs[s->nrecs].at = at;
+        s->recs[s->nrecs].off = p - s->data;
+        s->recs[s->nrecs].len = len;
+        ++s->nrecs;
+        p += len;
+    }
+
+    return true;
+}
+
+
+static int
+connect_to(const char *ip, int port)
+{
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(0 == inet_aton(ip, &addr.sin_addr)) {
+        fprintf(stderr, "Invalid address '%s'\n", ip);
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(-1 == fd)
+        return -1;
+
+    if(-1 == connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        fprintf(stderr, "Cannot connect to %s:%d. %s\n", ip, port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+
+/* Reads and drops service replies, looking for the final SYNC one
+ */
+static bool
+read_replies(session_t *s, uint64_t now)
+{
+    char *p, *eol;
+    ssize_t nb;
+
+    nb = read(s->fd, s->rbuf + s->rlen, sizeof(s->rbuf) - s->rlen - 1);
+    if(nb <= 0)
+        return false;
+
+    s->rlen += nb;
+    s->rbuf[s->rlen] = '\0';
+
+    for(p=s->rbuf; NULL != (eol = strchr(p, '\n')); p=eol+1) {
+        if(0 != s->sync_at && 0 == strncmp(p, "OK " SYNC_TOKEN "\r\n", eol + 1 - p)) {
+            s->drain = now - s->sync_at;
+            s->done = true;
+        }
+    }
+
+    s->rlen -= p - s->rbuf;
+    memmove(s->rbuf, p, s->rlen);
+    if(sizeof(s->rbuf) - 1 == s->rlen)
+        s->rlen = 0;
+    return true;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    const char *ip = "127.0.0.1";
+    int port = 6116, nsess, active, i, n, timeout;
+    double speed = 1;
+    struct pollfd fds[MAX_SESSIONS];
+    uint64_t start, now, due, next, first = UINT64_MAX, bytes = 0, span = 0, maxdrain = 0;
+    size_t recs = 0;
+    session_t *s;
+    rec_t *r;
+    double secs;
+
+    while(-1 != (n = getopt(argc, argv, _optstr))) {
+        switch(n) {
+            case 'i': ip = optarg; break;
+            case 't': port = atoi(optarg); break;
+            case 's': speed = atof(optarg); break;
+            default:
+                fprintf(stdout, _helpstr, argv[0], argv[0]);
+                return EXIT_SUCCESS;
+        }
+    }
+
+    nsess = argc - optind;
+    if(nsess < 1 || nsess > MAX_SESSIONS || speed < 0) {
+        fprintf(stderr, "Give 1..%d session files and non-negative speed\n", MAX_SESSIONS);
+        return EXIT_FAILURE;
+    }
+
+    for(i=0; i<nsess; ++i) {
+        s = &_sessions[i];
+        if(!load_session(s, argv[optind + i]))
+            return EXIT_FAILURE;
+        if(s->start < first)
+            first = s->start;
+    }
+
+    /* Sessions which connected later during recording start later */
+    for(i=0; i<nsess; ++i) {
+        s = &_sessions[i];
+        for(n=0; n<(int)s->nrecs; ++n) {
+            s->recs[n].at += s->start - first;
+            bytes += s->recs[n].len;
+        }
+        recs += s->nrecs;
+        if(0 != s->nrecs && s->recs[s->nrecs - 1].at > span)
+            span = s->recs[s->nrecs - 1].at;
+
+        s->fd = connect_to(ip, port);
+        if(-1 == s->fd)
+            return EXIT_FAILURE;
+        fds[i].fd = s->fd;
+        fds[i].events = POLLIN;
+    }
+
+    start = now_us();
+    for(active=nsess; active > 0; ) {
+        /* Send everything which is due, find when the next record is
+         */
+        now = now_us();
+        next = UINT64_MAX;
+        for(i=0; i<nsess; ++i) {
+            s = &_sessions[i];
+            for(; s->next < s->nrecs; ++s->next) {
+                r = &s->recs[s->next];
+                due = start + (0 == speed ? 0 : (uint64_t)(r->at / speed));
+                if(due > now) {
+                    if(due < next)
+                        next = due;
+                    break;
+                }
+                if((ssize_t)r->len != send(s->fd, s->data + r->off, r->len, MSG_NOSIGNAL)) {
+                    fprintf(stderr, "%s: send() failed. %s\n", s->name, strerror(errno));
+                    return EXIT_FAILURE;
+                }
+            }
+
+            if(s->next == s->nrecs && 0 == s->sync_at) {
+                s->sync_at = now_us();
+                send(s->fd, _sync, sizeof(_sync) - 1, MSG_NOSIGNAL);
+            }
+        }
+
+        now = now_us();
+        timeout = (UINT64_MAX == next) ? 1000 : (next > now ? (int)((next - now + 999) / 1000) : 0);
+        n = poll(fds, nsess, timeout);
+        if(n < 0 && EINTR != errno)
+            break;
+
+        now = now_us();
+        for(i=0; n > 0 && i<nsess; ++i) {
+            s = &_sessions[i];
+            if(0 == fds[i].revents)
+                continue;
+            if(!read_replies(s, now)) {
+                fprintf(stderr, "%s: connection closed by service\n", s->name);
+                return EXIT_FAILURE;
+            }
+            if(s->done) {
+                fds[i].fd = -1;
+                --active;
+                if(s->drain > maxdrain)
+                    maxdrain = s->drain;
+            }
+        }
+    }
+
+    secs = (now_us() - start) / 1e6;
+    printf("Sessions:        %d\n", nsess);
+    printf("Records:         %u (%llu bytes)\n", (unsigned)recs, (unsigned long long)bytes);
+    printf("Recorded span:   %.3f s\n", span / 1e6);
+    printf("Replay time:     %.3f s (x%.1f)\n", secs, 0 == secs ? 0 : span / 1e6 / secs);
+    printf("Throughput:      %.0f bytes/s\n", bytes / secs);
+    printf("Max drain time:  %.3f ms\n", maxdrain / 1e3);
+
+    for(i=0; i<nsess; ++i) {
+        close(_sessions[i].fd);
+        free(_sessions[i].data);
+        free(_sessions[i].recs);
+    }
+    return EXIT_SUCCESS;
+}
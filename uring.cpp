@@ -0,0 +1,331 @@
+#include "config.h"
+#include "common.h"
+#include "logging.h"
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+
+/* io_uring needs kernel 5.19 or newer here: provided buffer rings and
+ * multishot accept appeared there. uring_init() fails on older kernels,
+ * and the service uses poll() then
+ */
+
+
+static int
+sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int
+sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+
+static int
+sys_register(int fd, unsigned op, void *arg, unsigned nargs)
+{
+    return syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+
+/* Adds buffer bid to the tail of provided buffer ring. Kernel sees it once
+ * the tail is published
+ */
+static void
+add_buf(uring_t *r, uint16_t bid)
+{
+    struct io_uring_buf *b;
+
+    /* Not br->bufs: in C++ the flexible array member is preceded by an
+     * empty struct, which is not empty there and shifts the array
+     */
+    b = (struct io_uring_buf *)r->br + (r->br_tail & (r->nbufs - 1));
+
+    b->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * r->buf_size);
+    b->len = r->buf_size;
+    b->bid = bid;
+    ++r->br_tail;
+}
+
+
+static int
+init_bufs(uring_t *r)
+{
+    struct io_uring_buf_reg reg;
+    unsigned i;
+
+    r->br_len = r->nbufs * sizeof(struct io_uring_buf);
+    r->br = (struct io_uring_buf_ring *)mmap(NULL, r->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(MAP_FAILED == r->br) {
+        r->br = NULL;
+        return -1;
+    }
+
+    r->bufs = (uint8_t *)malloc((size_t)r->nbufs * r->buf_size);
+    if(NULL == r->bufs)
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)r->br;
+    reg.ring_entries = r->nbufs;
+    reg.bgid = 0;
+    if(-1 == sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+        return -1;
+
+    for(i=0; i<r->nbufs; ++i)
+        add_buf(r, i);
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+/* Creates ring with given number of submission entries and nbufs (power of
+ * 2) receive buffers of buf_size bytes. Returns false if io_uring or one of
+ * features used is not supported, errno is set then
+ */
+bool
+uring_init(uring_t *r, unsigned entries, unsigned nbufs, unsigned buf_size)
+{
+    struct io_uring_params p;
+    uint8_t *ring;
+    size_t cq_len;
+    int err;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    r->nbufs = nbufs;
+    r->buf_size = buf_size;
+
+    r->fd = sys_setup(entries, &p);
+    if(-1 == r->fd)
+        return false;
+
+    if(0 == (p.features & IORING_FEAT_EXT_ARG) || 0 == (p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(r->fd);
+        r->fd = -1;
+        errno = ENOTSUP;
+        return false;
+    }
+
+    /* Submission and completion rings share one mapping, entries array is
+     * separate
+     */
+    r->ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(cq_len > r->ring_len)
+        r->ring_len = cq_len;
+
+    r->ring_ptr = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(MAP_FAILED == r->ring_ptr || MAP_FAILED == r->sqes) {
+        err = errno;
+        if(MAP_FAILED == r->ring_ptr)
+            r->ring_ptr = NULL;
+        if(MAP_FAILED == r->sqes)
+            r->sqes = NULL;
+        uring_exit(r);
+        errno = err;
+        return false;
+    }
+
+    ring = (uint8_t *)r->ring_ptr;
+    r->sq_head = (unsigned *)(ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    r->sq_array = (unsigned *)(ring + p.sq_off.array);
+    r->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sqe_head = r->sqe_tail = *r->sq_tail;
+
+    r->cq_head = (unsigned *)(ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    if(-1 == init_bufs(r)) {
+        err = errno;
+        uring_exit(r);
+        errno = err;
+        return false;
+    }
+
+    return true;
+}
+
+
+void
+uring_exit(uring_t *r)
+{
+    if(NULL != r->sqes)
+        munmap(r->sqes, r->sqes_len);
+    if(NULL != r->ring_ptr)
+        munmap(r->ring_ptr, r->ring_len);
+    if(NULL != r->br)
+        munmap(r->br, r->br_len);
+    free(r->bufs);
+    if(-1 != r->fd)
+        close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+
+/* Submits all prepared requests with a single system call and waits for
+ * at least one completion, or until timeout (ms, -1 for none) expires.
+ * Returns -1 on error
+ */
+int
+uring_wait(uring_t *r, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned submit, wait;
+    int res;
+
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    submit = r->sqe_tail - r->sqe_head;
+    wait = (NULL == uring_peek(r)) ? 1 : 0;
+
+    memset(&arg, 0, sizeof(arg));
+    if(timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    res = sys_enter(r->fd, submit, wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if(res >= 0) {
+        r->sqe_head += res;
+        return 0;
+    }
+    if(ETIME == errno || EINTR == errno || EBUSY == errno)
+        return 0;
+    return -1;
+}
+
+
+static struct io_uring_sqe *
+get_sqe(uring_t *r, uint8_t opcode, int fd, uint64_t tag)
+{
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+    int res;
+
+    /* Ring is full: hand over what is there without waiting */
+    if(r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+        res = sys_enter(r->fd, r->sqe_tail - r->sqe_head, 0, 0, NULL, 0);
+        if(res > 0)
+            r->sqe_head += res;
+    }
+
+    idx = r->sqe_tail & r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = tag;
+    r->sq_array[idx] = idx;
+    ++r->sqe_tail;
+    return sqe;
+}
+
+
+/* Returns next completion or NULL if there is none
+ */
+struct io_uring_cqe *
+uring_peek(uring_t *r)
+{
+    unsigned head = *r->cq_head;
+
+    if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+
+void
+uring_seen(uring_t *r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Returns data of receive completion, NULL if it has no buffer
+ */
+uint8_t *
+uring_buf(uring_t *r, const struct io_uring_cqe *cqe)
+{
+    if(0 == (cqe->flags & IORING_CQE_F_BUFFER))
+        return NULL;
+    return r->bufs + (size_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) * r->buf_size;
+}
+
+
+/* Gives buffer of receive completion back to kernel
+ */
+void
+uring_recycle(uring_t *r, const struct io_uring_cqe *cqe)
+{
+    if(0 == (cqe->flags & IORING_CQE_F_BUFFER))
+        return;
+    add_buf(r, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+
+/* Multishot accept: one completion per connection, new socket in res
+ */
+void
+uring_accept(uring_t *r, int fd, uint64_t tag)
+{
+    struct io_uring_sqe *sqe = get_sqe(r, IORING_OP_ACCEPT, fd, tag);
+
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+
+/* Multishot poll for input
+ */
+void
+uring_poll(uring_t *r, int fd, uint64_t tag)
+{
+    struct io_uring_sqe *sqe = get_sqe(r, IORING_OP_POLL_ADD, fd, tag);
+
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+
+/* Receives up to len bytes into a buffer picked from provided buffer ring
+ */
+void
+uring_recv(uring_t *r, int fd, unsigned len, uint64_t tag)
+{
+    struct io_uring_sqe *sqe = get_sqe(r, IORING_OP_RECV, fd, tag);
+
+    sqe->len = len < r->buf_size ? len : r->buf_size;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+}
+
+
+/* Cancels request(s) submitted with given tag
+ */
+void
+uring_cancel(uring_t *r, uint64_t tag)
+{
+    struct io_uring_sqe *sqe = get_sqe(r, IORING_OP_ASYNC_CANCEL, -1, 0);
+
+    sqe->addr = tag;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+}
+#endif // HAVE_IO_URING
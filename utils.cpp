@@ -1,4 +1,8 @@
+#include "config.h"
 #include "common.h"
+#include "logging.h"
+#include <time.h>
+#include <sys/mman.h>
 
 
 char *
@@ -39,3 +43,54 @@ get_bool(const char *arg, int *res)
     return false;
 }
 
+
+
+/* Monotonic time in milliseconds
+ */
+uint64_t
+now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* Returns monotonic time in microseconds
+ */
+uint64_t
+now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* Maps file into memory for reading and writing, creating it or changing
+ * its size if necessary. Returns NULL on error
+ */
+void *
+map_file(const char *name, size_t size)
+{
+    struct stat st;
+    void *mem = MAP_FAILED;
+    int fd;
+
+    fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(-1 == fd || -1 == fstat(fd, &st)) {
+        ERR("Cannot open %s. %s", name, strerror(errno));
+    } else if((size_t)st.st_size != size && -1 == ftruncate(fd, size)) {
+        ERR("Cannot resize %s. %s", name, strerror(errno));
+    } else {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(MAP_FAILED == mem)
+            ERR("Cannot map %s. %s", name, strerror(errno));
+    }
+
+    if(-1 != fd)
+        close(fd);
+    return (MAP_FAILED == mem) ? NULL : mem;
+}
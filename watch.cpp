@@ -0,0 +1,371 @@
+#include "config.h"
+#include "common.h"
+#include "logging.h"
+#include "watch.h"
+#include "winstar_lcd.h"
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+
+
+/* Display regions bound to local sources. A regular file is shown line by
+ * line and redrawn whenever it is closed after writing or replaced by
+ * rename; its directory is watched, so atomic replacement is noticed too.
+ * Lines written into a FIFO scroll up through the region, the newest one
+ * at the bottom. Redrawn cells go through the display shadow copy, so
+ * unchanged content costs nothing.
+ *
+ * inotify descriptor and all FIFOs are gathered in one epoll set, so the
+ * event loop polls a single descriptor whatever the number of watches.
+ */
+
+
+#define INOTIFY_KEY     MAX_WATCHES     // epoll key of inotify descriptor
+
+
+struct watch_t {
+    int used;
+    char id[JOB_ID_LEN];
+    WinStarLCD *lcd;
+    uint8_t row;
+    uint8_t col;
+    uint8_t w;
+    uint8_t h;
+    int fd;                     // FIFO read end, -1 for regular file
+    int wfd;                    // FIFO write end, keeps it from EOF between writers
+    int wd;                     // inotify watch of file directory
+    char path[PATH_MAX];
+    const char *name;           // File name part of path
+    char buf[MAX_BUF_SIZE+1];   // Incomplete FIFO line
+    size_t len;
+};
+
+
+static watch_t _watches[MAX_WATCHES];
+static int _epfd = -1;
+static int _infd = -1;
+static char *_dir;
+
+
+/* Prints UTF-8 line into region row, padded with spaces
+ */
+static void
+show_line(watch_t *wt, uint8_t r, const char *text, size_t len)
+{
+    uint8_t codes[LCD_MAX_COLS];
+    size_t n;
+
+    n = wt->lcd->encode(text, len, codes, wt->w);
+    memset(&codes[n], ' ', wt->w - n);
+    wt->lcd->writeCells(wt->row + r, wt->col, codes, wt->w);
+}
+
+
+/* Shows first lines of the file. Missing file leaves region blank
+ */
+static void
+show_file(watch_t *wt)
+{
+    char data[WATCH_FILE_SIZE];
+    const char *p, *eol, *end;
+    ssize_t n;
+    uint8_t r;
+    int fd;
+
+    n = 0;
+    fd = open(wt->path, O_RDONLY | O_CLOEXEC);
+    if(-1 != fd) {
+        n = read(fd, data, sizeof(data));
+        close(fd);
+        if(n < 0)
+            n = 0;
+    }
+
+    end = data + n;
+    wt->lcd->claim();
+    for(r=0, p=data; r<wt->h; ++r) {
+        eol = (const char *)memchr(p, '\n', end - p);
+        if(NULL == eol)
+            eol = end;
+        show_line(wt, r, p, (eol > p && '\r' == eol[-1]) ? eol - p - 1 : eol - p);
+        p = (eol < end) ? eol + 1 : end;
+    }
+}
+
+
+/* Shows line received from FIFO in the last row of the region, moving
+ * the rows above it one up
+ */
+static void
+show_fifo_line(watch_t *wt, const char *text, size_t len)
+{
+    uint8_t codes[LCD_MAX_COLS];
+    uint8_t r;
+
+    wt->lcd->claim();
+    for(r=1; r<wt->h; ++r) {
+        wt->lcd->readCells(wt->row + r, wt->col, codes, wt->w);
+        wt->lcd->writeCells(wt->row + r - 1, wt->col, codes, wt->w);
+    }
+
+    show_line(wt, wt->h - 1, text, (0 != len && '\r' == text[len-1]) ? len - 1 : len);
+}
+
+
+/* Reads everything FIFO has and shows complete lines
+ */
+static void
+read_fifo(watch_t *wt)
+{
+    char *p, *eol;
+    ssize_t n;
+
+    for(;;) {
+        n = read(wt->fd, wt->buf + wt->len, MAX_BUF_SIZE - wt->len);
+        if(n <= 0)
+            break;
+
+        wt->len += n;
+        for(p=wt->buf; NULL != (eol = (char *)memchr(p, '\n', wt->buf + wt->len - p)); p=eol+1)
+            show_fifo_line(wt, p, eol - p);
+
+        wt->len -= p - wt->buf;
+        memmove(wt->buf, p, wt->len);
+
+        /* Line does not fit into the buffer: show what is there */
+        if(MAX_BUF_SIZE == wt->len) {
+            show_fifo_line(wt, wt->buf, wt->len);
+            wt->len = 0;
+        }
+    }
+
+    if(0 == n || (-1 == n && EAGAIN != errno && EINTR != errno))
+        WARN_RL("Watch '%s': read from %s failed", wt->id, wt->path);
+}
+
+
+static void
+read_inotify()
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+    int i;
+
+    while((n = read(_infd, buf, sizeof(buf))) > 0) {
+        for(p=buf; p < buf + n; p+=sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if(0 == ev->len)
+                continue;
+
+            for(i=0; i<MAX_WATCHES; ++i)
+                if(_watches[i].used && -1 == _watches[i].fd && _watches[i].wd == ev->wd
+                        && 0 == strcmp(_watches[i].name, ev->name))
+                    show_file(&_watches[i]);
+        }
+    }
+}
+
+
+static void
+drop_watch(watch_t *wt)
+{
+    int i;
+
+    if(-1 != wt->fd) {
+        epoll_ctl(_epfd, EPOLL_CTL_DEL, wt->fd, NULL);
+        close(wt->fd);
+        close(wt->wfd);
+    } else {
+        /* Directory watch is shared by files in the same directory */
+        for(i=0; i<MAX_WATCHES; ++i)
+            if(&_watches[i] != wt && _watches[i].used && -1 == _watches[i].fd && _watches[i].wd == wt->wd)
+                break;
+        if(MAX_WATCHES == i)
+            inotify_rm_watch(_infd, wt->wd);
+    }
+
+    wt->used = 0;
+}
+
+
+/* Creates epoll set of watches. Returns its descriptor, which becomes
+ * readable when some source has data, or -1 on error
+ */
+int
+watch_init()
+{
+    struct epoll_event ev;
+
+    _epfd = epoll_create1(EPOLL_CLOEXEC);
+    _infd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(-1 == _epfd || -1 == _infd) {
+        ERR("Cannot watch files: %s", strerror(errno));
+        watch_exit();
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = INOTIFY_KEY;
+    epoll_ctl(_epfd, EPOLL_CTL_ADD, _infd, &ev);
+    return _epfd;
+}
+
+
+void
+watch_exit()
+{
+    int i;
+
+    for(i=0; i<MAX_WATCHES; ++i)
+        if(_watches[i].used)
+            drop_watch(&_watches[i]);
+
+    if(-1 != _infd)
+        close(_infd);
+    if(-1 != _epfd)
+        close(_epfd);
+    _infd = _epfd = -1;
+}
+
+
+/* Sets directory WATCH paths are relative to, NULL disables WATCH.
+ * Existing watches are kept
+ */
+void
+watch_set_dir(const char *dir)
+{
+    free(_dir);
+    _dir = (NULL == dir) ? NULL : strdup(dir);
+}
+
+
+/* Handles sources which have data. Called when descriptor returned by
+ * watch_init() is readable
+ */
+void
+watch_run()
+{
+    struct epoll_event evs[MAX_WATCHES + 1];
+    int i, n;
+
+    n = epoll_wait(_epfd, evs, COUNTOF(evs), 0);
+    for(i=0; i<n; ++i) {
+        if(INOTIFY_KEY == evs[i].data.u32)
+            read_inotify();
+        else if(_watches[evs[i].data.u32].used)
+            read_fifo(&_watches[evs[i].data.u32]);
+    }
+}
+
+
+/* Binds region to file or FIFO name under watch directory. Watch with the
+ * same id is replaced. File contents are shown at once
+ */
+bool
+watch_add(WinStarLCD *lcd, const char *id, uint8_t row, uint8_t col, uint8_t w, uint8_t h, const char *name)
+{
+    struct epoll_event ev;
+    struct stat st;
+    watch_t *wt, *slot;
+    char *sep;
+    int i;
+
+    if(NULL == _dir || -1 == _epfd) {
+        WARN_RL("WATCH: disabled, WatchDir is not set");
+        return false;
+    }
+
+    if(strlen(id) >= JOB_ID_LEN || '\0' == *name || '/' == *name || NULL != strstr(name, "..")
+            || row >= lcd->rows() || col >= lcd->cols() || 0 == w || 0 == h)
+        return false;
+
+    if(w > lcd->cols() - col)
+        w = lcd->cols() - col;
+    if(h > lcd->rows() - row)
+        h = lcd->rows() - row;
+
+    watch_remove(id);
+    for(i=0, slot=NULL; i<MAX_WATCHES && NULL == slot; ++i)
+        if(!_watches[i].used)
+            slot = &_watches[i];
+    if(NULL == slot) {
+        WARN_RL("WATCH: too many watches");
+        return false;
+    }
+
+    wt = slot;
+    memset(wt, 0, sizeof(*wt));
+    strcpy(wt->id, id);
+    wt->lcd = lcd;
+    wt->row = row;
+    wt->col = col;
+    wt->w = w;
+    wt->h = h;
+    wt->fd = wt->wfd = wt->wd = -1;
+    snprintf(wt->path, sizeof(wt->path), "%s/%s", _dir, name);
+
+    if(0 == stat(wt->path, &st) && S_ISFIFO(st.st_mode)) {
+        /* Own write end is opened after the read one, so neither blocks */
+        wt->fd = open(wt->path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        wt->wfd = (-1 == wt->fd) ? -1 : open(wt->path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if(-1 == wt->wfd) {
+            WARN_RL("WATCH: cannot open FIFO %s. %s", wt->path, strerror(errno));
+            if(-1 != wt->fd)
+                close(wt->fd);
+            return false;
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = wt - _watches;
+        epoll_ctl(_epfd, EPOLL_CTL_ADD, wt->fd, &ev);
+    } else {
+        sep = strrchr(wt->path, '/');
+        *sep = '\0';
+        wt->wd = inotify_add_watch(_infd, wt->path, IN_CLOSE_WRITE | IN_MOVED_TO);
+        *sep = '/';
+        if(-1 == wt->wd) {
+            WARN_RL("WATCH: cannot watch %s. %s", wt->path, strerror(errno));
+            return false;
+        }
+        wt->name = sep + 1;
+        show_file(wt);
+    }
+
+    wt->used = 1;
+    DBG("Watch '%s': %s %s", id, -1 == wt->fd ? "file" : "FIFO", wt->path);
+    return true;
+}
+
+
+/* Unbinds region. Its contents are left on screen
+ */
+bool
+watch_remove(const char *id)
+{
+    int i;
+
+    for(i=0; i<MAX_WATCHES; ++i)
+        if(_watches[i].used && 0 == strcmp(_watches[i].id, id)) {
+            drop_watch(&_watches[i]);
+            return true;
+        }
+
+    return false;
+}
+
+
+/* Unbinds all regions of the display, which is going away
+ */
+void
+watch_drop(WinStarLCD *lcd)
+{
+    int i;
+
+    for(i=0; i<MAX_WATCHES; ++i)
+        if(_watches[i].used && _watches[i].lcd == lcd)
+            drop_watch(&_watches[i]);
+}
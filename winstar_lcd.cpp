@@ -1,39 +1,41 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "winstar_lcd.h"
-
-
-static uint8_t _cp1251_chr_map[256] =
-{
-    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
-    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F,
-    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
-    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
-    0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
-    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F,
-    0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6F,
-    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x7B, 0x7C, 0x7D, 0x7E, 0x7F,
-    0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A, 0x8B, 0x8C, 0x8D, 0x8E, 0x8F,
-    0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0x9B, 0x9C, 0x9D, 0x9E, 0x9F,
-    0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xAB, 0xAC, 0xAD, 0xAE, 0xAF,
-    0xB0, 0xB1, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xBB, 0xBC, 0xBD, 0xBE, 0xBF,
-    0xC0, 0xC1, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xCB, 0xCC, 0xCD, 0xCE, 0xCF, // 'A'
-    0xD0, 0xD1, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xDB, 0xDC, 0xDD, 0xDE, 0xDF, // 'Р'
-    0xE0, 0xE1, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xEB, 0xEC, 0xED, 0xEE, 0xEF,
-    0xF0, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF,
-};
+#include "lcd_charset.h"
 
 
 /*! \brief Constructor.
  * Constructs LCD object. The object then must be initialized by \c init() method call
  */
-WinStarLCD::WinStarLCD(): _bufp(0), _mode(M_COMMAND|M_WRITE), _dev_addr(0x20), _i2c()
+WinStarLCD::WinStarLCD(): _bufp(0), _burst(LCD_MAX_BURST), _own_io(false), _mode(M_COMMAND|M_WRITE), _nouts(0), _mask(0xFF),
+    _ac(0), _ac_cgram(0), _ac_known(false), _disp_ctl(0xFF), _entry(0xFF), _func(0xFF), _shift(0),
+    _page_offs(0), _frame(false), _skipped(0), _recovered(0),
+    _scrub_pos(0), _scrub_cells(0), _scrub_fixed(0), _charset(lcd_find_charset(NULL)), _dirty(false),
+    _glyphs(0), _full_glyph(-1), _gdef_cnt(0), _cg_cache(0), _cg_clock(0), _hook(NULL), _hook_ctx(NULL), _rx(0),
+    _writer_on(false), _lock_memory(false), _nlanes(0), _ring_head(0), _drain_wait(0)
 {
+    _buf[0] = GPIO;
+    _own.io = NULL;
+    _own.addr = LCD_DEFAULT_ADDR;
+    _own.bus[0] = '\0';
+    _own.owner = NULL;
+    _own.failed = 0;
+    _own.retry_at = 0;
+    memset(_bars, 0, sizeof(_bars));
+    memset(_ddram, ' ', sizeof(_ddram));
+    memset(_stale, 0, sizeof(_stale));
+    memset(_cgram, 0, sizeof(_cgram));
+    setGeometry(16, 2);
 }
 
 
 WinStarLCD::~WinStarLCD()
 {
+    stopWriter();
+    if(_own_io)
+        delete _own.io;
 }
 
 
@@ -43,9 +45,9 @@ WinStarLCD::~WinStarLCD()
 inline void
 WinStarLCD::i2c_out(uint8_t v)
 {
-    if(I2C_MAX_BURST_LEN == _bufp)
+    if(_burst == _bufp)
         flush();
-    _buf[_bufp++] = v;
+    _buf[1 + _bufp++] = v;
 }
 
 
@@ -67,18 +69,32 @@ WinStarLCD::rawdata(uint8_t v)
  * increment.
  * Then, it issues "magic" display initialization sequence, which puts it into
  * 4-bit mode, clears display, hides cursor and moves cursor into home position
+ * \retval false if some port extender did not respond. It is marked failed
  */
-void
-WinStarLCD::_do_init()
+bool
+WinStarLCD::_do_sync()
 {
-    /* Set all lines as output */
-    _i2c.W1b(_dev_addr, WinStarLCD::DIR, 0x00);
+    lcd_output *o;
+    bool ok;
+    int i;
+
+    for(i=0, ok=true; i<_nouts; ++i) {
+        if(0 == (_mask & (1 << i)))
+            continue;
 
-    /* Enable pullup on all lines */
-    _i2c.W1b(_dev_addr, WinStarLCD::PULLUP, 0xFF);
+        o = _outs[i];
+        o->owner = this;
 
-    /* Disable address increment on burst writes */
-    _i2c.W1b(_dev_addr, WinStarLCD::IOCON, 0x20);
+        /* Set all lines as output, enable pullup on all lines, and disable
+         * address increment on burst writes
+         */
+        if(o->io->write1(o->addr, WinStarLCD::DIR, 0x00) < 0
+                || o->io->write1(o->addr, WinStarLCD::PULLUP, 0xFF) < 0
+                || o->io->write1(o->addr, WinStarLCD::IOCON, 0x20) < 0) {
+            __atomic_store_n(&o->failed, 1, __ATOMIC_RELEASE);
+            ok = false;
+        }
+    }
 
     /* Now issue "magic" display init sequence: put it in 4-bit mode */
     rawdata(0x18);
@@ -87,8 +103,24 @@ WinStarLCD::_do_init()
     rawdata(0x10);
     flush();
 
+    /* Nothing is known about controller registers until they are set */
+    _ac_known = false;
+    _disp_ctl = _entry = _func = 0xFF;
+    _shift = 0;
+    _page_offs = 0;
+    _frame = false;
+    return ok;
+}
+
+
+void
+WinStarLCD::_do_init()
+{
+    _do_sync();
+
     /* Clear display and set operation options */
     command(0x0C);
+    command(0x06);
     clear();
     home();
 
@@ -96,52 +128,652 @@ WinStarLCD::_do_init()
 }
 
 
+/*! \brief Brings controller back to the state saved in snapshot without
+ * clearing it. The 4-bit init sequence above also resynchronizes nibble
+ * order, and leaves display memory intact. Used glyphs and visible cells
+ * are then rewritten, so the panel keeps showing the same picture even if
+ * the controller lost it
+ */
+void
+WinStarLCD::_do_resume(const state_t *st)
+{
+    uint8_t r, c, p;
+
+    _do_sync();
+
+    memcpy(_ddram, st->ddram, sizeof(_ddram));
+    memcpy(_cgram, st->cgram, sizeof(_cgram));
+    _glyphs = st->glyphs;
+    _full_glyph = st->full_glyph;
+    _gdef_cnt = st->gdef_cnt;
+    _cg_cache = st->cg_cache;
+    memcpy(_bars, st->bars, sizeof(_bars));
+    memcpy(_gdefs, st->gdefs, sizeof(_gdefs));
+    memcpy(_cg_ucs, st->cg_ucs, sizeof(_cg_ucs));
+    memcpy(_cg_stamp, st->cg_stamp, sizeof(_cg_stamp));
+    _cg_clock = st->cg_clock;
+
+    command(0x08 == (st->disp_ctl & 0xF8) ? st->disp_ctl : 0x0C);
+    command(0x04 == (st->entry & 0xFC) ? st->entry : 0x06);
+    loadGlyphs();
+
+    /* Hidden frame page is rewritten too: the next frame is drawn there
+     * as a difference against the shadow copy
+     */
+    for(p=0; p < (framesSupported() ? 2 : 1); ++p) {
+        _page_offs = p * LCD_PAGE_COLS;
+        for(r=0; r<_rows; ++r) {
+            setAddr(cellAddr(r, 0));
+            for(c=0; c<_cols; ++c)
+                data(st->ddram[cellAddr(r, c)]);
+        }
+    }
+
+    scrollTo(st->shift % LCD_MAX_COLS);
+    _page_offs = (framesSupported() && LCD_PAGE_COLS == _shift) ? LCD_PAGE_COLS : 0;
+
+    command((st->ac_cgram ? 0x40 : 0x80) | st->ac);
+    flush();
+}
+
+
+/*! \brief Loads glyphs in use from the shadow copy into CGRAM of the panels
+ */
+void
+WinStarLCD::loadGlyphs()
+{
+    uint8_t i, c;
+
+    for(i=0; i<LCD_CGRAM_SIZE; ++i) {
+        if(0 == ((_glyphs | _cg_cache) & (1 << i)))
+            continue;
+        command(0x40 | (i << 3));
+        for(c=0; c<8; ++c)
+            data(_cgram[i * 8 + c]);
+    }
+}
+
+
+/*! \brief Forgets what the panels show, after some of them were drawn by
+ * another object. Display shift is returned home, registers and glyphs
+ * are written again, and every cell is sent by the next write to it even
+ * if the shadow copy has the same character
+ */
+void
+WinStarLCD::forget()
+{
+    uint8_t ctl = _disp_ctl, entry = _entry;
+
+    _ac_known = false;
+    _disp_ctl = _entry = _func = 0xFF;
+    _frame = false;
+
+    flush();
+    command(0x02);
+    flush();
+
+    command(0x08 == (ctl & 0xF8) ? ctl : 0x0C);
+    command(0x04 == (entry & 0xFC) ? entry : 0x06);
+    loadGlyphs();
+    flush();
+
+    memset(_stale, 0xFF, sizeof(_stale));
+}
+
+
+/*! \brief Takes over the panels before drawing. When some of them were
+ * last drawn by another object (display group or its member), everything
+ * that object has queued is sent first, and this object forgets what the
+ * panels show. Does nothing for an object used alone
+ */
+void
+WinStarLCD::claim()
+{
+    lcd_output *o;
+    bool lost;
+    int i;
+
+    for(i=0, lost=false; i<_nouts; ++i) {
+        o = _outs[i];
+        if(o->owner == this)
+            continue;
+        if(NULL != o->owner)
+            o->owner->drain();
+        o->owner = this;
+        lost = true;
+    }
+
+    if(lost)
+        forget();
+}
+
+
+/*! \brief Brings back panels whose I2C transfers failed. Failed panel gets
+ * nothing until then, so the caller never waits for a broken bus. Once the
+ * retry interval passes, the panel is initialized again and the whole
+ * picture is rewritten from the shadow copy in one burst, like on warm
+ * restart. Interval starts at \c LCD_RETRY_MIN_MS and doubles after every
+ * failed attempt, up to \c LCD_RETRY_MAX_MS. Only panels this object drew
+ * last are handled. Call it periodically, when nothing is being drawn
+ * \retval -1 if all panels work
+ * \retval ms until the next attempt otherwise
+ */
+int
+WinStarLCD::recover()
+{
+    struct timespec ts;
+    lcd_output *o;
+    state_t st;
+    uint64_t now;
+    uint8_t mask;
+    bool writer, dirty;
+    int i, next;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    for(i=0, mask=0; i<_nouts; ++i) {
+        o = _outs[i];
+        if(o->owner != this || !__atomic_load_n(&o->failed, __ATOMIC_ACQUIRE))
+            continue;
+
+        if(0 == o->retry_at) {
+            o->backoff = LCD_RETRY_MIN_MS;
+            o->retry_at = now + o->backoff;
+        } else if(now >= o->retry_at && !_frame) {
+            mask |= 1 << i;
+        }
+    }
+
+    if(0 != mask) {
+        /* Writer threads are idle after drain(), so the failed panels are
+         * written from here, without disturbing the others
+         */
+        drain();
+        writer = _writer_on;
+        _writer_on = false;
+        _mask = mask;
+        for(i=0; i<_nouts; ++i)
+            if(0 != (mask & (1 << i)))
+                __atomic_store_n(&_outs[i]->failed, 0, __ATOMIC_RELEASE);
+
+        dirty = _dirty;
+        memset(&st, 0, sizeof(st));
+        saveState(&st);
+        _do_resume(&st);
+        _dirty = dirty;
+
+        _mask = 0xFF;
+        _writer_on = writer;
+
+        for(i=0; i<_nouts; ++i) {
+            if(0 == (mask & (1 << i)))
+                continue;
+            o = _outs[i];
+            if(__atomic_load_n(&o->failed, __ATOMIC_ACQUIRE)) {
+                o->backoff = (o->backoff * 2 > LCD_RETRY_MAX_MS) ? LCD_RETRY_MAX_MS : o->backoff * 2;
+                o->retry_at = now + o->backoff;
+            } else {
+                o->retry_at = 0;
+                ++_recovered;
+            }
+        }
+    }
+
+    for(i=0, next=-1; i<_nouts; ++i) {
+        o = _outs[i];
+        if(o->owner != this || 0 == o->retry_at)
+            continue;
+        if(o->retry_at <= now)
+            return _frame ? LCD_RETRY_MIN_MS : 0; // Frame is drawn, wait for its end
+        if(-1 == next || o->retry_at - now < (uint64_t)next)
+            next = o->retry_at - now;
+    }
+
+    return next;
+}
+
+
+/*! \brief Reads character at controller address counter, which was set
+ * beforehand. Data lines of the port extender are switched to input for
+ * the time of reading, and back to output whatever the result
+ * \param[in] o Panel to read
+ * \param[out] v Character code
+ * \retval false if some transfer failed
+ */
+bool
+WinStarLCD::readCell(lcd_output *o, uint8_t *v)
+{
+    const uint8_t ctl = M_DATA | M_READ;
+    uint8_t hi, lo;
+    bool ok;
+
+    ok = o->io->write1(o->addr, WinStarLCD::DIR, 0x78) >= 0
+        && o->io->write1(o->addr, WinStarLCD::GPIO, ctl | CLOCK_BIT) >= 0
+        && o->io->read(o->addr, WinStarLCD::GPIO, &hi) >= 0
+        && o->io->write1(o->addr, WinStarLCD::GPIO, ctl) >= 0
+        && o->io->write1(o->addr, WinStarLCD::GPIO, ctl | CLOCK_BIT) >= 0
+        && o->io->read(o->addr, WinStarLCD::GPIO, &lo) >= 0
+        && o->io->write1(o->addr, WinStarLCD::GPIO, ctl) >= 0;
+    o->io->write1(o->addr, WinStarLCD::DIR, 0x00);
+
+    *v = (((hi >> 3) & 0x0F) << 4) | ((lo >> 3) & 0x0F);
+    return ok;
+}
+
+
+/*! \brief Tells whether some output was not sent to the bus yet
+ */
+bool
+WinStarLCD::pending() const
+{
+    int i;
+
+    if(0 != _bufp)
+        return true;
+    if(!_writer_on)
+        return false;
+
+    for(i=0; i<_nlanes; ++i)
+        if(__atomic_load_n(&_lanes[i].tail, __ATOMIC_ACQUIRE) != _ring_head)
+            return true;
+    return false;
+}
+
+
+/*! \brief Reads one visible cell back from every panel and rewrites it
+ * where it differs from the shadow copy, e.g. after the controller was
+ * disturbed by ESD. Cells are visited in turn, the whole screen is checked
+ * after rows * cols calls. Nothing is done while output is pending or a
+ * frame is drawn, so the caller paces it into idle bus time. A read which
+ * fails is skipped: broken bus is noticed by the next write
+ * \retval false if nothing was checked
+ */
+bool
+WinStarLCD::scrub()
+{
+    lcd_output *o;
+    uint8_t a, v;
+    bool writer, done;
+    int i;
+
+    if(_frame || 0 == _nouts || pending())
+        return false;
+
+    if(_scrub_pos >= _rows * _cols)
+        _scrub_pos = 0;
+    a = cellAddr(_scrub_pos / _cols, _scrub_pos % _cols);
+    ++_scrub_pos;
+
+    /* Writer threads are idle, panels are written from here one by one */
+    writer = _writer_on;
+    _writer_on = false;
+
+    for(i=0, done=false; i<_nouts; ++i) {
+        o = _outs[i];
+        if(o->owner != this || __atomic_load_n(&o->failed, __ATOMIC_ACQUIRE))
+            continue;
+
+        _mask = 1 << i;
+        _ac_known = false;
+        command(0x80 | a);
+        flush();
+        if(!readCell(o, &v))
+            continue;
+
+        done = true;
+        ++_scrub_cells;
+        if(v == _ddram[a])
+            continue;
+
+        _ac_known = false;
+        command(0x80 | a);
+        data(_ddram[a]);
+        flush();
+        ++_scrub_fixed;
+    }
+
+    /* Address counters of the panels differ now */
+    _ac_known = false;
+    _mask = 0xFF;
+    _writer_on = writer;
+    return done;
+}
+
+
+/*! \brief Sets I2C address of the port extender, used by \c init()
+ * \param[in] addr 7-bit address, 0x20..0x27 for MCP23008
+ */
+void
+WinStarLCD::setAddress(uint8_t addr)
+{
+    _own.addr = addr;
+}
+
+
+/*! \brief Adds panel driven by another object, which makes this one a
+ * display group: everything drawn is sent to every panel. Panels on
+ * different buses are written in parallel when writer threads run.
+ * Must be called before \c startWriter()
+ * \param[in] o Output of a display, see \c output()
+ * \retval false if there are too many outputs or writer is running
+ */
+bool
+WinStarLCD::addOutput(lcd_output *o)
+{
+    if(LCD_MAX_OUTPUTS == _nouts || _writer_on)
+        return false;
+
+    _outs[_nouts++] = o;
+    setBurst();
+    return true;
+}
+
+
+/*! \brief Sets transport \c init() opens the bus with. Must be called
+ * before \c init(), by default the one of \c lcd_transport_create(NULL)
+ * is used
+ * \param[in] io Transport
+ * \param[in] own Delete transport with the object
+ */
+void
+WinStarLCD::setTransport(lcd_transport *io, bool own)
+{
+    drain();
+    if(_own_io)
+        delete _own.io;
+    _own.io = io;
+    _own_io = own;
+}
+
+
+/*! \brief Limits transaction length to what every output can take
+ */
+void
+WinStarLCD::setBurst()
+{
+    uint16_t n;
+    int i;
+
+    for(i=0, n=LCD_MAX_BURST; i<_nouts; ++i)
+        if(NULL != _outs[i]->io && _outs[i]->io->maxBurst() < n)
+            n = _outs[i]->io->maxBurst();
+
+    flush();
+    _burst = n;
+}
+
+
 /*! \brief Initializes object using I/O bus number
  * \param[in] busn Bus number. Can be obtained by calling \c CI2c::find_bus() call
  * \retval < 0 if and error was occured
  * \retval 0 if initialization was successful
  */
 int
-WinStarLCD::init(int busn)
+WinStarLCD::init(int busn, const state_t *st)
 {
-    if(_i2c.set_bus(busn) < 0)
-        return -1;
+    char bus[16];
 
-    _do_init();
-    return 0;
+    snprintf(bus, sizeof(bus), "%d", busn);
+    return init(bus, st);
 }
 
 
 /*! \brief Initializes object using symbolic I/O slot name
  * \param[in] busn Slot name, in form -S<num>, where <num> is integer in range 1..28 for LTPS3.
- *          For other types of LTPS please consult hardware manual
+ *          For other types of LTPS please consult hardware manual. Bus number
+ *          or /dev/i2c-N path for i2cdev transport, see lcd_transport.h
  * \retval < 0 if and error was occured
  * \retval 0 if initialization was successful
  */
 int
-WinStarLCD::init(const char *busn)
+WinStarLCD::init(const char *busn, const state_t *st)
 {
-    if(_i2c.set_bus(busn) < 0)
+    drain(); // Bus is changed and registers are written bypassing writer thread
+    if(NULL == _own.io) {
+        _own.io = lcd_transport_create(NULL);
+        _own_io = true;
+    }
+    if(_own.io->open(busn) < 0)
         return -1;
 
-    _do_init();
+    _own.failed = 0;
+    _own.retry_at = 0;
+    snprintf(_own.bus, sizeof(_own.bus), "%s", busn);
+    if(0 == _nouts)
+        _outs[_nouts++] = &_own;
+    setBurst();
+
+    if(validState(st))
+        _do_resume(st);
+    else
+        _do_init();
     return 0;
 }
 
 
-/*! \brief Flushes internal data buffer, by issuing atomic I2C transaction
+/*! \brief Checks if snapshot may be used to resume this display
+ * \param[in] st Snapshot, may be NULL
+ * \retval true if snapshot is complete and was taken with the same geometry
+ */
+bool
+WinStarLCD::validState(const state_t *st) const
+{
+    return NULL != st && LCD_STATE_MAGIC == st->magic && sizeof(state_t) == st->size
+        && 0 != st->valid && _cols == st->cols && _rows == st->rows;
+}
+
+
+/*! \brief Copies display state into snapshot, if it has changed since
+ * the previous call. Snapshot is marked invalid while being written, so
+ * interrupted copy is never used
+ * \param[out] st Snapshot
+ * \retval true if snapshot was updated
+ */
+bool
+WinStarLCD::saveState(state_t *st)
+{
+    if(!_dirty && validState(st))
+        return false;
+
+    st->valid = 0;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+
+    st->magic = LCD_STATE_MAGIC;
+    st->size = sizeof(state_t);
+    st->cols = _cols;
+    st->rows = _rows;
+    st->ac = _ac;
+    st->ac_cgram = _ac_cgram;
+    st->disp_ctl = _disp_ctl;
+    st->entry = _entry;
+    st->shift = _shift;
+    memcpy(st->ddram, _ddram, sizeof(st->ddram));
+    memcpy(st->cgram, _cgram, sizeof(st->cgram));
+    st->glyphs = _glyphs;
+    st->full_glyph = _full_glyph;
+    st->gdef_cnt = _gdef_cnt;
+    st->cg_cache = _cg_cache;
+    memcpy(st->bars, _bars, sizeof(st->bars));
+    memcpy(st->gdefs, _gdefs, sizeof(st->gdefs));
+    memcpy(st->cg_ucs, _cg_ucs, sizeof(st->cg_ucs));
+    memcpy(st->cg_stamp, _cg_stamp, sizeof(st->cg_stamp));
+    st->cg_clock = _cg_clock;
+
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    st->valid = 1;
+    _dirty = false;
+    return true;
+}
+
+
+/*! \brief Issues atomic I2C transaction to every panel, reporting each
+ * one to flush hook. Panels which share a bus through one transport get
+ * the message in a single combined transaction, if the transport can do it
+ * \param[in] msg GPIO register number followed by data
+ * \param[in] len Message length
+ * \param[in] queued Time the data was queued for writer thread (us), 0 if not
+ * \param[in] rx Time the data was received (us), 0 if not known
+ * \param[in] lane Writer lane: only panels on its bus are written. -1 for all
+ */
+void
+WinStarLCD::busWrite(const uint8_t *msg, uint8_t len, uint64_t queued, uint64_t rx, int lane)
+{
+    struct timespec t0, t1;
+    uint8_t addrs[LCD_MAX_OUTPUTS];
+    uint8_t idx[LCD_MAX_OUTPUTS];
+    lcd_output *o;
+    uint64_t start, end;
+    uint8_t todo;
+    int i, j, n, res;
+
+    /* Nibble order of failed panel is unknown, it waits for recover() */
+    for(i=0, todo=0; i<_nouts; ++i)
+        if((lane < 0 || _out_lane[i] == lane) && 0 != (_mask & (1 << i))
+                && !__atomic_load_n(&_outs[i]->failed, __ATOMIC_ACQUIRE))
+            todo |= 1 << i;
+
+    for(i=0; i<_nouts; ++i) {
+        if(0 == (todo & (1 << i)))
+            continue;
+
+        o = _outs[i];
+        for(j=i, n=0; j<_nouts; ++j)
+            if(0 != (todo & (1 << j)) && (j == i || o->io->sameBus(_outs[j]->io))) {
+                addrs[n] = _outs[j]->addr;
+                idx[n++] = j;
+                todo &= ~(1 << j);
+            }
+
+        if(NULL != _hook)
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+        res = (1 == n) ? o->io->write(o->addr, msg, len) : o->io->writeMulti(addrs, n, msg, len);
+        if(NULL != _hook) {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            start = (uint64_t)t0.tv_sec * 1000000 + t0.tv_nsec / 1000;
+            end = (uint64_t)t1.tv_sec * 1000000 + t1.tv_nsec / 1000;
+            _hook(_hook_ctx, (len - 1) * n, (0 == queued || start < queued) ? 0 : start - queued,
+                end - start, (0 == rx || end < rx) ? 0 : end - rx, res);
+        }
+
+        /* Combined transaction stops at the first panel which did not
+         * answer, the ones after it are re-initialized as well
+         */
+        if(res < 0)
+            for(j=0; j<n; ++j)
+                __atomic_store_n(&_outs[idx[j]]->failed, 1, __ATOMIC_RELEASE);
+    }
+}
+
+
+/*! \brief Flushes internal data buffer, by issuing atomic I2C transaction.
+ * When writer thread runs, the transaction is queued for it instead
  */
 void
 WinStarLCD::flush()
 {
-    if(0 != _bufp) {
-        _i2c.Wbb(_dev_addr, GPIO, _buf, _bufp);
+    struct timespec ts;
+    burst_t *b;
+    int i;
+
+    if(0 == _bufp)
+        return;
+
+    _dirty = true;
+    if(!_writer_on) {
+        busWrite(_buf, 1 + _bufp, 0, _rx, -1);
         _bufp = 0;
+        return;
+    }
+
+    while(0 != sem_wait(&_ring_free))
+        ; // EINTR
+
+    b = &_ring[_ring_head & (LCD_WRITER_SLOTS - 1)];
+    memcpy(b->data, _buf, 1 + _bufp);
+    b->len = 1 + _bufp;
+    b->refs = _nlanes;
+    b->rx = _rx;
+    b->queued = 0;
+    if(NULL != _hook) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        b->queued = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
     }
+
+    __atomic_store_n(&_ring_head, _ring_head + 1, __ATOMIC_SEQ_CST);
+    for(i=0; i<_nlanes; ++i)
+        sem_post(&_lanes[i].used);
+    _bufp = 0;
+}
+
+
+/*! \brief Installs function called after every I2C transaction
+ * \param[in] hook Function to call, NULL to remove
+ * \param[in] ctx Pointer passed to the function
+ */
+void
+WinStarLCD::setFlushHook(lcd_flush_hook_f hook, void *ctx)
+{
+    _hook = hook;
+    _hook_ctx = ctx;
+}
+
+
+/*! \brief Tells when the data drawn from now on was received, so flush hook
+ * gets its receive-to-glass time. Transactions keep the time when they are
+ * queued for writer thread
+ * \param[in] us CLOCK_MONOTONIC time in microseconds, 0 when it is not known
+ */
+void
+WinStarLCD::setReceived(uint64_t us)
+{
+    _rx = us;
 }
 
 
-/*! \brief Sends LCD command
+/*! \brief Checks if command would leave controller registers as they are
+ * \param[in] c Command byte
+ */
+bool
+WinStarLCD::redundant(uint8_t c) const
+{
+    if(0 != (c & 0x80))         // Set DDRAM address
+        return _ac_known && !_ac_cgram && _ac == (c & 0x7F);
+    if(0 != (c & 0x40))         // Set CGRAM address
+        return _ac_known && _ac_cgram && _ac == (c & 0x3F);
+    if(0 != (c & 0x20))         // Function set
+        return (c & 0xFC) == _func;
+    if(0 != (c & 0x10))         // Cursor or display shift
+        return false;
+    if(0 != (c & 0x08))         // Display control
+        return c == _disp_ctl;
+    if(0 != (c & 0x04))         // Entry mode
+        return c == _entry;
+    if(0x02 == (c & 0xFE))      // Return home
+        return _ac_known && !_ac_cgram && 0 == _ac && 0 == _shift;
+    return false;               // Clear
+}
+
+
+/*! \brief Moves address counter by one, as the controller does after data
+ * write or cursor shift. Two-line display DDRAM continues from the end of
+ * the first line to the second one and back
+ * \param[in] up Increment, decrement otherwise
+ */
+void
+WinStarLCD::stepAc(bool up)
+{
+    if(_ac_cgram)
+        _ac = (_ac + (up ? 1 : -1)) & 0x3F;
+    else if(up)
+        _ac = (0x27 == _ac) ? 0x40 : (0x67 == _ac) ? 0x00 : _ac + 1;
+    else
+        _ac = (0x40 == _ac) ? 0x27 : (0x00 == _ac) ? 0x67 : _ac - 1;
+}
+
+
+/*! \brief Sends LCD command. Commands which would not change controller
+ * state (address, display control, entry mode) are skipped
  * \param[in] c Command byte (see WinStar LCD documentation for more info)
  */
 void
@@ -149,14 +781,54 @@ WinStarLCD::command(uint8_t c)
 {
     uint8_t lo, hi;
 
+    if(redundant(c)) {
+        ++_skipped;
+        return;
+    }
+
     lo = c & 0x0F;
     hi = (c >> 4) & 0x0F;
 
-    if(_mode != M_COMMAND|M_WRITE)
-        flush();
-
+    /* RS line travels with every nibble, so commands and data may be mixed
+     * in one I2C transaction
+     */
     _mode = M_COMMAND | M_WRITE; // put display in command mode
 
+    /* Mirror controller registers */
+    if(0 != (c & 0x80)) {
+        _ac = c & 0x7F;
+        _ac_cgram = 0;
+        _ac_known = true;
+    } else if(0 != (c & 0x40)) {
+        _ac = c & 0x3F;
+        _ac_cgram = 1;
+        _ac_known = true;
+    } else if(0 != (c & 0x20)) {
+        _func = c & 0xFC;
+    } else if(0 != (c & 0x10)) {
+        if(0 == (c & 0x08))
+            stepAc(0 != (c & 0x04));
+        else
+            _shift = (_shift + ((c & 0x04) ? LCD_MAX_COLS - 1 : 1)) % LCD_MAX_COLS;
+    } else if(0 != (c & 0x08)) {
+        _disp_ctl = c;
+    } else if(0 != (c & 0x04)) {
+        _entry = c;
+    } else if(0x01 == c || 0x02 == (c & 0xFE)) {
+        _ac = 0;
+        _ac_cgram = 0;
+        _ac_known = true;
+        _shift = 0;
+        if(!_frame)
+            _page_offs = 0;
+        if(0x01 == c) {
+            memset(_ddram, ' ', sizeof(_ddram));
+            memset(_stale, 0, sizeof(_stale));
+            if(0xFF != _entry)
+                _entry |= 0x02; // Clear sets increment mode
+        }
+    }
+
     rawdata(_mode | (hi << 3));
     rawdata(_mode | (lo << 3));
 }
@@ -173,48 +845,277 @@ WinStarLCD::data(uint8_t v)
     lo = v & 0x0F;
     hi = (v >> 4) & 0x0F;
 
-    if(_mode != M_DATA|M_WRITE)
-        flush();
-
     _mode = M_DATA|M_WRITE; // put display in data mode
 
+    /* Address counter moves after each write, according to entry mode */
+    if(_ac_cgram) {
+        _cgram[_ac & 0x3F] = v;
+    } else {
+        _ddram[_ac & 0x7F] = v;
+        _stale[(_ac & 0x7F) >> 3] &= ~(1 << (_ac & 0x07));
+    }
+    stepAc(0 != (_entry & 0x02));
+
     rawdata(_mode | (hi << 3));
     rawdata(_mode | (lo << 3));
 }
 
 
-/*! \brief Clears LCD
+/*! \brief Clears LCD.
+ * Controller is busy for 1.52ms after this command, so it is sent in its own
+ * I2C transaction. Inside a frame only the page being drawn is cleared
  */
 void
 WinStarLCD::clear()
 {
+    if(_frame) {
+        fillRegion(0, 0, _cols, _rows);
+        setAddr(cellAddr(0, 0));
+        flush();
+        return;
+    }
+
     command(0x01);
+    flush();
 }
 
 
-/*! \brief Moves LCD cursor (visible or not) into home position (upper left corner)
+/*! \brief Moves LCD cursor (visible or not) into home position (upper left corner).
+ * Controller is busy for 1.52ms after this command, so it is sent in its own
+ * I2C transaction. When the second frame page is shown or being drawn,
+ * cursor is moved to its first cell instead, display is not shifted back
  */
 void
 WinStarLCD::home()
 {
+    if(_frame || 0 != _page_offs) {
+        setAddr(cellAddr(0, 0));
+        flush();
+        return;
+    }
+
     command(0x02);
+    flush();
 }
 
 
-/*! \brief Prints given string on the screen
+/*! \brief Prints given UTF-8 string on the screen
  * \param[in] str String to print
  */
 void
 WinStarLCD::echo(const char *str)
 {
-    int l;
-
     if(NULL != str)
-        for(l=strlen(str); l != 0; --l)
-            data(_cp1251_chr_map[*str++]);
+        echo(str, strlen(str));
+}
+
+
+/*! \brief Prints given UTF-8 string on the screen
+ * \param[in] str String to print, not necessary null-terminated
+ * \param[in] len String length in bytes
+ */
+void
+WinStarLCD::echo(const char *str, size_t len)
+{
+    uint8_t codes[64];
+    size_t n, used, i;
+    uint32_t since;
+
+    if(NULL == str)
+        return;
+
+    /* Glyphs loaded for earlier chunks are on screen already, chunks of
+     * the string must not evict them
+     */
+    since = ++_cg_clock;
+    while(0 != len) {
+        n = encodeSince(str, len, codes, sizeof(codes), &used, since);
+        for(i=0; i<n; ++i)
+            data(codes[i]);
+        str += used;
+        len -= used;
+    }
+}
+
+
+/*! \brief Translates UTF-8 string into character codes of display ROM.
+ * Pure ASCII runs are detected a machine word at a time and copied as is
+ * when ROM has all of ASCII, otherwise only bytes missing from the direct
+ * bitmap go through lookup. Code points which
+ * ROM lacks are drawn by glyphs registered with \c defineGlyph(), these are
+ * loaded into free CGRAM slots on demand. Anything else is shown as '?'.
+ * Bytes which do not form valid UTF-8 sequence are passed as is, so legacy
+ * clients sending ROM codes directly still work.
+ * \param[in] str String to translate
+ * \param[in] len String length in bytes
+ * \param[out] out Character codes
+ * \param[in] max Size of output buffer
+ * \param[out] used Number of input bytes consumed, may be NULL
+ * \retval Number of character codes stored
+ */
+size_t
+WinStarLCD::encode(const char *str, size_t len, uint8_t *out, size_t max, size_t *used)
+{
+    return encodeSince(str, len, out, max, used, ++_cg_clock);
+}
+
+
+/*! \brief Translates part of a string, see \c encode()
+ * \param[in] since Clock value at the start of the whole string: fallback
+ *          glyphs used since then are not evicted from CGRAM
+ */
+size_t
+WinStarLCD::encodeSince(const char *str, size_t len, uint8_t *out, size_t max, size_t *used, uint32_t since)
+{
+    const uint8_t *s = (const uint8_t *)str;
+    uint32_t ucs;
+    size_t i, n, run;
+    int c;
+
+    for(i=0, n=0; i < len && n < max; ) {
+        run = lcd_ascii_run(s + i, len - i);
+        if(run > max - n)
+            run = max - n;
+
+        if(_charset->ascii) {
+            memcpy(out + n, s + i, run);
+            n += run;
+            i += run;
+        } else {
+            for(; 0 != run; --run, ++i) {
+                if(0 != (_charset->direct[s[i] >> 5] & (1u << (s[i] & 0x1F)))) {
+                    out[n++] = s[i];
+                    continue;
+                }
+
+                c = lcd_charset_lookup(_charset, s[i]);
+                out[n++] = (c >= 0) ? c : fallbackGlyph(s[i], since);
+            }
+        }
+
+        if(i == len || n == max)
+            break;
+
+        run = lcd_utf8_decode(s + i, len - i, &ucs);
+        if(0 == run) {
+            out[n++] = s[i++];
+            continue;
+        }
+
+        c = lcd_charset_lookup(_charset, ucs);
+        out[n++] = (c >= 0) ? c : fallbackGlyph(ucs, since);
+        i += run;
+    }
+
+    if(NULL != used)
+        *used = i;
+    return n;
+}
+
+
+/*! \brief Returns character code of fallback glyph, loading it into CGRAM
+ * if necessary. Least recently used cached glyph is replaced when CGRAM is
+ * full, unless it was already used since given moment.
+ * \param[in] ucs Code point
+ * \param[in] since Clock value at the start of current string
+ */
+int
+WinStarLCD::fallbackGlyph(uint32_t ucs, uint32_t since)
+{
+    int i, j, slot;
+
+    for(i=0; i<_gdef_cnt; ++i)
+        if(_gdefs[i].ucs == ucs)
+            break;
+
+    if(i == _gdef_cnt)
+        return '?';
+
+    for(slot=0; slot<LCD_CGRAM_SIZE; ++slot)
+        if(0 != (_cg_cache & (1 << slot)) && _cg_ucs[slot] == ucs) {
+            _cg_stamp[slot] = _cg_clock;
+            return LCD_GLYPH_CHR(slot);
+        }
+
+    /* Not allocGlyph(): it would take any cached slot, even one shown by
+     * the current string
+     */
+    for(slot=0; slot<LCD_CGRAM_SIZE && 0 != (_glyphs & (1 << slot)); ++slot)
+        ;
+    if(LCD_CGRAM_SIZE == slot) {
+        for(j=0, slot=-1; j<LCD_CGRAM_SIZE; ++j)
+            if(0 != (_cg_cache & (1 << j)) && _cg_stamp[j] < since && (slot < 0 || _cg_stamp[j] < _cg_stamp[slot]))
+                slot = j;
+
+        if(slot < 0)
+            return '?';
+    }
+    _glyphs |= 1 << slot;
+
+    _cg_cache |= 1 << slot;
+    _cg_ucs[slot] = ucs;
+    _cg_stamp[slot] = _cg_clock;
+    setGlyph(slot, _gdefs[i].bitmap);
+
+    return LCD_GLYPH_CHR(slot);
+}
+
+
+/*! \brief Selects character generator ROM of the display
+ * \param[in] name Charset name: "A00", "A02" or "Cyrillic"
+ * \retval false if charset is unknown
+ */
+bool
+WinStarLCD::setCharset(const char *name)
+{
+    const lcd_charset *cs;
+
+    cs = lcd_find_charset(name);
+    if(NULL == cs)
+        return false;
+
+    _charset = cs;
+    return true;
+}
+
+
+/*! \brief Registers glyph used to draw character, which is missing in ROM
+ * \param[in] ucs Code point
+ * \param[in] bitmap 5x8 bitmap, see \c setGlyph()
+ * \retval false if glyph table is full
+ */
+bool
+WinStarLCD::defineGlyph(uint32_t ucs, const uint8_t *bitmap)
+{
+    int i, slot;
+
+    for(i=0; i<_gdef_cnt; ++i)
+        if(_gdefs[i].ucs == ucs)
+            break;
+
+    if(i == _gdef_cnt) {
+        if(LCD_MAX_GLYPH_DEFS == _gdef_cnt)
+            return false;
+        ++_gdef_cnt;
+    }
+
+    _gdefs[i].ucs = ucs;
+    memcpy(_gdefs[i].bitmap, bitmap, sizeof(_gdefs[i].bitmap));
+    _dirty = true;
+
+    /* Update glyph in place if it is on the screen already */
+    for(slot=0; slot<LCD_CGRAM_SIZE; ++slot)
+        if(0 != (_cg_cache & (1 << slot)) && _cg_ucs[slot] == ucs)
+            setGlyph(slot, bitmap);
+
+    return true;
 }
 
 
+/*! \brief Sets DDRAM address. Nothing is sent if address counter is there
+ * already
+ * \param[in] a DDRAM address
+ */
 void
 WinStarLCD::setAddr(uint8_t a)
 {
@@ -222,7 +1123,573 @@ WinStarLCD::setAddr(uint8_t a)
 }
 
 
+/*! \brief Translates DDRAM address given by client into the frame page
+ * drawing methods work with. Addresses past the page are left as they are
+ * \param[in] a DDRAM address of the first page
+ */
+uint8_t
+WinStarLCD::pageAddr(uint8_t a) const
+{
+    return ((a & 0x3F) < LCD_PAGE_COLS) ? a + _page_offs : a;
+}
+
+
+/*! \brief Shows or hides cursor at the current DDRAM address. Nothing is
+ * sent if cursor is in requested state already
+ * \param[in] show Show underline cursor
+ * \param[in] blink Blink the whole cell under cursor
+ */
+void
+WinStarLCD::showCursor(bool show, bool blink)
+{
+    command(0x0C | (show ? 0x02 : 0) | (blink ? 0x01 : 0));
+    flush();
+}
+
+
+/*! \brief Sets direction address counter moves in after each write.
+ * Nothing is sent if entry mode is the same
+ * \param[in] increment Move right, left otherwise
+ * \param[in] shift Shift display instead of moving cursor
+ */
+void
+WinStarLCD::setEntryMode(bool increment, bool shift)
+{
+    command(0x04 | (increment ? 0x02 : 0) | (shift ? 0x01 : 0));
+}
+
+
+/*! \brief Reserves one of CGRAM glyph slots. Slots caching fallback glyphs
+ * are taken over when there is no free one.
+ * \retval Slot number in range 0..LCD_CGRAM_SIZE-1
+ * \retval -1 if all slots are in use
+ */
+int
+WinStarLCD::allocGlyph()
+{
+    int i;
+
+    for(i=0; i<LCD_CGRAM_SIZE; ++i)
+        if(0 == (_glyphs & (1 << i))) {
+            _glyphs |= 1 << i;
+            return i;
+        }
+
+    for(i=0; i<LCD_CGRAM_SIZE; ++i)
+        if(0 != (_cg_cache & (1 << i))) {
+            _cg_cache &= ~(1 << i);
+            return i;
+        }
+
+    return -1;
+}
+
+
+/*! \brief Releases CGRAM glyph slot previously reserved by \c allocGlyph()
+ * \param[in] n Slot number
+ */
+void
+WinStarLCD::freeGlyph(uint8_t n)
+{
+    if(n < LCD_CGRAM_SIZE) {
+        _glyphs &= ~(1 << n);
+        _cg_cache &= ~(1 << n);
+        _dirty = true;
+    }
+}
+
+
+/*! \brief Loads 5x8 bitmap into CGRAM glyph slot.
+ * Glyph is shown by printing \c LCD_GLYPH_CHR(n) character. DDRAM address
+ * is restored afterwards
+ * \param[in] n Slot number
+ * \param[in] bitmap 8 rows, top to bottom, 5 least significant bits are used
+ */
+void
+WinStarLCD::setGlyph(uint8_t n, const uint8_t *bitmap)
+{
+    uint8_t ac = _ac, cg = _ac_cgram;
+    int i;
+
+    command(0x40 | ((n & 0x07) << 3));
+    for(i=0; i<8; ++i)
+        data(bitmap[i] & 0x1F);
+
+    if(!cg)
+        setAddr(ac);
+}
+
+
+/*! \brief Calculates DDRAM address of the cell
+ * \param[in] row Display row
+ * \param[in] col Display column
+ */
+uint8_t
+WinStarLCD::cellAddr(uint8_t row, uint8_t col) const
+{
+    return _row_offs[row % LCD_MAX_ROWS] + _page_offs + col;
+}
+
+
+/*! \brief Sets display size and derives DDRAM row addresses from it.
+ * Supported are one- and two-row panels up to 40 columns wide and four-row
+ * panels up to 20 columns wide (16x4 panels use their own row addresses).
+ * \param[in] cols Number of columns
+ * \param[in] rows Number of rows
+ * \retval false if geometry is not supported
+ */
+bool
+WinStarLCD::setGeometry(uint8_t cols, uint8_t rows)
+{
+    if(0 == cols || cols > LCD_MAX_COLS)
+        return false;
+    if((1 != rows && 2 != rows && 4 != rows) || (4 == rows && cols > 20))
+        return false;
+
+    _cols = cols;
+    _rows = rows;
+    _row_offs[0] = 0x00;
+    _row_offs[1] = 0x40;
+    _row_offs[2] = (16 == cols) ? 0x10 : 0x14;
+    _row_offs[3] = 0x40 + _row_offs[2];
+
+    return true;
+}
+
+
+/*! \brief Shifts display so that given DDRAM column is shown in the
+ * leftmost cell. Shift back to column 0 is a single return home command,
+ * otherwise the shortest run of shift commands is sent
+ * \param[in] col DDRAM column, 0..39
+ */
+void
+WinStarLCD::scrollTo(uint8_t col)
+{
+    uint8_t n;
+
+    if(col == _shift)
+        return;
+
+    if(0 == col) {
+        flush();
+        command(0x02);
+        flush();
+        return;
+    }
+
+    n = (col + LCD_MAX_COLS - _shift) % LCD_MAX_COLS;
+    if(n <= LCD_MAX_COLS / 2) {
+        for(; 0 != n; --n)
+            command(0x18);
+    } else {
+        for(n=LCD_MAX_COLS-n; 0 != n; --n)
+            command(0x1C);
+    }
+}
+
+
+/*! \brief Starts drawing a frame. Each DDRAM line holds 40 cells, panels
+ * up to 20 columns wide show only part of them, so there are two pages:
+ * columns 0..19 and 20..39. Drawing methods write into the hidden one
+ * until \c endFrame() shifts display onto it, so the panel never shows
+ * a half drawn frame. The hidden page starts as a copy of the shown one,
+ * and only cells which differ between them are sent for that.
+ * \retval false if panel is too wide or has more than two rows
+ */
+bool
+WinStarLCD::beginFrame()
+{
+    uint8_t r, front;
+
+    if(!framesSupported())
+        return false;
+    if(_frame)
+        return true;
+
+    front = _page_offs;
+    _page_offs = front ? 0 : LCD_PAGE_COLS;
+    _frame = true;
+
+    for(r=0; r<_rows; ++r)
+        putCells(r, 0, &_ddram[_row_offs[r] + front], _cols);
+    flush();
+    return true;
+}
+
+
+/*! \brief Shows frame started by \c beginFrame(). Bursts of the frame are
+ * queued before display shift, so with writer thread running the call
+ * returns at once and the next frame may be started while this one is
+ * still being sent
+ * \retval false if no frame was started
+ */
+bool
+WinStarLCD::endFrame()
+{
+    if(!_frame)
+        return false;
+
+    _frame = false;
+    flush();
+    scrollTo(_page_offs);
+    flush();
+    return true;
+}
+
+
+/*! \brief Moves cursor to given cell
+ * \param[in] row Display row
+ * \param[in] col Display column
+ */
+void
+WinStarLCD::setCursor(uint8_t row, uint8_t col)
+{
+    if(row < _rows && col < _cols)
+        setAddr(cellAddr(row, col));
+}
+
+
+/*! \brief Writes character codes into consecutive cells of one row.
+ * Cells which already show given character are skipped. Address is set
+ * only when the next changed cell is not where address counter points to,
+ * so contiguous changes go out as a single auto-incremented run.
+ * \param[in] row Display row
+ * \param[in] col First column
+ * \param[in] codes Character codes
+ * \param[in] n Number of cells, must fit into the row
+ */
+void
+WinStarLCD::putCells(uint8_t row, uint8_t col, const uint8_t *codes, uint8_t n)
+{
+    uint8_t a, i;
+
+    for(i=0, a=cellAddr(row, col); i<n; ++i, ++a) {
+        if(_ddram[a] == codes[i] && 0 == (_stale[a >> 3] & (1 << (a & 0x07))))
+            continue;
+        if(_ac_cgram || _ac != a)
+            setAddr(a);
+        data(codes[i]);
+    }
+}
+
+
+/*! \brief Prints UTF-8 text starting at given cell. Text is clipped at the
+ * end of the row. Cursor is left in unspecified position.
+ * \param[in] row Display row
+ * \param[in] col Display column
+ * \param[in] text Text to print
+ * \param[in] len Text length in bytes
+ */
+void
+WinStarLCD::writeAt(uint8_t row, uint8_t col, const char *text, size_t len)
+{
+    uint8_t codes[LCD_MAX_COLS];
+    size_t n;
+
+    if(row >= _rows || col >= _cols || NULL == text)
+        return;
+
+    n = encode(text, len, codes, _cols - col);
+    putCells(row, col, codes, n);
+    flush();
+}
+
+
+/*! \brief Replaces contents of the whole row with UTF-8 text. Text is
+ * padded with spaces according to requested alignment. Cursor is left in
+ * unspecified position
+ * \param[in] row Display row
+ * \param[in] text Text to print
+ * \param[in] how Text alignment
+ */
+void
+WinStarLCD::writeLine(uint8_t row, const char *text, align how)
+{
+    uint8_t codes[LCD_MAX_COLS], line[LCD_MAX_COLS];
+    size_t n, pad;
+
+    if(row >= _rows)
+        return;
+
+    n = (NULL == text) ? 0 : encode(text, strlen(text), codes, _cols);
+    if(ALIGN_RIGHT == how)
+        pad = _cols - n;
+    else if(ALIGN_CENTER == how)
+        pad = (_cols - n) / 2;
+    else
+        pad = 0;
+
+    memset(line, ' ', _cols);
+    memcpy(&line[pad], codes, n);
+    putCells(row, 0, line, _cols);
+    flush();
+}
+
+
+/*! \brief Reads character codes of consecutive cells of one row from the
+ * shadow copy of display memory
+ * \param[in] row Display row
+ * \param[in] col First column
+ * \param[out] codes Character codes
+ * \param[in] n Number of cells
+ * \retval Number of cells read, clipped at the end of the row
+ */
+uint8_t
+WinStarLCD::readCells(uint8_t row, uint8_t col, uint8_t *codes, uint8_t n) const
+{
+    if(row >= _rows || col >= _cols)
+        return 0;
+    if(n > _cols - col)
+        n = _cols - col;
+
+    memcpy(codes, &_ddram[cellAddr(row, col)], n);
+    return n;
+}
+
+
+/*! \brief Writes raw character codes into consecutive cells of one row,
+ * clipped at the end of the row. Cursor is left in unspecified position.
+ * \param[in] row Display row
+ * \param[in] col First column
+ * \param[in] codes Character codes
+ * \param[in] n Number of cells
+ */
+void
+WinStarLCD::writeCells(uint8_t row, uint8_t col, const uint8_t *codes, uint8_t n)
+{
+    if(row >= _rows || col >= _cols)
+        return;
+    if(n > _cols - col)
+        n = _cols - col;
+
+    putCells(row, col, codes, n);
+    flush();
+}
+
+
+/*! \brief Fills rectangular region with a character.
+ * Rows are visited in DDRAM order, so on four-row panels full-width fills
+ * of rows 0 and 2 (or 1 and 3) run through auto-increment without
+ * intermediate address commands. Cursor is left in unspecified position.
+ * \param[in] row Top row
+ * \param[in] col Left column
+ * \param[in] w Region width
+ * \param[in] h Region height
+ * \param[in] c ASCII character
+ */
+void
+WinStarLCD::fillRegion(uint8_t row, uint8_t col, uint8_t w, uint8_t h, char c)
+{
+    static const uint8_t order[LCD_MAX_ROWS] = { 0, 2, 1, 3 };
+    uint8_t codes[LCD_MAX_COLS];
+    uint8_t i, r;
+
+    if(row >= _rows || col >= _cols || 0 == w || 0 == h)
+        return;
+    if(w > _cols - col)
+        w = _cols - col;
+    if(h > _rows - row)
+        h = _rows - row;
+
+    encode(&c, 1, codes, 1);
+    memset(&codes[1], codes[0], w - 1);
+
+    for(i=0; i<LCD_MAX_ROWS; ++i) {
+        r = order[i];
+        if(r >= row && r < row + h)
+            putCells(r, col, codes, w);
+    }
+    flush();
+}
+
+
+/*! \brief Returns character shown in i-th cell of the bar having given value
+ * \param[in] b Bar
+ * \param[in] px Bar value in pixels
+ * \param[in] i Cell index, counting from the bar origin
+ */
+uint8_t
+WinStarLCD::barCell(const bar_t *b, uint16_t px, uint8_t i) const
+{
+    uint8_t step = (BAR_HORIZONTAL == b->dir) ? 5 : 8;
+
+    if(i < px / step)
+        return LCD_GLYPH_CHR(_full_glyph);
+    if(i == px / step && 0 != px % step)
+        return LCD_GLYPH_CHR(b->glyph);
+    return ' ';
+}
+
+
+/*! \brief Reloads bar's partial cell glyph, if it does not show given number
+ *  of pixels yet
+ * \param[in] b Bar
+ * \param[in] gpx Number of lit pixel columns (horizontal) or rows (vertical)
+ */
+void
+WinStarLCD::barGlyph(bar_t *b, uint8_t gpx)
+{
+    uint8_t bitmap[8];
+    int i;
+
+    if(0 == gpx || b->gpx == gpx)
+        return;
+
+    for(i=0; i<8; ++i) {
+        if(BAR_HORIZONTAL == b->dir)
+            bitmap[i] = (0x1F << (5 - gpx)) & 0x1F;
+        else
+            bitmap[i] = (i >= 8 - gpx) ? 0x1F : 0x00;
+    }
+
+    setGlyph(b->glyph, bitmap);
+    b->gpx = gpx;
+}
+
+
+/*! \brief Defines bar graph widget and draws it empty.
+ * Each bar occupies one CGRAM slot for its partial cell, and all bars share
+ * one more slot for fully lit cells, so up to \c LCD_MAX_BARS bars may exist.
+ * Cursor position is preserved.
+ * \param[in] id Bar number in range 0..LCD_MAX_BARS-1
+ * \param[in] dir Bar direction
+ * \param[in] row Row of the bar origin (leftmost or bottom cell)
+ * \param[in] col Column of the bar origin
+ * \param[in] len Bar length in cells
+ * \retval true if bar was defined
+ * \retval false if arguments are invalid or CGRAM is exhausted
+ */
+bool
+WinStarLCD::barDefine(uint8_t id, bar_dir dir, uint8_t row, uint8_t col, uint8_t len)
+{
+    static const uint8_t full[8] = { 0x1F, 0x1F, 0x1F, 0x1F, 0x1F, 0x1F, 0x1F, 0x1F };
+    bar_t *b;
+    bool own_full;
+    int g;
+    uint8_t i, ac;
+
+    if(id >= LCD_MAX_BARS || 0 == len || row >= _rows)
+        return false;
+    if(BAR_HORIZONTAL == dir && (col >= _cols || len > _cols - col))
+        return false;
+    if(BAR_VERTICAL == dir && len > row + 1)
+        return false;
+
+    barRemove(id);
+    b = &_bars[id];
+
+    own_full = _full_glyph < 0;
+    if(own_full) {
+        if((g = allocGlyph()) < 0)
+            return false;
+        _full_glyph = g;
+        setGlyph(g, full);
+    }
+
+    /* Shared slot taken above is not kept for a bar which does not exist */
+    if((g = allocGlyph()) < 0) {
+        if(own_full) {
+            freeGlyph(_full_glyph);
+            _full_glyph = -1;
+        }
+        return false;
+    }
+
+    b->used = 1;
+    b->dir = dir;
+    b->glyph = g;
+    b->gpx = 0;
+    b->row = row;
+    b->col = col;
+    b->len = len;
+    b->px = 0;
+
+    ac = _ac;
+    if(BAR_HORIZONTAL == dir) {
+        setAddr(cellAddr(row, col));
+        for(i=0; i<len; ++i)
+            data(' ');
+    } else {
+        for(i=0; i<len; ++i) {
+            setAddr(cellAddr(row - i, col));
+            data(' ');
+        }
+    }
+
+    if(_ac != ac)
+        setAddr(ac);
+    return true;
+}
+
+
+/*! \brief Updates bar value.
+ * Only cells which change their appearance are sent to the display. When the
+ * value moves within the same cell, only the partial glyph is reloaded.
+ * Cursor position is preserved.
+ * \param[in] id Bar number
+ * \param[in] px New value in pixels. It is clamped to the bar length
+ */
 void
-WinStarLCD::showCursor(bool)
+WinStarLCD::barSet(uint8_t id, uint16_t px)
 {
+    bar_t *b;
+    uint8_t step, i, c, ac;
+    int next;
+
+    if(id >= LCD_MAX_BARS || !_bars[id].used)
+        return;
+
+    b = &_bars[id];
+    step = (BAR_HORIZONTAL == b->dir) ? 5 : 8;
+    if(px > b->len * step)
+        px = b->len * step;
+
+    if(px == b->px)
+        return;
+
+    ac = _ac;
+    barGlyph(b, px % step);
+
+    for(i=0, next=-1; i<b->len; ++i) {
+        c = barCell(b, px, i);
+        if(c == barCell(b, b->px, i))
+            continue;
+
+        /* Horizontal neighbours are written using address auto-increment */
+        if(BAR_VERTICAL == b->dir)
+            setAddr(cellAddr(b->row - i, b->col));
+        else if(next != i)
+            setAddr(cellAddr(b->row, b->col + i));
+
+        data(c);
+        next = i + 1;
+    }
+
+    if(_ac != ac)
+        setAddr(ac);
+    b->px = px;
+}
+
+
+/*! \brief Deletes bar and releases its CGRAM slot. Bar cells are left intact
+ * \param[in] id Bar number
+ */
+void
+WinStarLCD::barRemove(uint8_t id)
+{
+    int i;
+
+    if(id >= LCD_MAX_BARS || !_bars[id].used)
+        return;
+
+    freeGlyph(_bars[id].glyph);
+    _bars[id].used = 0;
+
+    for(i=0; i<LCD_MAX_BARS; ++i)
+        if(_bars[i].used)
+            return;
+
+    /* No more bars, release shared glyph too */
+    freeGlyph(_full_glyph);
+    _full_glyph = -1;
 }